@@ -21,10 +21,25 @@ spin:
     cmp rax, 0x10000000
     je deadlock
     pause
+    cmp dword [rel shootdown_pending], 0 ; The holder might be waiting for us to flush, and with interrupts off the IPI can't get here
+    jne spin_shootdown
+spin_check:
     test dword [rdi], 1 ; This will set the ZF if the bitwise and results in 0
     jnz spin ; If the lock is locked, keep spinning
     jmp spinlock_lock ; If the lock is unlocked, try to acquire it again
 
+extern shootdown_pending
+extern vmm_shootdown_poll
+spin_shootdown:
+    push rdi
+    push rax
+    sub rsp, 8 ; align the stack
+    call vmm_shootdown_poll
+    add rsp, 8
+    pop rax
+    pop rdi
+    jmp spin_check
+
 spinlock_unlock:
     lock btr dword [rdi], 0 ; Set the bit to 0
     ret
@@ -0,0 +1,71 @@
+[bits 64]
+
+section .text
+
+global memcpy_from_userspace
+global memcpy_to_userspace
+global strcpy_from_userspace
+global strlen_from_userspace
+
+; Copies to and from userspace pointers without checking the page tables
+; first. If one of the instructions listed in .extable faults, the fault
+; handler resumes at the matching fixup instead of panicking.
+
+; uint64_t memcpy_from_userspace(void *dst, void *src, uint64_t byte_count)
+; uint64_t memcpy_to_userspace(void *dst, void *src, uint64_t byte_count)
+; Returns the amount of bytes that were NOT copied, so 0 on success
+memcpy_from_userspace:
+memcpy_to_userspace:
+    mov rcx, rdx
+user_memcpy_access:
+    rep movsb
+    xor rax, rax
+    ret
+user_memcpy_fixup:
+    mov rax, rcx ; A faulting rep movsb leaves the bytes left in rcx
+    ret
+
+; int64_t strcpy_from_userspace(char *dst, char *src, uint64_t max)
+; Copies a string including the null, up to max bytes. Returns the length
+; without the null, or -1 on a fault or if there was no null in max bytes
+strcpy_from_userspace:
+    xor rax, rax
+user_strcpy_loop:
+    cmp rax, rdx
+    je user_strcpy_fixup
+user_strcpy_access:
+    mov cl, byte [rsi + rax]
+    mov byte [rdi + rax], cl
+    test cl, cl
+    jz user_strcpy_done
+    inc rax
+    jmp user_strcpy_loop
+user_strcpy_done:
+    ret
+user_strcpy_fixup:
+    mov rax, -1
+    ret
+
+; int64_t strlen_from_userspace(char *str, uint64_t max)
+; Same as above, without copying anything
+strlen_from_userspace:
+    xor rax, rax
+user_strlen_loop:
+    cmp rax, rsi
+    je user_strlen_fixup
+user_strlen_access:
+    cmp byte [rdi + rax], 0
+    je user_strlen_done
+    inc rax
+    jmp user_strlen_loop
+user_strlen_done:
+    ret
+user_strlen_fixup:
+    mov rax, -1
+    ret
+
+; Faulting instruction, where to continue
+section .extable progbits alloc noexec nowrite align=8
+    dq user_memcpy_access, user_memcpy_fixup
+    dq user_strcpy_access, user_strcpy_fixup
+    dq user_strlen_access, user_strlen_fixup
@@ -105,9 +105,11 @@ loaded_cs:
     mov rax, cr0
     and ax, 0xFFFB
     or ax, 0x2
+    or rax, 1 << 16 ; Write protect, so kernel writes to COW pages fault too
     mov cr0, rax
     mov rax, cr4
     or ax, 3 << 9
+    or ax, 1 << 7 ; Global pages, kernel half entries stay in the TLB across CR3 loads
     mov cr4, rax
 
     call kmain
\ No newline at end of file
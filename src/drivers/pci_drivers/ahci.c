@@ -260,7 +260,7 @@ static ahci_command_slot_t ahci_allocate_command_slot(ahci_port_data_t *port, ui
         return ret;
     }
 
-    ahci_command_entry_t *command_entry = pmm_alloc(fis_size);
+    ahci_command_entry_t *command_entry = pmm_try_alloc(fis_size);
     if (!command_entry) {
         return ret;
     }
@@ -592,7 +592,10 @@ int ahci_read_sata_bytes(ahci_port_data_t *port, void *buf, uint64_t count, uint
         return 6; // Not enough bytes
     }
 
-    uint8_t *data_buf = pmm_alloc(sector_count * port->sector_size);
+    uint8_t *data_buf = pmm_try_alloc(sector_count * port->sector_size);
+    if (!data_buf) {
+        return 7; // No contiguous memory for the transfer
+    }
     int err = ahci_io_sata_sectors(port, data_buf, sector_count, sector_start, 0);
     
     if (err) {
@@ -620,7 +623,10 @@ int ahci_write_sata_bytes(ahci_port_data_t *port, void *buf, uint64_t count, uin
         return 6; // Not enough bytes
     }
 
-    uint8_t *data_buf_temp = pmm_alloc(sector_count * port->sector_size);
+    uint8_t *data_buf_temp = pmm_try_alloc(sector_count * port->sector_size);
+    if (!data_buf_temp) {
+        return 7; // No contiguous memory for the transfer
+    }
     uint8_t *data_buf_end_area = data_buf_temp + ((sector_count - 1) * port->sector_size);
 
     /* Errors */
@@ -658,7 +664,6 @@ int ahci_io_sata_sectors(ahci_port_data_t *port, void *buf, uint16_t count, uint
     if (command_slot.index == -1) {
         kprintf("[AHCI] No command slot!\n");
 
-        ahci_free_command_slot(command_slot.data, AHCI_GET_FIS_SIZE(prdt_count + 1));
         unlock(ahci_lock);
         return 1;
     }
@@ -5,17 +5,14 @@
 #include "drivers/tty/tty.h"
 #include "klibc/stdlib.h"
 #include "proc/scheduler.h"
-#include "proc/sleep_queue.h"
+#include "sys/timer.h"
 
 volatile uint64_t global_ticks = 0;
 
+/* Only runs at boot, until the TSC is calibrated and the PIT stopped */
 void timer_handler(int_reg_t *r) {
     global_ticks++;
-    advance_time(); // Sleep queue
-
-    if (global_ticks % sched_period == 0 && scheduler_enabled) {
-        schedule_bsp(r);
-    }
+    UNUSED(r);
 }
 
 void set_pit_freq() {
@@ -32,20 +29,30 @@ void set_pit_freq() {
     port_outb(0x40, high); /* High byte of the frequency */
 }
 
+/* One shot mode with no count written, so it never fires again */
+void pit_stop() {
+    port_outb(0x43, 0x30);
+}
+
 void sleep_no_task(uint64_t ticks) {
+    if (timer_calibrated) {
+        timer_udelay(ticks * 1000);
+        return;
+    }
+
     volatile uint64_t start_ticks = global_ticks;
     while (global_ticks < ticks + start_ticks) asm volatile("pause");
 }
 
 uint64_t stopwatch_start() {
-    return global_ticks;
+    return timer_now_ms();
 }
 
 uint64_t stopwatch_stop(uint64_t start) {
-    return (global_ticks - start);
+    return (timer_now_ms() - start);
 }
 
 void time_code(uint64_t *start, char *description) {
-    sprintf("%s Took: %lu\n", description, global_ticks - *start);
-    *start = global_ticks;
+    sprintf("%s Took: %lu\n", description, timer_now_ms() - *start);
+    *start = timer_now_ms();
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "vesa.h"
 #include "mm/vmm.h"
+#include "mm/vmalloc.h"
 #include "klibc/stdlib.h"
 #include "klibc/string.h"
 #include "klibc/lock.h"
@@ -30,7 +31,7 @@ void init_vesa(stivale_info_t *bootloader_info) {
     vesa_display_info.green_shift = 8;
     vesa_display_info.blue_shift  = 0;
     /* Framebuffer address */
-    vesa_display_info.framebuffer = (uint32_t *) kcalloc(vesa_display_info.framebuffer_size);
+    vesa_display_info.framebuffer = (uint32_t *) vmalloc(vesa_display_info.framebuffer_size);
     vesa_display_info.actual_framebuffer = (uint32_t *) (bootloader_info->framebuffer_addr + NORMAL_VMA_OFFSET);
 
     /* Map the real framebuffer and as write combining */
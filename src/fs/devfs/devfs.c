@@ -6,6 +6,7 @@
 
 /* Devices we want to register */
 #include "drivers/vesa.h"
+#include "mm/memstat.h"
 
 vfs_node_t *devfs_root;
 hashmap_t *devfs_hashmap;
@@ -27,6 +28,7 @@ int devfs_file_exists(vfs_node_t *root_node, char *path) {
 
 void register_devices() {
     setup_vesa_device();
+    setup_memstat_device();
 }
 
 void devfs_init() {
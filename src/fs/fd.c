@@ -11,6 +11,7 @@
 #include "drivers/serial.h"
 
 lock_t fd_lock = {0, 0, 0, 0};
+slab_cache_t fd_entry_cache = SLAB_CACHE_INIT("fd_entry_t", sizeof(fd_entry_t));
 
 int fd_open(char *filepath, int mode) {
     char *kernel_string = check_and_copy_string(filepath);
@@ -66,9 +67,79 @@ int fd_close(int fd) {
     return ret;
 }
 
+/* Userspace buffers go through a kernel bounce buffer in chunks, so a bad
+   pointer is caught by the copy instead of faulting inside a driver. The
+   caller checks the range, since ignore_ring is set by then */
+static int fd_user_read(int fd, void *buf, uint64_t count) {
+    if (!count) {
+        return 0;
+    }
+
+    uint8_t *bounce = kmalloc(count < FD_COPY_CHUNK ? count : FD_COPY_CHUNK);
+    uint64_t done = 0;
+    int ret = 0;
+
+    while (done < count) {
+        uint64_t chunk = count - done < FD_COPY_CHUNK ? count - done : FD_COPY_CHUNK;
+        int read = vfs_read(fd, bounce, chunk);
+        if (read < 0) {
+            ret = read;
+            break;
+        }
+
+        if (memcpy_to_userspace((uint8_t *) buf + done, bounce, read)) {
+            ret = -EFAULT;
+            break;
+        }
+
+        done += read;
+        if ((uint64_t) read < chunk) {
+            break; // Short read, don't block for more
+        }
+    }
+
+    kfree(bounce);
+    return done ? (int) done : ret;
+}
+
+static int fd_user_write(int fd, void *buf, uint64_t count) {
+    if (!count) {
+        return 0;
+    }
+
+    uint8_t *bounce = kmalloc(count < FD_COPY_CHUNK ? count : FD_COPY_CHUNK);
+    uint64_t done = 0;
+    int ret = 0;
+
+    while (done < count) {
+        uint64_t chunk = count - done < FD_COPY_CHUNK ? count - done : FD_COPY_CHUNK;
+        if (memcpy_from_userspace(bounce, (uint8_t *) buf + done, chunk)) {
+            ret = -EFAULT;
+            break;
+        }
+
+        int written = vfs_write(fd, bounce, chunk);
+        if (written < 0) {
+            ret = written;
+            break;
+        }
+
+        done += written;
+        if ((uint64_t) written < chunk) {
+            break;
+        }
+    }
+
+    kfree(bounce);
+    return done ? (int) done : ret;
+}
+
 int fd_read(int fd, void *buf, uint64_t count) {
     int set_ignore = 0;
     if (get_cur_thread()->ring == 3 && !get_cpu_locals()->ignore_ring) {
+        if (!userspace_range_ok(buf, count)) {
+            return -EFAULT; // Checked now, ignore_ring would let anything through
+        }
         get_cpu_locals()->ignore_ring = 1;
         set_ignore = 1;
     }
@@ -80,16 +151,14 @@ int fd_read(int fd, void *buf, uint64_t count) {
         return -EBADF;
     }
 
-    if (!range_mapped(buf, count)) {
-        if (set_ignore)
-            get_cpu_locals()->ignore_ring = 0;
-        return -EBADF;
-    }
-
-
-    int read = vfs_read(fd, buf, count);
-    if (set_ignore)
+    int read;
+    if (set_ignore) {
+        /* Userspace buffer, read into the kernel and copy it out */
+        read = fd_user_read(fd, buf, count);
         get_cpu_locals()->ignore_ring = 0;
+    } else {
+        read = vfs_read(fd, buf, count);
+    }
 
     return read;
 }
@@ -97,6 +166,9 @@ int fd_read(int fd, void *buf, uint64_t count) {
 int fd_write(int fd, void *buf, uint64_t count) {
     int set_ignore = 0;
     if (get_cur_thread()->ring == 3 && !get_cpu_locals()->ignore_ring) {
+        if (!userspace_range_ok(buf, count)) {
+            return -EFAULT; // Checked now, ignore_ring would let anything through
+        }
         get_cpu_locals()->ignore_ring = 1;
         set_ignore = 1;
     }
@@ -108,15 +180,13 @@ int fd_write(int fd, void *buf, uint64_t count) {
         return -EBADF;
     }
 
-    if (!range_mapped(buf, count)) {
-        if (set_ignore)
-            get_cpu_locals()->ignore_ring = 0;
-        return -EFAULT;
-    }
-
-    int ret = vfs_write(fd, buf, count);
-    if (set_ignore)
+    int ret;
+    if (set_ignore) {
+        ret = fd_user_write(fd, buf, count);
         get_cpu_locals()->ignore_ring = 0;
+    } else {
+        ret = vfs_write(fd, buf, count);
+    }
     return ret;
 }
 
@@ -169,7 +239,7 @@ int fd_new(vfs_node_t *node, int mode, int pid) {
     fd_entry_t **fd_table = current_process->fd_table;
     int *fd_table_size = &current_process->fd_table_size;
 
-    fd_entry_t *new_entry = kcalloc(sizeof(fd_entry_t));
+    fd_entry_t *new_entry = slab_alloc(&fd_entry_cache);
     new_entry->node = node;
     new_entry->mode = mode;
     new_entry->seek = 0;
@@ -294,7 +364,7 @@ void clone_fds(int64_t old_pid, int64_t new_pid) {
 
     for (int i = 0; i < old->fd_table_size; i++) {
         if (old->fd_table[i]) {
-            fd_entry_t *new_fd = kcalloc(sizeof(fd_entry_t));
+            fd_entry_t *new_fd = slab_alloc(&fd_entry_cache);
             new_fd->node = old->fd_table[i]->node;
             new_fd->mode = old->fd_table[i]->mode;
             new_fd->seek = old->fd_table[i]->seek;
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include "vfs/vfs.h"
 #include "klibc/lock.h"
+#include "mm/slab.h"
 
 #define FD_COOKIE_VAL 0x1111222233334444
 
@@ -10,6 +11,8 @@
 #define SEEK_END 2
 #define SEEK_SET 3
 
+#define FD_COPY_CHUNK 0x10000
+
 typedef struct fd_entry {
     uint64_t fd_cookie1;
     vfs_node_t *node;
@@ -21,6 +24,7 @@ typedef struct fd_entry {
 } fd_entry_t;
 
 extern lock_t fd_lock;
+extern slab_cache_t fd_entry_cache;
 
 struct vfs_node;
 typedef struct vfs_node vfs_node_t;
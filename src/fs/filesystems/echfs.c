@@ -12,6 +12,7 @@
 #include "fs/filesystems/filesystems.h"
 
 #include "mm/pmm.h"
+#include "mm/vmalloc.h"
 
 #include "drivers/pit.h"
 #include "drivers/rtc.h"
@@ -221,7 +222,7 @@ uint64_t find_free_block(echfs_filesystem_t *filesystem) {
 
 /* Read a file */
 void *echfs_read_file(echfs_filesystem_t *filesystem, echfs_dir_entry_t *file, uint64_t *read_count) {
-    uint8_t *data = kcalloc(ROUND_UP(file->file_size_bytes, filesystem->block_size));
+    uint8_t *data = vmalloc(ROUND_UP(file->file_size_bytes, filesystem->block_size));
     uint64_t current_block = file->starting_block;
     uint64_t byte_offset = 0;
     *read_count = file->file_size_bytes;
@@ -429,7 +430,7 @@ void *read_blocks_for_range(echfs_filesystem_t *filesystem, echfs_dir_entry_t *f
     uint64_t blocks_to_read = (end - start) / filesystem->block_size;
     uint64_t start_block = start / filesystem->block_size;
     uint64_t current_block = file->starting_block;
-    uint8_t *block_buffer = kcalloc(blocks_to_read * filesystem->block_size);
+    uint8_t *block_buffer = kcalloc(blocks_to_read * filesystem->block_size); // Short lived, vfree would cost a shootdown
     uint8_t *current_blockbuf_pointer = block_buffer;
 
     for (uint64_t i = 0; i < start_block; i++) {
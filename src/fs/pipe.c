@@ -1,9 +1,11 @@
 #include "pipe.h"
 #include "klibc/stdlib.h"
+#include "klibc/math.h"
 #include "klibc/errno.h"
 #include "klibc/logger.h"
 #include "sys/smp.h"
 #include "fd.h"
+#include "mm/vmalloc.h"
 #include <stddef.h>
 
 uint64_t pipes_size = 0;
@@ -26,7 +28,7 @@ void create_pipe(int cur_fd, int remote_fd, int other_pid, int direction) {
     }
 
     pipes[index] = kcalloc(sizeof(pipe_t));
-    pipes[index]->buffer = kcalloc(PIPE_DEFAULT_BUFFER_SIZE);
+    pipes[index]->buffer = vmalloc(PIPE_DEFAULT_BUFFER_SIZE);
     pipes[index]->buffer_size = PIPE_DEFAULT_BUFFER_SIZE;
     pipes[index]->creator_fd = cur_fd;
     pipes[index]->creator_pid = get_cur_pid();
@@ -109,11 +111,11 @@ int pipe_write(int fd, void *buf, uint64_t count) {
 
     lock(pipe_lock);
     if (pipe->buffer_size - (pipe->write_pointer - pipe->buffer) < count) {
-        uint64_t new_bytes = (((count - (pipe->buffer_size - (pipe->write_pointer - pipe->buffer))) + 1) + 0x1000 - 1) / 0x1000;
+        uint64_t new_bytes = ROUND_UP((count - (pipe->buffer_size - (pipe->write_pointer - pipe->buffer))) + 1, 0x1000);
         uint64_t write_offset = pipe->write_pointer - pipe->buffer;
         uint64_t read_offset = pipe->read_pointer - pipe->buffer;
 
-        pipe->buffer = krealloc(pipe->buffer, pipe->buffer_size + new_bytes);
+        pipe->buffer = vrealloc(pipe->buffer, pipe->buffer_size + new_bytes);
         pipe->buffer_size += new_bytes;
         pipe->write_pointer = pipe->buffer + write_offset;
         pipe->read_pointer = pipe->buffer + read_offset;
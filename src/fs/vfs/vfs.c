@@ -15,8 +15,10 @@
 #include "drivers/serial.h"
 #include "mm/vmm.h"
 #include "mm/pmm.h"
+#include "mm/slab.h"
 
 vfs_node_t *root_node;
+static slab_cache_t vfs_node_cache = SLAB_CACHE_INIT("vfs_node_t", sizeof(vfs_node_t));
 
 lock_t vfs_lock = {0, 0, 0, 0};
 lock_t vfs_open_lock = {0, 0, 0, 0}; // Opening files can be a bit hectic on multicore
@@ -137,7 +139,7 @@ void dummy_node_handle(vfs_node_t *_1, vfs_node_t *_2, char *_3) {
 
 /* Setting up the root node */
 void vfs_init() {
-    root_node = kcalloc(sizeof(vfs_node_t));
+    root_node = slab_alloc(&vfs_node_cache);
     root_node->children_array_size = 10;
     root_node->children = kcalloc(10 * sizeof(vfs_node_t *));
     root_node->node_handle = dummy_node_handle; // root node should have a node handler to prevent death
@@ -147,7 +149,7 @@ void vfs_init() {
 /* Creating a new VFS node */
 vfs_node_t *vfs_new_node(char *name, vfs_ops_t ops) {
     /* Allocate the space for the new array */
-    vfs_node_t *node = kcalloc(sizeof(vfs_node_t));
+    vfs_node_t *node = slab_alloc(&vfs_node_cache);
     node->children_array_size = 10;
     node->children = kcalloc(10 * sizeof(vfs_node_t *));
 
@@ -2,6 +2,7 @@
 #include <stddef.h>
 
 #include "mm/pmm.h"
+#include "mm/vmalloc.h"
 
 #include "fs/vfs/vfs.h"
 #include "fs/devfs/devfs.h"
@@ -9,6 +10,8 @@
 #include "fs/pipe.h"
 
 #include "sys/apic.h"
+#include "sys/timer.h"
+#include "sys/acpi/srat.h"
 #include "sys/int/isr.h"
 
 #include "klibc/stdlib.h"
@@ -95,7 +98,10 @@ void kernel_task() {
     log("Starting kernel process and userspace request monitor thread under kernel process.");
     new_kernel_process("Kernel process", kernel_process);
     thread_t *urm = create_thread("URM", urm_thread, (uint64_t) kcalloc(TASK_STACK_SIZE) + TASK_STACK_SIZE, 0);
+    sched_set_policy(urm, SCHED_POLICY_FAIR, SCHED_NICE_SERVICE); // Not queued yet, so no lock needed
     add_new_child_thread(urm, 0);
+    thread_t *reclaim = create_thread("Reclaim", vmm_reclaim_thread, (uint64_t) kcalloc(TASK_STACK_SIZE) + TASK_STACK_SIZE, 0);
+    add_new_child_thread(reclaim, 0);
     log("URM started and kernel process started, exiting kernel_task.");
 
     kill_task(get_cur_thread()->tid); // suicide
@@ -112,6 +118,7 @@ void kmain(stivale_info_t *bootloader_info) {
 
     if (bootloader_info) {
         pmm_memory_setup(bootloader_info);
+        vmalloc_init();
         log("PMM enabled, virtual memory set up.");
     }
 
@@ -128,10 +135,15 @@ void kmain(stivale_info_t *bootloader_info) {
     configure_apic();
     log("APIC configured and routed.");
 
+    numa_init();
+    log("NUMA nodes set up.");
+
     new_cpu_locals(); // Setup CPU locals for our CPU
     get_cpu_locals()->apic_id = get_lapic_id();
     get_cpu_locals()->cpu_index = 0;
+    get_cpu_locals()->numa_node = pmm_cpu_node(get_cpu_locals()->apic_id);
     hashmap_set_elem(cpu_locals_list, 0, get_cpu_locals());
+    vmm_pcid_init();
 
     load_tss();
     set_panic_stack((uint64_t) kmalloc(0x1000) + 0x1000);
@@ -143,6 +155,9 @@ void kmain(stivale_info_t *bootloader_info) {
     set_pit_freq();
     log("PIT enabled at 1000hz.");
 
+    timer_calibrate();
+    log("TSC and LAPIC timer calibrated, PIT stopped.");
+
     scheduler_init_bsp();
 
     thread_t *kernel_thread = create_thread("Kernel setup worker", kernel_task, 
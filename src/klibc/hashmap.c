@@ -2,6 +2,9 @@
 #include "klibc/stdlib.h"
 #include "klibc/linked_list.h"
 #include "klibc/string.h"
+#include "mm/slab.h"
+
+static slab_cache_t hashmap_elem_cache = SLAB_CACHE_INIT("hashmap_elem_t", sizeof(hashmap_elem_t));
 
 static uint64_t get_bucket_from_hash(uint64_t hash) {
     return hash % HASHMAP_BUCKET_SIZE;
@@ -86,7 +89,7 @@ void hashmap_set_elem(hashmap_t *hashmap, uint64_t key, void *data) {
         hashmap_unref_elem(elem);
     } else {
         uint64_t bucket = get_bucket_from_hash(key);
-        hashmap_elem_t *elem = kcalloc(sizeof(hashmap_elem_t));
+        hashmap_elem_t *elem = slab_alloc(&hashmap_elem_cache);
         elem->data = data;
         elem->key = key;
         elem->ref_count = 1;
@@ -7,6 +7,4 @@ void log(char *message, ...);
 void warn(char *message, ...);
 void error(char *message, ...);
 
-void log_alloc(char *message, ...);
-
 #endif
\ No newline at end of file
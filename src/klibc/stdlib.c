@@ -2,6 +2,8 @@
 #include "string.h"
 #include "mm/pmm.h"
 #include "mm/vmm.h"
+#include "mm/slab.h"
+#include "mm/memstat.h"
 #include "proc/scheduler.h"
 #include "klibc/lock.h"
 #include "klibc/logger.h"
@@ -9,7 +11,10 @@
 #include "drivers/tty/tty.h"
 #include "drivers/serial.h"
 
-void *kmalloc(uint64_t size) {
+#ifdef KMALLOC_GUARD
+/* Debug heap: every allocation gets its own pages, with unmapped guard pages
+   on both sides to catch out of bounds accesses */
+static void *kmalloc_caller(uint64_t size, uint64_t caller) {
     interrupt_state_t state = interrupt_lock();
     uint64_t size_data = (uint64_t) pmm_alloc(size + 0x2000) + NORMAL_VMA_OFFSET;
     uint64_t page_count = ((size + 0x2000) + 0x1000 - 1) / 0x1000;
@@ -20,19 +25,25 @@ void *kmalloc(uint64_t size) {
     *(uint64_t *) size_data = size + 0x2000;
     *(uint64_t *) (size_data + 8) = MALLOC_SIGNATURE;
 
-    log_alloc("+mem %lu %lu %lx\n", size_data, *(uint64_t *) size_data, __builtin_return_address(0));
-
     /* Unmap size data for low OOB reads/writes */
     vmm_unmap((void *) size_data, 1);
     interrupt_unlock(state);
 
     if (size_data % 0x1000 != 0) {
-        error("{-kmalloc-} died, caller: %lx, size: %lu\n", __builtin_return_address(0), size);
+        error("{-kmalloc-} died, caller: %lx, size: %lu\n", caller, size);
         assert(!"kmalloc bug");
     }
+
+    if (memstat_profiling) {
+        memstat_record_alloc(caller, size);
+    }
     return (void *) (size_data + 0x1000);
 }
 
+void *kmalloc(uint64_t size) {
+    return kmalloc_caller(size, (uint64_t) __builtin_return_address(0));
+}
+
 //void *cur_pain = (void *) 0;
 // 727
 void kfree(void *addr) {
@@ -62,7 +73,9 @@ void kfree(void *addr) {
 
     void *phys = virt_to_phys((void *) size_data, (page_table_t *) vmm_get_base());
     if ((uint64_t) phys != 0xFFFFFFFFFFFFFFFF) {
-        log_alloc("-mem %lu %lu %lx\n", size_data, *size_data, __builtin_return_address(0));
+        if (memstat_profiling) {
+            memstat_record_free((uint64_t) __builtin_return_address(0), *size_data - 0x2000);
+        }
         pmm_unalloc(phys, *size_data);
     }
 
@@ -95,30 +108,170 @@ void remap_alloc(void *addr) {
     interrupt_unlock(state);
 }
 
-void *kcalloc(uint64_t size) {
-    interrupt_state_t state = interrupt_lock();
-    void *buffer = kmalloc(size);
+uint64_t kmalloc_size(void *addr) {
+    vmm_map(GET_LOWER_HALF(void *, (uint64_t) addr - 0x1000), (void *) ((uint64_t) addr - 0x1000), 1, VMM_PRESENT | VMM_WRITE);
+    uint64_t size = *(uint64_t *) ((uint64_t) addr - 0x1000) - 0x2000;
+    vmm_unmap((void *) ((uint64_t) addr - 0x1000), 1);
+    return size;
+}
+#else
+/* Big allocations get whole pages, the size is kept in the page descriptor */
+static void *kmalloc_pages(uint64_t size, uint8_t zero) {
+    uint64_t pages = (size + 0x1000 - 1) / 0x1000;
+    void *phys = zero ? pmm_alloc_zeroed(pages * 0x1000) : pmm_alloc(pages * 0x1000);
+    pmm_page_t *desc = &pmm_pages[(uint64_t) phys / 0x1000];
+    desc->flags |= PMM_PAGE_KMALLOC;
+    desc->alloc_pages = pages;
+    return GET_HIGHER_HALF(void *, phys);
+}
+
+static void *kmalloc_caller(uint64_t size, uint64_t caller) {
+    slab_cache_t *cache = slab_size_cache(size);
+    void *ret;
+
+    if (cache) {
+        ret = slab_alloc(cache);
+    } else {
+        ret = kmalloc_pages(size, 0);
+    }
+
+    if (memstat_profiling) {
+        memstat_record_alloc(caller, size);
+    }
+    return ret;
+}
+
+void *kmalloc(uint64_t size) {
+    return kmalloc_caller(size, (uint64_t) __builtin_return_address(0));
+}
+
+void kfree(void *addr) {
+    if (!addr) {
+        return;
+    }
+
+    // Page aligned pointers are never slab objects, the slab header is there
+    if ((uint64_t) addr % 0x1000) {
+        slab_free_caller(addr, (uint64_t) __builtin_return_address(0));
+        return;
+    }
+
+    pmm_page_t *desc = &pmm_pages[GET_LOWER_HALF(uint64_t, addr) / 0x1000];
+    if (!(desc->flags & PMM_PAGE_KMALLOC)) {
+        kprintf("kfree() on something that wasn't allocated! addr: %lx, caller: %lx\n", addr, __builtin_return_address(0));
+        assert(!"kfree bad address");
+    }
+
+    if (memstat_profiling) {
+        memstat_record_free((uint64_t) __builtin_return_address(0), desc->alloc_pages * 0x1000);
+    }
+    desc->flags &= ~PMM_PAGE_KMALLOC;
+    pmm_unalloc(GET_LOWER_HALF(void *, addr), desc->alloc_pages * 0x1000);
+}
+
+uint64_t kmalloc_size(void *addr) {
+    if ((uint64_t) addr % 0x1000) {
+        return slab_object_size(addr);
+    }
+    return pmm_pages[GET_LOWER_HALF(uint64_t, addr) / 0x1000].alloc_pages * 0x1000;
+}
+#endif
+
+// Allocations made for the caller's caller get counted against it
+static void *kcalloc_caller(uint64_t size, uint64_t caller) {
+#ifndef KMALLOC_GUARD
+    if (!slab_size_cache(size)) {
+        void *pages = kmalloc_pages(size, 1); // Zeroed frames, no memset needed
+        if (memstat_profiling) {
+            memstat_record_alloc(caller, size);
+        }
+        return pages;
+    }
+#endif
+    void *buffer = kmalloc_caller(size, caller);
 
     memset((uint8_t *) buffer, 0, size);
-    interrupt_unlock(state);
     return buffer;
 }
 
-void *krealloc(void *addr, uint64_t new_size) {
-    interrupt_state_t state = interrupt_lock();
-    void *new_buffer = kcalloc(new_size);
-    if (!addr) { interrupt_unlock(state); return new_buffer; }
+void *kcalloc(uint64_t size) {
+    return kcalloc_caller(size, (uint64_t) __builtin_return_address(0));
+}
 
-    vmm_map(GET_LOWER_HALF(void *, (uint64_t) addr - 0x1000), (void *) ((uint64_t) addr - 0x1000), 1, VMM_PRESENT | VMM_WRITE);
-    uint64_t *size_data = (uint64_t *) ((uint64_t) addr - 0x1000);
+#ifdef KMALLOC_GUARD
+/* Always move, so stale pointers to the old buffer fault */
+void *krealloc(void *addr, uint64_t new_size) {
+    void *new_buffer = kcalloc_caller(new_size, (uint64_t) __builtin_return_address(0));
+    if (!addr) { return new_buffer; }
 
     /* Copy everything over, and only copy part if our new size is lower than the old size */
-    memcpy((uint8_t *) addr, (uint8_t *) new_buffer, (*size_data) - 0x2000);
+    uint64_t old_size = kmalloc_size(addr);
+    memcpy((uint8_t *) addr, (uint8_t *) new_buffer, old_size < new_size ? old_size : new_size);
 
     kfree(addr);
-    interrupt_unlock(state);
     return new_buffer;
 }
+#else
+/* Page sized allocations grow in place when the frames after them are free.
+   Anything that has to move gets at least twice the pages it had, so
+   growing a buffer a bit at a time only copies it a logarithmic number of
+   times. Slab objects stay put while the new size fits the object */
+void *krealloc(void *addr, uint64_t new_size) {
+    uint64_t caller = (uint64_t) __builtin_return_address(0);
+    if (!addr) {
+        return kcalloc_caller(new_size, caller);
+    }
+
+    uint64_t old_size = kmalloc_size(addr);
+    uint64_t alloc_size = new_size;
+    if ((uint64_t) addr % 0x1000) {
+        if (new_size <= old_size) {
+            // Clear the tail so growing back into it later reads zeroes
+            memset((uint8_t *) addr + new_size, 0, old_size - new_size);
+            return addr;
+        }
+    } else if (new_size > SLAB_MAX_SIZE) {
+        pmm_page_t *desc = &pmm_pages[GET_LOWER_HALF(uint64_t, addr) / 0x1000];
+        uint64_t pages = desc->alloc_pages;
+        uint64_t new_pages = (new_size + 0x1000 - 1) / 0x1000;
+
+        if (new_pages <= pages) {
+            // Only give pages back once most of them are unused, so a shrink and grow doesn't bounce
+            if (new_pages <= pages / 2) {
+                pmm_unalloc(GET_LOWER_HALF(void *, (uint64_t) addr + new_pages * 0x1000), (pages - new_pages) * 0x1000);
+                desc->alloc_pages = new_pages;
+                if (memstat_profiling) {
+                    memstat_record_free(caller, (pages - new_pages) * 0x1000);
+                }
+            }
+            memset((uint8_t *) addr + new_size, 0, desc->alloc_pages * 0x1000 - new_size);
+            return addr;
+        }
+
+        // The frames pmm_try_extend hands out are already zeroed
+        uint64_t grow_pages = new_pages < pages * 2 ? pages * 2 : new_pages;
+        uint64_t extended = 0;
+        if (pmm_try_extend(GET_LOWER_HALF(void *, addr), pages, grow_pages)) {
+            extended = grow_pages;
+        } else if (grow_pages != new_pages && pmm_try_extend(GET_LOWER_HALF(void *, addr), pages, new_pages)) {
+            extended = new_pages;
+        }
+        if (extended) {
+            desc->alloc_pages = extended;
+            if (memstat_profiling) {
+                memstat_record_alloc(caller, (extended - pages) * 0x1000);
+            }
+            return addr;
+        }
+        alloc_size = grow_pages * 0x1000;
+    }
+
+    void *new_buffer = kcalloc_caller(alloc_size, caller);
+    memcpy((uint8_t *) addr, (uint8_t *) new_buffer, old_size < new_size ? old_size : new_size);
+    kfree(addr);
+    return new_buffer;
+}
+#endif
 
 void panic(char *msg) {
     if (check_interrupts()) {
@@ -17,8 +17,11 @@ void *kmalloc(uint64_t size);
 void kfree(void *addr);
 void *krealloc(void *addr, uint64_t new_size);
 void *kcalloc(uint64_t size);
+uint64_t kmalloc_size(void *addr);
+#ifdef KMALLOC_GUARD
 void unmap_alloc(void *addr);
 void remap_alloc(void *addr);
+#endif
 void yield();
 void panic(char *msg);
 
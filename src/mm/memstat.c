@@ -0,0 +1,341 @@
+#include "memstat.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "mm/slab.h"
+#include "klibc/stdlib.h"
+#include "klibc/string.h"
+#include "klibc/lock.h"
+#include "klibc/errno.h"
+#include "proc/scheduler.h"
+
+/* Setup vfs driver */
+#include "fs/vfs/vfs.h"
+#include "fs/devfs/devfs.h"
+#include "fs/fd.h"
+
+volatile uint8_t memstat_profiling = 0;
+
+/* Open addressed table of call sites, keyed by return address */
+static memstat_site_t sites[MEMSTAT_SITES];
+static uint64_t size_counts[MEMSTAT_SIZE_BUCKETS];
+static uint64_t dropped_records = 0; // Records for sites that didn't fit in the table
+static lock_t memstat_lock = {0, 0, 0, 0};
+
+/* Text report that grows as it's written */
+typedef struct {
+    char *data;
+    uint64_t length;
+    uint64_t size;
+} memstat_report_t;
+
+typedef struct {
+    uint8_t present;
+    int64_t pid;
+    uint64_t rss; // In pages
+    char name[50];
+} memstat_process_t;
+
+static memstat_site_t *memstat_find_site(uint64_t caller) {
+    uint64_t slot = ((caller * 0x9E3779B97F4A7C15) >> 32) & (MEMSTAT_SITES - 1);
+
+    for (uint64_t i = 0; i < MEMSTAT_PROBES; i++) {
+        memstat_site_t *site = &sites[(slot + i) & (MEMSTAT_SITES - 1)];
+        if (site->caller == caller) {
+            return site;
+        }
+        if (!site->caller) {
+            site->caller = caller;
+            return site;
+        }
+    }
+
+    dropped_records++;
+    return (memstat_site_t *) 0;
+}
+
+static uint8_t memstat_size_bucket(uint64_t size) {
+    uint8_t bucket = 0;
+    while (bucket < MEMSTAT_SIZE_BUCKETS - 1 && (16UL << bucket) < size) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void memstat_record_alloc(uint64_t caller, uint64_t size) {
+    interrupt_state_t state = interrupt_lock();
+    lock(memstat_lock);
+
+    memstat_site_t *site = memstat_find_site(caller);
+    if (site) {
+        site->alloc_count++;
+        site->alloc_bytes += size;
+    }
+    size_counts[memstat_size_bucket(size)]++;
+
+    unlock(memstat_lock);
+    interrupt_unlock(state);
+}
+
+void memstat_record_free(uint64_t caller, uint64_t size) {
+    interrupt_state_t state = interrupt_lock();
+    lock(memstat_lock);
+
+    memstat_site_t *site = memstat_find_site(caller);
+    if (site) {
+        site->free_count++;
+        site->free_bytes += size;
+    }
+
+    unlock(memstat_lock);
+    interrupt_unlock(state);
+}
+
+void memstat_reset() {
+    interrupt_state_t state = interrupt_lock();
+    lock(memstat_lock);
+    memset((uint8_t *) sites, 0, sizeof(sites));
+    memset((uint8_t *) size_counts, 0, sizeof(size_counts));
+    dropped_records = 0;
+    unlock(memstat_lock);
+    interrupt_unlock(state);
+}
+
+static void report_put(memstat_report_t *report, char *str) {
+    uint64_t len = strlen(str);
+    if (report->length + len + 1 > report->size) {
+        uint64_t new_size = report->size * 2;
+        while (report->length + len + 1 > new_size) {
+            new_size *= 2;
+        }
+        report->data = krealloc(report->data, new_size);
+        report->size = new_size;
+    }
+
+    memcpy((uint8_t *) str, (uint8_t *) report->data + report->length, len + 1);
+    report->length += len;
+}
+
+static void report_put_num(memstat_report_t *report, uint64_t n) {
+    char buf[32];
+    utoa(n, buf);
+    report_put(report, buf);
+}
+
+static void report_memory(memstat_report_t *report) {
+    uint64_t counts[PMM_MAX_NODES][PMM_MAX_ORDER + 1];
+    uint64_t zeroed[PMM_MAX_NODES];
+    pmm_get_free_blocks(counts, zeroed);
+
+    report_put(report, "Memory (KiB): total ");
+    report_put_num(report, pmm_get_total_mem() / 1024);
+    report_put(report, ", used ");
+    report_put_num(report, pmm_get_used_mem() / 1024);
+    report_put(report, ", free ");
+    report_put_num(report, pmm_get_free_mem() / 1024);
+
+    /* How much of the free memory could still back a 2 MiB allocation */
+    report_put(report, "\n\nFree blocks by order (4 KiB to 4 MiB):\n");
+    for (uint8_t n = 0; n < pmm_node_count; n++) {
+        uint64_t free_pages = 0;
+        uint64_t large_pages = 0;
+
+        report_put(report, "node ");
+        report_put_num(report, n);
+        report_put(report, ":");
+        for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+            report_put(report, " ");
+            report_put_num(report, counts[n][order]);
+            free_pages += counts[n][order] << order;
+            if (order >= 9) {
+                large_pages += counts[n][order] << order;
+            }
+        }
+
+        report_put(report, ", zeroed ");
+        report_put_num(report, zeroed[n]);
+        report_put(report, ", in 2 MiB+ blocks ");
+        report_put_num(report, free_pages ? large_pages * 100 / free_pages : 0);
+        report_put(report, "%\n");
+    }
+}
+
+static void report_slabs(memstat_report_t *report) {
+    report_put(report, "\nSlab caches (object size, objects in use / capacity, slabs, empty slabs):\n");
+
+    for (slab_cache_t *cache = slab_cache_list(); cache; cache = cache->next_cache) {
+        /* Copy the counters out, the report can allocate from this cache */
+        interrupt_state_t state = interrupt_lock();
+        lock(cache->cache_lock);
+        uint64_t in_use = cache->objects_in_use;
+        uint64_t capacity = cache->slab_count * cache->objects_per_slab;
+        uint64_t slabs = cache->slab_count;
+        uint64_t empty = cache->empty_slabs;
+        unlock(cache->cache_lock);
+        interrupt_unlock(state);
+
+        report_put(report, (char *) cache->name);
+        report_put(report, " ");
+        report_put_num(report, cache->object_size);
+        report_put(report, " ");
+        report_put_num(report, in_use);
+        report_put(report, "/");
+        report_put_num(report, capacity);
+        report_put(report, " ");
+        report_put_num(report, slabs);
+        report_put(report, " ");
+        report_put_num(report, empty);
+        report_put(report, "\n");
+    }
+}
+
+static void report_processes(memstat_report_t *report) {
+    uint64_t size = process_list_size;
+    memstat_process_t *list = kcalloc(sizeof(memstat_process_t) * size);
+
+    interrupt_safe_lock(sched_lock);
+    for (uint64_t i = 0; i < size && i < process_list_size; i++) {
+        process_t *process = processes[i];
+        if (!process) {
+            continue;
+        }
+
+        list[i].present = 1;
+        list[i].pid = process->pid;
+        strcpy(process->name, list[i].name);
+        uint64_t page = process->cr3 / 0x1000;
+        if (process->cr3 != base_kernel_cr3 && page < pmm_max_page) {
+            list[i].rss = pmm_pages[page].rss;
+        }
+    }
+    interrupt_safe_unlock(sched_lock);
+
+    report_put(report, "\nProcesses (pid, name, resident KiB):\n");
+    for (uint64_t i = 0; i < size; i++) {
+        if (!list[i].present) {
+            continue;
+        }
+
+        report_put_num(report, list[i].pid);
+        report_put(report, " ");
+        report_put(report, list[i].name);
+        report_put(report, " ");
+        report_put_num(report, list[i].rss * 4);
+        report_put(report, "\n");
+    }
+
+    kfree(list);
+}
+
+static void report_sites(memstat_report_t *report) {
+    memstat_site_t *snapshot = kmalloc(sizeof(sites));
+    uint64_t sizes[MEMSTAT_SIZE_BUCKETS];
+
+    interrupt_state_t state = interrupt_lock();
+    lock(memstat_lock);
+    memcpy((uint8_t *) sites, (uint8_t *) snapshot, sizeof(sites));
+    memcpy((uint8_t *) size_counts, (uint8_t *) sizes, sizeof(sizes));
+    uint64_t dropped = dropped_records;
+    unlock(memstat_lock);
+    interrupt_unlock(state);
+
+    /* Pack the used slots and sort them, most bytes allocated first */
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < MEMSTAT_SITES; i++) {
+        if (snapshot[i].caller) {
+            snapshot[count++] = snapshot[i];
+        }
+    }
+    for (uint64_t i = 1; i < count; i++) {
+        memstat_site_t site = snapshot[i];
+        uint64_t j = i;
+        while (j > 0 && snapshot[j - 1].alloc_bytes < site.alloc_bytes) {
+            snapshot[j] = snapshot[j - 1];
+            j--;
+        }
+        snapshot[j] = site;
+    }
+
+    report_put(report, "\nAllocation sites (profiling ");
+    report_put(report, memstat_profiling ? "on" : "off");
+    report_put(report, ", dropped ");
+    report_put_num(report, dropped);
+    report_put(report, "):\ncaller allocs bytes frees bytes\n");
+    for (uint64_t i = 0; i < count; i++) {
+        char caller[32];
+        htoa(snapshot[i].caller, caller);
+        report_put(report, caller);
+        report_put(report, " ");
+        report_put_num(report, snapshot[i].alloc_count);
+        report_put(report, " ");
+        report_put_num(report, snapshot[i].alloc_bytes);
+        report_put(report, " ");
+        report_put_num(report, snapshot[i].free_count);
+        report_put(report, " ");
+        report_put_num(report, snapshot[i].free_bytes);
+        report_put(report, "\n");
+    }
+
+    report_put(report, "\nAllocation sizes (16 bytes and up, by power of two):\n");
+    for (uint8_t i = 0; i < MEMSTAT_SIZE_BUCKETS; i++) {
+        report_put_num(report, sizes[i]);
+        report_put(report, i + 1 < MEMSTAT_SIZE_BUCKETS ? " " : "\n");
+    }
+
+    kfree(snapshot);
+}
+
+/* The whole report is rebuilt on every read, reads pick up at the seek */
+static int memstat_read(int fd_no, void *buf, uint64_t count) {
+    fd_entry_t *fd_data = fd_lookup(fd_no);
+    memstat_report_t report = {kmalloc(0x1000), 0, 0x1000};
+    report.data[0] = '\0';
+
+    report_memory(&report);
+    report_slabs(&report);
+    report_processes(&report);
+    report_sites(&report);
+
+    uint64_t copied = 0;
+    if (fd_data->seek < report.length) {
+        copied = report.length - fd_data->seek;
+        if (copied > count) {
+            copied = count;
+        }
+        memcpy((uint8_t *) report.data + fd_data->seek, buf, copied);
+        fd_data->seek += copied;
+    }
+
+    kfree(report.data);
+    return (int) copied;
+}
+
+/* Takes "on", "off" or "reset" for the call site profiling */
+static int memstat_write(int fd_no, void *buf, uint64_t count) {
+    char command[8];
+    if (count >= sizeof(command)) {
+        return -EINVAL;
+    }
+
+    memcpy((uint8_t *) buf, (uint8_t *) command, count);
+    command[count] = '\0';
+    if (count && command[count - 1] == '\n') {
+        command[count - 1] = '\0';
+    }
+
+    if (!strcmp(command, "on")) {
+        memstat_profiling = 1;
+    } else if (!strcmp(command, "off")) {
+        memstat_profiling = 0;
+    } else if (!strcmp(command, "reset")) {
+        memstat_reset();
+    } else {
+        return -EINVAL;
+    }
+
+    return (int) count;
+}
+
+void setup_memstat_device() {
+    vfs_ops_t ops = {devfs_open, 0, devfs_close, memstat_read, memstat_write, dummy_ops.seek};
+    register_device("meminfo", ops, (void *) 0);
+}
\ No newline at end of file
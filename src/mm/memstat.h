@@ -0,0 +1,27 @@
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+#include <stdint.h>
+
+#define MEMSTAT_SITES 512 // Call sites tracked while profiling, a power of two
+#define MEMSTAT_PROBES 16 // Slots tried before a new site is dropped
+#define MEMSTAT_SIZE_BUCKETS 12 // Allocation sizes by power of two, 16 bytes to 32 KiB and over
+
+/* kmalloc and kfree traffic from one caller */
+typedef struct {
+    uint64_t caller;
+    uint64_t alloc_count;
+    uint64_t alloc_bytes;
+    uint64_t free_count;
+    uint64_t free_bytes;
+} memstat_site_t;
+
+/* Set by writing "on" to /dev/meminfo. The allocator only checks this flag
+   until profiling is turned on */
+extern volatile uint8_t memstat_profiling;
+
+void memstat_record_alloc(uint64_t caller, uint64_t size);
+void memstat_record_free(uint64_t caller, uint64_t size);
+void memstat_reset();
+void setup_memstat_device();
+
+#endif
\ No newline at end of file
@@ -3,11 +3,33 @@
 #include "klibc/math.h"
 #include "klibc/string.h"
 #include "klibc/lock.h"
+#include "klibc/stdlib.h"
+#include "sys/smp.h"
 #include "drivers/serial.h"
 #include "drivers/tty/tty.h"
 
-uint8_t *bitmap;
-uint64_t bitmap_max_page;
+pmm_page_t *pmm_pages;
+uint64_t pmm_max_page;
+
+// Heads of the free lists for each NUMA node and block order
+static uint32_t free_lists[PMM_MAX_NODES][PMM_MAX_ORDER];
+static uint64_t free_counts[PMM_MAX_NODES][PMM_MAX_ORDER + 1]; // Free blocks of each order
+
+/* Free max order blocks aren't on a list. Runs of them that sit next to each
+   other are kept in a red-black tree per node, ordered by length and then
+   address, so the best fit for a large allocation is one descent. The
+   array lives after the page descriptors, the last slot is the tree's nil */
+static pmm_extent_t *extents;
+static uint32_t extent_nil;
+static uint32_t extent_roots[PMM_MAX_NODES];
+
+/* NUMA layout from the SRAT. Pages outside every range belong to node 0,
+   which is all there is until pmm_numa_setup runs */
+uint8_t pmm_node_count = 1;
+static pmm_node_range_t node_ranges[PMM_MAX_NODE_RANGES];
+static uint8_t node_range_count = 0;
+static uint8_t node_order[PMM_MAX_NODES][PMM_MAX_NODES]; // Nodes to take memory from, nearest first
+static uint8_t apic_nodes[256];
 
 uint64_t total_memory = 0;
 uint64_t used_memory = 0;
@@ -15,81 +37,567 @@ uint64_t available_memory = 0;
 
 lock_t pmm_lock = {0, 0, 0, 0};
 
-static void pmm_set_bit(uint64_t page) {
-    uint8_t bit = page % 8;
-    uint64_t byte = page / 8;
+/* Set once every CPU has its locals. Before that GS can't be trusted, so
+   everything goes through the global lists */
+uint8_t pmm_cpu_caches_enabled = 0;
+
+/* Frames zeroed ahead of time by idle CPUs, chained through their
+   descriptors. They count as used, like the per CPU caches */
+lock_t zero_pool_lock = {0, 0, 0, 0};
+uint32_t zero_pool[PMM_MAX_NODES];
+volatile uint64_t zero_pool_count[PMM_MAX_NODES];
+
+static uint8_t pages_to_order(uint64_t pages) {
+    uint8_t order = 0;
+    while ((1UL << order) < pages) {
+        order++;
+    }
+    return order;
+}
+
+static uint8_t pmm_page_node(uint64_t page) {
+    return pmm_pages[page].node;
+}
+
+// First page after page where the node might change
+static uint64_t pmm_node_boundary(uint64_t page) {
+    uint64_t boundary = ~0UL;
+    for (uint8_t i = 0; i < node_range_count; i++) {
+        if (node_ranges[i].start > page && node_ranges[i].start < boundary) {
+            boundary = node_ranges[i].start;
+        }
+        if (node_ranges[i].end > page && node_ranges[i].end < boundary) {
+            boundary = node_ranges[i].end;
+        }
+    }
+    return boundary;
+}
+
+/* The node of the calling CPU. Before every CPU has its locals, the LAPIC
+   ID says which CPU this is */
+static uint8_t pmm_cur_node() {
+    if (pmm_node_count == 1) {
+        return 0;
+    }
+    if (pmm_cpu_caches_enabled) {
+        return get_cpu_locals()->numa_node;
+    }
+    return apic_nodes[get_lapic_id()];
+}
+
+static uint8_t extent_less(uint32_t a, uint32_t b) {
+    if (extents[a].length != extents[b].length) {
+        return extents[a].length < extents[b].length;
+    }
+    return a < b;
+}
+
+static void extent_rotate_left(uint32_t *root, uint32_t x) {
+    uint32_t y = extents[x].right;
+    extents[x].right = extents[y].left;
+    if (extents[y].left != extent_nil) {
+        extents[extents[y].left].parent = x;
+    }
+
+    extents[y].parent = extents[x].parent;
+    if (extents[x].parent == extent_nil) {
+        *root = y;
+    } else if (x == extents[extents[x].parent].left) {
+        extents[extents[x].parent].left = y;
+    } else {
+        extents[extents[x].parent].right = y;
+    }
+
+    extents[y].left = x;
+    extents[x].parent = y;
+}
+
+static void extent_rotate_right(uint32_t *root, uint32_t x) {
+    uint32_t y = extents[x].left;
+    extents[x].left = extents[y].right;
+    if (extents[y].right != extent_nil) {
+        extents[extents[y].right].parent = x;
+    }
+
+    extents[y].parent = extents[x].parent;
+    if (extents[x].parent == extent_nil) {
+        *root = y;
+    } else if (x == extents[extents[x].parent].right) {
+        extents[extents[x].parent].right = y;
+    } else {
+        extents[extents[x].parent].left = y;
+    }
+
+    extents[y].right = x;
+    extents[x].parent = y;
+}
+
+static void extent_insert(uint32_t *root, uint32_t z) {
+    uint32_t parent = extent_nil;
+    uint32_t cur = *root;
+    while (cur != extent_nil) {
+        parent = cur;
+        cur = extent_less(z, cur) ? extents[cur].left : extents[cur].right;
+    }
+
+    extents[z].parent = parent;
+    extents[z].left = extent_nil;
+    extents[z].right = extent_nil;
+    extents[z].red = 1;
+    if (parent == extent_nil) {
+        *root = z;
+    } else if (extent_less(z, parent)) {
+        extents[parent].left = z;
+    } else {
+        extents[parent].right = z;
+    }
+
+    while (extents[extents[z].parent].red) {
+        uint32_t p = extents[z].parent;
+        uint32_t g = extents[p].parent;
+        if (p == extents[g].left) {
+            uint32_t uncle = extents[g].right;
+            if (extents[uncle].red) {
+                extents[p].red = 0;
+                extents[uncle].red = 0;
+                extents[g].red = 1;
+                z = g;
+            } else {
+                if (z == extents[p].right) {
+                    z = p;
+                    extent_rotate_left(root, z);
+                    p = extents[z].parent;
+                }
+                extents[p].red = 0;
+                extents[g].red = 1;
+                extent_rotate_right(root, g);
+            }
+        } else {
+            uint32_t uncle = extents[g].left;
+            if (extents[uncle].red) {
+                extents[p].red = 0;
+                extents[uncle].red = 0;
+                extents[g].red = 1;
+                z = g;
+            } else {
+                if (z == extents[p].left) {
+                    z = p;
+                    extent_rotate_right(root, z);
+                    p = extents[z].parent;
+                }
+                extents[p].red = 0;
+                extents[g].red = 1;
+                extent_rotate_left(root, g);
+            }
+        }
+    }
+    extents[*root].red = 0;
+}
+
+static void extent_transplant(uint32_t *root, uint32_t u, uint32_t v) {
+    if (extents[u].parent == extent_nil) {
+        *root = v;
+    } else if (u == extents[extents[u].parent].left) {
+        extents[extents[u].parent].left = v;
+    } else {
+        extents[extents[u].parent].right = v;
+    }
+    extents[v].parent = extents[u].parent;
+}
+
+static void extent_delete_fixup(uint32_t *root, uint32_t x) {
+    while (x != *root && !extents[x].red) {
+        uint32_t p = extents[x].parent;
+        if (x == extents[p].left) {
+            uint32_t w = extents[p].right;
+            if (extents[w].red) {
+                extents[w].red = 0;
+                extents[p].red = 1;
+                extent_rotate_left(root, p);
+                w = extents[p].right;
+            }
+            if (!extents[extents[w].left].red && !extents[extents[w].right].red) {
+                extents[w].red = 1;
+                x = p;
+            } else {
+                if (!extents[extents[w].right].red) {
+                    extents[extents[w].left].red = 0;
+                    extents[w].red = 1;
+                    extent_rotate_right(root, w);
+                    w = extents[p].right;
+                }
+                extents[w].red = extents[p].red;
+                extents[p].red = 0;
+                extents[extents[w].right].red = 0;
+                extent_rotate_left(root, p);
+                x = *root;
+            }
+        } else {
+            uint32_t w = extents[p].left;
+            if (extents[w].red) {
+                extents[w].red = 0;
+                extents[p].red = 1;
+                extent_rotate_right(root, p);
+                w = extents[p].left;
+            }
+            if (!extents[extents[w].right].red && !extents[extents[w].left].red) {
+                extents[w].red = 1;
+                x = p;
+            } else {
+                if (!extents[extents[w].left].red) {
+                    extents[extents[w].right].red = 0;
+                    extents[w].red = 1;
+                    extent_rotate_left(root, w);
+                    w = extents[p].left;
+                }
+                extents[w].red = extents[p].red;
+                extents[p].red = 0;
+                extents[extents[w].left].red = 0;
+                extent_rotate_right(root, p);
+                x = *root;
+            }
+        }
+    }
+    extents[x].red = 0;
+}
+
+static void extent_delete(uint32_t *root, uint32_t z) {
+    uint32_t y = z;
+    uint8_t removed_red = extents[y].red;
+    uint32_t x;
+
+    if (extents[z].left == extent_nil) {
+        x = extents[z].right;
+        extent_transplant(root, z, x);
+    } else if (extents[z].right == extent_nil) {
+        x = extents[z].left;
+        extent_transplant(root, z, x);
+    } else {
+        y = extents[z].right;
+        while (extents[y].left != extent_nil) {
+            y = extents[y].left;
+        }
+        removed_red = extents[y].red;
+        x = extents[y].right;
+
+        if (extents[y].parent == z) {
+            extents[x].parent = y;
+        } else {
+            extent_transplant(root, y, x);
+            extents[y].right = extents[z].right;
+            extents[extents[y].right].parent = y;
+        }
+
+        extent_transplant(root, z, y);
+        extents[y].left = extents[z].left;
+        extents[extents[y].left].parent = y;
+        extents[y].red = extents[z].red;
+    }
+
+    if (!removed_red) {
+        extent_delete_fixup(root, x);
+    }
+}
+
+// Only the first page of a free max order block has the order set
+static uint8_t extent_block_free(uint64_t block, uint8_t node) {
+    uint64_t page = block << PMM_MAX_ORDER;
+    return page < pmm_max_page && pmm_pages[page].order == PMM_MAX_ORDER && pmm_page_node(page) == node;
+}
+
+/* A max order block was freed, join it with the runs on either side. Runs
+   are always as long as they can be, so a free block right before this one
+   is the end of a run and one right after it is the start of one */
+static void extent_add_block(uint64_t page, uint8_t node) {
+    uint32_t block = page >> PMM_MAX_ORDER;
+    uint32_t head = block;
+    uint32_t length = 1;
+
+    if (block && extent_block_free(block - 1, node)) {
+        head = extents[block - 1].head;
+        extent_delete(&extent_roots[node], head);
+        length += extents[head].length;
+    }
+
+    if (extent_block_free(block + 1, node)) {
+        extent_delete(&extent_roots[node], block + 1);
+        length += extents[block + 1].length;
+    }
+
+    extents[head].length = length;
+    extents[head + length - 1].head = head;
+    extent_insert(&extent_roots[node], head);
+}
+
+/* Take count max order blocks off the end of the shortest run that has
+   enough of them, which keeps the long runs whole */
+static uint64_t extent_take(uint64_t count, uint8_t node) {
+    uint32_t head = extent_nil;
+    for (uint32_t cur = extent_roots[node]; cur != extent_nil;) {
+        if (extents[cur].length >= count) {
+            head = cur;
+            cur = extents[cur].left;
+        } else {
+            cur = extents[cur].right;
+        }
+    }
+
+    if (head == extent_nil) {
+        return PMM_NO_PAGE;
+    }
+
+    extent_delete(&extent_roots[node], head);
+    uint32_t length = extents[head].length - count;
+    if (length) {
+        extents[head].length = length;
+        extents[head + length - 1].head = head;
+        extent_insert(&extent_roots[node], head);
+    }
 
-    bitmap[byte] |= (1<<bit);
+    uint64_t first = head + length;
+    for (uint64_t i = 0; i < count; i++) {
+        pmm_pages[(first + i) << PMM_MAX_ORDER].order = PMM_ORDER_NONE;
+    }
+    free_counts[node][PMM_MAX_ORDER] -= count;
+    return first << PMM_MAX_ORDER;
 }
 
-static void pmm_clear_bit(uint64_t page) {
-    uint8_t bit = page % 8;
-    uint64_t byte = page / 8;
+/* Take one given free max order block out of its run, whatever is left on
+   either side of it goes back in the tree as its own run */
+static void extent_remove_block(uint64_t page, uint8_t node) {
+    uint32_t block = page >> PMM_MAX_ORDER;
+    uint32_t head = block;
+    while (head && extent_block_free(head - 1, node)) {
+        head--;
+    }
 
-    bitmap[byte] &= ~(1<<bit);
+    extent_delete(&extent_roots[node], head);
+    uint32_t end = head + extents[head].length;
+    if (block > head) {
+        extents[head].length = block - head;
+        extents[block - 1].head = head;
+        extent_insert(&extent_roots[node], head);
+    }
+    if (block + 1 < end) {
+        extents[block + 1].length = end - block - 1;
+        extents[end - 1].head = block + 1;
+        extent_insert(&extent_roots[node], block + 1);
+    }
+
+    pmm_pages[page].order = PMM_ORDER_NONE;
+    free_counts[node][PMM_MAX_ORDER]--;
 }
 
-static uint8_t pmm_get_bit(uint64_t page) {
-    uint8_t bit = page % 8;
-    uint64_t byte = page / 8;
+/* Free blocks never cross a node boundary, so the first page's node is
+   the node of the whole block */
+static void buddy_list_add(uint64_t page, uint8_t order) {
+    pmm_page_t *desc = &pmm_pages[page];
+    uint8_t node = pmm_page_node(page);
 
-    return bitmap[byte] & (1<<bit);
+    free_counts[node][order]++;
+    desc->order = order;
+    if (order == PMM_MAX_ORDER) {
+        extent_add_block(page, node);
+        return;
+    }
+
+    uint32_t *head = &free_lists[node][order];
+    desc->prev = PMM_NO_PAGE;
+    desc->next = *head;
+    if (*head != PMM_NO_PAGE) {
+        pmm_pages[*head].prev = (uint32_t) page;
+    }
+    *head = (uint32_t) page;
+}
+
+static void buddy_list_remove(uint64_t page, uint8_t order) {
+    pmm_page_t *desc = &pmm_pages[page];
+    uint8_t node = pmm_page_node(page);
+
+    free_counts[node][order]--;
+    if (desc->prev != PMM_NO_PAGE) {
+        pmm_pages[desc->prev].next = desc->next;
+    } else {
+        free_lists[node][order] = desc->next;
+    }
+    if (desc->next != PMM_NO_PAGE) {
+        pmm_pages[desc->next].prev = desc->prev;
+    }
+
+    desc->next = PMM_NO_PAGE;
+    desc->prev = PMM_NO_PAGE;
+    desc->order = PMM_ORDER_NONE;
+}
+
+/* Free a naturally aligned block, merging it with its buddy for as long as
+   the buddy is a free block of the same order */
+static void buddy_free_block(uint64_t page, uint8_t order) {
+    uint8_t node = pmm_page_node(page);
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = page ^ (1UL << order);
+        if (buddy >= pmm_max_page || pmm_pages[buddy].order != order || pmm_page_node(buddy) != node) {
+            break;
+        }
+
+        buddy_list_remove(buddy, order);
+        page &= ~(1UL << order);
+        order++;
+    }
+
+    buddy_list_add(page, order);
+}
+
+// Free an arbitrary run of pages by splitting it into the largest aligned blocks
+static void buddy_free_range(uint64_t page, uint64_t pages) {
+    while (pages) {
+        uint8_t order = 0;
+        while (order < PMM_MAX_ORDER && !(page & (1UL << order)) && (2UL << order) <= pages) {
+            order++;
+        }
+
+        buddy_free_block(page, order);
+        page += 1UL << order;
+        pages -= 1UL << order;
+    }
+}
+
+// Same as buddy_free_range, but the range may span several nodes
+static void buddy_free_nodes(uint64_t page, uint64_t pages) {
+    while (pages) {
+        uint64_t run = pmm_node_boundary(page) - page;
+        if (run > pages) {
+            run = pages;
+        }
+
+        buddy_free_range(page, run);
+        page += run;
+        pages -= run;
+    }
+}
+
+// Take a block of the given order off a node's free lists, splitting a larger one if needed
+static uint64_t buddy_alloc_block(uint8_t order, uint8_t node) {
+    uint8_t cur_order = order;
+    while (cur_order < PMM_MAX_ORDER && free_lists[node][cur_order] == PMM_NO_PAGE) {
+        cur_order++;
+    }
+
+    uint64_t page;
+    if (cur_order == PMM_MAX_ORDER) {
+        page = extent_take(1, node);
+        if (page == PMM_NO_PAGE) {
+            return PMM_NO_PAGE;
+        }
+    } else {
+        page = free_lists[node][cur_order];
+        buddy_list_remove(page, cur_order);
+    }
+
+    // Give the upper halves back until the block is the right size
+    while (cur_order > order) {
+        cur_order--;
+        buddy_list_add(page + (1UL << cur_order), cur_order);
+    }
+
+    return page;
+}
+
+// Allocations bigger than the largest order need a run of max order blocks
+static uint64_t buddy_alloc_run(uint64_t pages, uint8_t node) {
+    uint64_t block_pages = 1UL << PMM_MAX_ORDER;
+    return extent_take((pages + block_pages - 1) / block_pages, node);
 }
 
 void pmm_memory_setup(stivale_info_t *bootloader_info) {
-    // Bitmap set to kernel_end rounded up to a page
+    // Page descriptors set to kernel_end rounded up to a page
     bootloader_info = GET_HIGHER_HALF(stivale_info_t *, bootloader_info);
     sprintf("%lx bootloader info addr\n", bootloader_info);
-    bitmap = (uint8_t *) ((((uint64_t) __kernel_end) + 0x1000 - 1) & ~(0xfff));
+    pmm_pages = (pmm_page_t *) ((((uint64_t) __kernel_end) + 0x1000 - 1) & ~(0xfff));
 
     // Dont destroy the bootloader info
-    if ((uint64_t) bootloader_info + sizeof(stivale_info_t) > (uint64_t) bitmap) {
-        bitmap = (uint8_t *) ((uint64_t) bootloader_info + sizeof(stivale_info_t));
+    if ((uint64_t) bootloader_info + sizeof(stivale_info_t) > (uint64_t) pmm_pages) {
+        pmm_pages = (pmm_page_t *) ROUND_UP((uint64_t) bootloader_info + sizeof(stivale_info_t), 0x1000);
     }
 
-    // Setup the bitmap for the PMM
     e820_entry_t *mmap = GET_HIGHER_HALF(e820_entry_t *, bootloader_info->memory_map_addr);
     sprintf("e820 addrs: %lx %lx\n", bootloader_info->memory_map_addr, mmap);
     sprintf(" %u x %u\n", bootloader_info->framebuffer_width, bootloader_info->framebuffer_height);
 
-    // Calculate length of memory
-    e820_entry_t start = mmap[0];
-    e820_entry_t end = mmap[bootloader_info->memory_map_entries - 1];
-    uint64_t mem_length = ROUND_UP((end.addr + end.len) - start.addr, 0x1000);
-    uint64_t bitmap_bytes = ((mem_length / 0x1000) + 8 - 1) / 8;
-
+    // Only describe memory up to the end of the last usable entry
     for (uint64_t i = 0; i < bootloader_info->memory_map_entries; i++) {
         sprintf("%lx - %lx (type %u)\n", mmap[i].addr, mmap[i].addr + mmap[i].len, mmap[i].type);
+        if (mmap[i].type == STIVALE_MEMORY_AVAILABLE && mmap[i].addr >= 0x100000) {
+            uint64_t block_end = (mmap[i].addr + mmap[i].len) / 0x1000;
+            if (block_end > pmm_max_page) {
+                pmm_max_page = block_end;
+            }
+        }
     }
 
-    // Set bitmap as ones
-    memset(bitmap, 0xFF, bitmap_bytes);
+    /* The descriptors and extents are written through the boot mapping of
+       the kernel, so they have to end inside it */
+    uint64_t extent_count = (ROUND_UP(pmm_max_page, 1UL << PMM_MAX_ORDER) >> PMM_MAX_ORDER) + 1;
+    uint64_t tables_end = (uint64_t) (pmm_pages + pmm_max_page) + extent_count * sizeof(pmm_extent_t);
+    if (tables_end - KERNEL_VMA_OFFSET > KERNEL_VMA_BOOT_SIZE) {
+        sprintf("[PMM] Page descriptors end at %lx, past the boot mapping\n", tables_end);
+        panic("Too much memory for the page descriptors");
+    }
 
-    for (uint64_t i = 0; i < bootloader_info->memory_map_entries; i++) {
-        uint64_t rounded_block_start = ROUND_UP(mmap[i].addr, 0x1000);
-        uint64_t rounded_block_end = ROUND_UP((mmap[i].addr + mmap[i].len), 0x1000);
-        uint64_t rounded_block_len = rounded_block_end - rounded_block_start;
+    for (uint64_t i = 0; i < pmm_max_page; i++) {
+        pmm_pages[i].next = PMM_NO_PAGE;
+        pmm_pages[i].prev = PMM_NO_PAGE;
+        pmm_pages[i].order = PMM_ORDER_NONE;
+        pmm_pages[i].flags = 0;
+        pmm_pages[i].node = 0;
+        pmm_pages[i].alloc_pages = 0;
+        pmm_pages[i].ref_count = 0;
+        pmm_pages[i].pcid = 0;
+        pmm_pages[i].map_count = 0;
+        pmm_pages[i].vmm_lock = 0;
+    }
 
-        if (mmap[i].type == STIVALE_MEMORY_AVAILABLE && mmap[i].addr >= 0x100000) { // Ignore low 640K so we dont use it
-            for (uint64_t i = 0; i < rounded_block_len / 0x1000; i++) {
-                pmm_clear_bit(i + (rounded_block_start / 0x1000)); // set the memory as avaiable
-            }
-            available_memory += rounded_block_len;
+    // The extent slots go right after the descriptors, one per max order block
+    extents = (pmm_extent_t *) (pmm_pages + pmm_max_page);
+    extent_nil = ROUND_UP(pmm_max_page, 1UL << PMM_MAX_ORDER) >> PMM_MAX_ORDER;
+    extents[extent_nil].red = 0;
+
+    for (uint8_t n = 0; n < PMM_MAX_NODES; n++) {
+        for (uint8_t i = 0; i < PMM_MAX_ORDER; i++) {
+            free_lists[n][i] = PMM_NO_PAGE;
         }
+        extent_roots[n] = extent_nil;
+        zero_pool[n] = PMM_NO_PAGE;
+        zero_pool_count[n] = 0;
     }
-    total_memory = available_memory;
 
-    // Make sure the kernel and bitmap are not marked as available
+    // Make sure the kernel and page descriptors are not marked as available
     uint64_t kernel_start = (uint64_t) __kernel_start;
     sprintf("kernel_start: %lx %lx\n", kernel_start, kernel_start - KERNEL_VMA_OFFSET);
-    uint64_t kernel_bitmap_len = ((uint64_t) bitmap + bitmap_bytes) - kernel_start;
-    uint64_t kernel_bitmap_start_page = (kernel_start - KERNEL_VMA_OFFSET) / 0x1000;
-    uint64_t kernel_bitmap_pages = (kernel_bitmap_len + 0x1000 - 1) / 0x1000;
+    uint64_t reserved_start = (kernel_start - KERNEL_VMA_OFFSET) / 0x1000;
+    uint64_t reserved_end = ROUND_UP((uint64_t) (extents + extent_nil + 1) - KERNEL_VMA_OFFSET, 0x1000) / 0x1000;
+
+    for (uint64_t i = 0; i < bootloader_info->memory_map_entries; i++) {
+        if (mmap[i].type != STIVALE_MEMORY_AVAILABLE || mmap[i].addr < 0x100000) { // Ignore low 640K so we dont use it
+            continue;
+        }
 
-    for (uint64_t i = 0; i < kernel_bitmap_pages; i++) {
-        pmm_set_bit(i + kernel_bitmap_start_page);
+        uint64_t block_start = ROUND_UP(mmap[i].addr, 0x1000) / 0x1000;
+        uint64_t block_end = (mmap[i].addr + mmap[i].len) / 0x1000;
+
+        // Hand everything around the reserved region to the buddy allocator
+        uint64_t low_end = block_end < reserved_start ? block_end : reserved_start;
+        if (block_start < low_end) {
+            buddy_free_range(block_start, low_end - block_start);
+            available_memory += (low_end - block_start) * 0x1000;
+        }
+
+        uint64_t high_start = block_start > reserved_end ? block_start : reserved_end;
+        if (high_start < block_end) {
+            buddy_free_range(high_start, block_end - high_start);
+            available_memory += (block_end - high_start) * 0x1000;
+        }
     }
-    bitmap_max_page = bitmap_bytes * 8;
+    total_memory = available_memory;
 
     // Get rid of qloader2's CR3
     void *new_cr3 = pmm_alloc(0x1000);
@@ -110,50 +618,146 @@ void pmm_memory_setup(stivale_info_t *bootloader_info) {
     vmm_complete = 1;
 }
 
-static uint64_t find_free_page(uint64_t pages) {
-    uint64_t found_pages = 0;
-    uint64_t first_page = 0;
+/* Callers that can cope with running out use pmm_try_alloc, for everyone
+   else it's fatal */
+static void pmm_out_of_memory(uint64_t pages) {
+    sprintf("[PMM] Error! Couldn't find %lu free pages!\n", pages);
+    panic("Out of physical memory");
+}
+
+/* Single pages come from this CPU's cache. Only the refill touches the global
+   lists, and it pulls a whole batch at once. Cached frames count as used */
+static uint64_t pmm_cache_alloc() {
+    interrupt_state_t state = interrupt_lock();
+    pmm_cpu_cache_t *cache = &get_cpu_locals()->page_cache;
 
-    for (uint64_t i = 0; i < bitmap_max_page; i++) {
-        if (!pmm_get_bit(i)) {
-            found_pages += 1;
-            if (first_page == 0) {
-                first_page = i;
+    if (!cache->count) {
+        uint8_t node = pmm_cur_node();
+        lock(pmm_lock);
+        for (uint8_t i = 0; i < pmm_node_count && cache->count < PMM_CPU_CACHE_BATCH; i++) {
+            while (cache->count < PMM_CPU_CACHE_BATCH) {
+                uint64_t page = buddy_alloc_block(0, node_order[node][i]);
+                if (page == PMM_NO_PAGE) {
+                    break;
+                }
+                cache->frames[cache->count++] = page;
             }
-        } else {
-            found_pages = 0;
-            first_page = 0;
         }
+        available_memory -= cache->count * 0x1000;
+        used_memory += cache->count * 0x1000;
+        unlock(pmm_lock);
+    }
 
-        if (found_pages == pages) {
-            return first_page;
-        }
+    uint64_t page = PMM_NO_PAGE;
+    if (cache->count) {
+        page = cache->frames[--cache->count];
     }
 
-    sprintf("[PMM] Error! Couldn't find free memory!\n");
-    while (1) {
-        asm volatile("hlt");
+    interrupt_unlock(state);
+    return page;
+}
+
+static void pmm_cache_free(uint64_t page) {
+    interrupt_state_t state = interrupt_lock();
+    pmm_cpu_cache_t *cache = &get_cpu_locals()->page_cache;
+
+    // Cache is full, give the oldest half back to the buddy allocator
+    if (cache->count == PMM_CPU_CACHE_SIZE) {
+        lock(pmm_lock);
+        for (uint64_t i = 0; i < PMM_CPU_CACHE_BATCH; i++) {
+            buddy_free_block(cache->frames[i], 0);
+        }
+        available_memory += PMM_CPU_CACHE_BATCH * 0x1000;
+        used_memory -= PMM_CPU_CACHE_BATCH * 0x1000;
+        unlock(pmm_lock);
+
+        cache->count -= PMM_CPU_CACHE_BATCH;
+        memcpy((uint8_t *) &cache->frames[PMM_CPU_CACHE_BATCH], (uint8_t *) cache->frames,
+            cache->count * sizeof(uint64_t));
     }
 
-    return 0;
+    cache->frames[cache->count++] = page;
+    interrupt_unlock(state);
 }
 
-void *pmm_alloc(uint64_t size) {
+/* Allocate from node, or the nearest node that has enough free memory */
+static uint64_t pmm_alloc_pages_node(uint64_t pages, uint8_t node) {
     interrupt_state_t state = interrupt_lock();
     lock(pmm_lock);
 
-    uint64_t pages = (size + 0x1000 - 1) / 0x1000;
-    uint64_t free_page = find_free_page(pages);
-
-    for (uint64_t i = 0; i < pages; i++) {
-        pmm_set_bit(free_page + i);
+    uint64_t free_page = PMM_NO_PAGE;
+    uint64_t block_pages;
+    if (pages <= (1UL << PMM_MAX_ORDER)) {
+        uint8_t order = pages_to_order(pages);
+        for (uint8_t i = 0; i < pmm_node_count && free_page == PMM_NO_PAGE; i++) {
+            free_page = buddy_alloc_block(order, node_order[node][i]);
+        }
+        block_pages = 1UL << order;
+    } else {
+        for (uint8_t i = 0; i < pmm_node_count && free_page == PMM_NO_PAGE; i++) {
+            free_page = buddy_alloc_run(pages, node_order[node][i]);
+        }
+        block_pages = ROUND_UP(pages, 1UL << PMM_MAX_ORDER);
     }
 
-    available_memory -= pages * 0x1000;
-    used_memory += pages * 0x1000;
+    if (free_page != PMM_NO_PAGE) {
+        // Return whatever was rounded up past the requested size
+        if (block_pages > pages) {
+            buddy_free_range(free_page + pages, block_pages - pages);
+        }
+
+        available_memory -= pages * 0x1000;
+        used_memory += pages * 0x1000;
+    }
 
     unlock(pmm_lock);
     interrupt_unlock(state);
+    return free_page;
+}
+
+static uint64_t pmm_alloc_pages(uint64_t pages) {
+    if (pages == 1 && pmm_cpu_caches_enabled) {
+        return pmm_cache_alloc();
+    }
+    return pmm_alloc_pages_node(pages, pmm_cur_node());
+}
+
+static uint64_t pmm_zero_pool_take(uint8_t node) {
+    if (!zero_pool_count[node]) {
+        return PMM_NO_PAGE;
+    }
+
+    interrupt_state_t state = interrupt_lock();
+    lock(zero_pool_lock);
+    uint64_t page = zero_pool[node];
+    if (page != PMM_NO_PAGE) {
+        zero_pool[node] = pmm_pages[page].next;
+        zero_pool_count[node]--;
+    }
+    unlock(zero_pool_lock);
+    interrupt_unlock(state);
+    return page;
+}
+
+static void pmm_zero_pages(uint64_t page, uint64_t pages) {
+    uint64_t *dst = GET_HIGHER_HALF(uint64_t *, page * 0x1000);
+    uint64_t count = pages * 0x200;
+    asm volatile("rep stosq;" : "+D"(dst), "+c"(count) : "a"(0UL) : "memory");
+}
+
+void *pmm_alloc(uint64_t size) {
+    uint64_t pages = (size + 0x1000 - 1) / 0x1000;
+    if (!pages) {
+        pages = 1;
+    }
+
+    uint64_t free_page = pmm_alloc_pages(pages);
+    for (uint8_t i = 0; i < pmm_node_count && free_page == PMM_NO_PAGE && pages == 1; i++) {
+        free_page = pmm_zero_pool_take(i); // Last resort
+    }
+    if (free_page == PMM_NO_PAGE) {
+        pmm_out_of_memory(pages);
+    }
 
     if ((free_page * 0x1000) <= cur_pain && cur_pain < (free_page * 0x1000) + size) {
         kprintf("idot lmao, caller: %lx\n", __builtin_return_address(0));
@@ -162,6 +766,158 @@ void *pmm_alloc(uint64_t size) {
     return (void *) (free_page * 0x1000);
 }
 
+/* Allocate from a specific node, for memory that's mostly used by one CPU */
+void *pmm_alloc_node(uint64_t size, uint8_t node) {
+    uint64_t pages = (size + 0x1000 - 1) / 0x1000;
+    if (!pages) {
+        pages = 1;
+    }
+
+    uint64_t free_page = pmm_alloc_pages_node(pages, node < pmm_node_count ? node : 0);
+    if (free_page == PMM_NO_PAGE) {
+        pmm_out_of_memory(pages);
+    }
+    return (void *) (free_page * 0x1000);
+}
+
+/* Same as pmm_alloc, but returns NULL instead of halting when there isn't a
+   free block big enough. Power of two sizes come back naturally aligned */
+void *pmm_try_alloc(uint64_t size) {
+    uint64_t pages = (size + 0x1000 - 1) / 0x1000;
+    if (!pages) {
+        pages = 1;
+    }
+
+    uint64_t free_page = pmm_alloc_pages(pages);
+    if (free_page == PMM_NO_PAGE) {
+        return (void *) 0;
+    }
+
+    return (void *) (free_page * 0x1000);
+}
+
+/* Same as pmm_alloc, but the memory comes back zeroed. Single frames
+   usually come from the pool, so the caller doesn't pay for the zeroing */
+void *pmm_alloc_zeroed(uint64_t size) {
+    uint64_t pages = (size + 0x1000 - 1) / 0x1000;
+    if (!pages) {
+        pages = 1;
+    }
+
+    if (pages == 1) {
+        uint64_t page = pmm_zero_pool_take(pmm_cur_node());
+        if (page != PMM_NO_PAGE) {
+            return (void *) (page * 0x1000);
+        }
+    }
+
+    void *ret = pmm_alloc(pages * 0x1000);
+    pmm_zero_pages((uint64_t) ret / 0x1000, pages);
+    return ret;
+}
+
+/* Zero one more frame for the pool, called by idle CPUs. Returns 0 when
+   there is nothing to do, so the caller can halt */
+uint8_t pmm_zero_pool_fill() {
+    if (!pmm_cpu_caches_enabled) {
+        return 0;
+    }
+
+    uint8_t node = pmm_cur_node(); // Each node's idle CPUs fill its own pool
+    if (zero_pool_count[node] >= PMM_ZERO_POOL_TARGET) {
+        return 0;
+    }
+
+    uint64_t page = pmm_alloc_pages(1);
+    if (page == PMM_NO_PAGE) {
+        return 0;
+    }
+    if (pmm_page_node(page) != node) {
+        pmm_unalloc((void *) (page * 0x1000), 0x1000); // The node is out of memory, leave the rest alone
+        return 0;
+    }
+    pmm_zero_pages(page, 1); // Interrupts stay on, this is the slow part
+
+    interrupt_state_t state = interrupt_lock();
+    lock(zero_pool_lock);
+    pmm_pages[page].next = zero_pool[node];
+    zero_pool[node] = page;
+    zero_pool_count[node]++;
+    unlock(zero_pool_lock);
+    interrupt_unlock(state);
+    return 1;
+}
+
+/* Find the free block that holds a page, its head is the only page with
+   the order set. Max order blocks count too, they sit in the extent tree */
+static uint64_t buddy_find_free(uint64_t page, uint8_t *order_out) {
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        uint64_t head = page & ~((1UL << order) - 1);
+        if (pmm_pages[head].order == order) {
+            *order_out = order;
+            return head;
+        }
+    }
+    return PMM_NO_PAGE;
+}
+
+// Take one page out of the free block holding it, the rest of the block stays free
+static void buddy_claim_page(uint64_t page) {
+    uint8_t order = 0;
+    uint64_t head = buddy_find_free(page, &order);
+    if (order == PMM_MAX_ORDER) {
+        extent_remove_block(head, pmm_page_node(head));
+    } else {
+        buddy_list_remove(head, order);
+    }
+
+    while (order) {
+        order--;
+        uint64_t half = head + (1UL << order);
+        if (page >= half) {
+            buddy_list_add(head, order);
+            head = half;
+        } else {
+            buddy_list_add(half, order);
+        }
+    }
+}
+
+/* Grow an allocation in place by claiming the free pages right after it.
+   Returns 0 without changing anything if one of them isn't free. The new
+   frames come back zeroed */
+uint8_t pmm_try_extend(void *addr, uint64_t pages, uint64_t new_pages) {
+    uint64_t start = (uint64_t) addr / 0x1000 + pages;
+    uint64_t end = (uint64_t) addr / 0x1000 + new_pages;
+    if (end > pmm_max_page) {
+        return 0;
+    }
+
+    interrupt_state_t state = interrupt_lock();
+    lock(pmm_lock);
+
+    uint8_t order = 0;
+    for (uint64_t page = start; page < end; page++) {
+        if (buddy_find_free(page, &order) == PMM_NO_PAGE) {
+            unlock(pmm_lock);
+            interrupt_unlock(state);
+            return 0;
+        }
+    }
+
+    for (uint64_t page = start; page < end; page++) {
+        buddy_claim_page(page);
+    }
+    available_memory -= (end - start) * 0x1000;
+    used_memory += (end - start) * 0x1000;
+
+    unlock(pmm_lock);
+    interrupt_unlock(state);
+
+    pmm_zero_pages(start, end - start);
+    return 1;
+}
+
 uint64_t cur_pain = 0;
 void pmm_unalloc(void *addr, uint64_t size) {
     if ((uint64_t) addr <= cur_pain && cur_pain < (uint64_t) addr + size) {
@@ -172,13 +928,10 @@ void pmm_unalloc(void *addr, uint64_t size) {
         kprintf("pmm_unalloc freeing bad address, caller: %lx, addr: %lx\n", __builtin_return_address(0), addr);
     }
 
-    interrupt_state_t state = interrupt_lock();
-    lock(pmm_lock);
-
     uint64_t page = ((uint64_t) addr & ~(0xfff)) / 0x1000;
     uint64_t pages = (size + 0x1000 - 1) / 0x1000;
 
-    if (page + pages > bitmap_max_page) {
+    if (page + pages > pmm_max_page) {
         kprintf("REEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEE\n");
         kprintf("trying to free bad memory: %lx. Size: %lx\n", addr, size);
         while (1) {
@@ -186,10 +939,17 @@ void pmm_unalloc(void *addr, uint64_t size) {
         }
     }
 
-    for (uint64_t i = 0; i < pages; i++) {
-        pmm_clear_bit(page + i);
+    // Frames from other nodes go straight back, so the cache only hands out local memory
+    if (pages == 1 && pmm_cpu_caches_enabled && pmm_page_node(page) == pmm_cur_node()) {
+        pmm_cache_free(page);
+        return;
     }
 
+    interrupt_state_t state = interrupt_lock();
+    lock(pmm_lock);
+
+    buddy_free_range(page, pages);
+
     available_memory += pages * 0x1000;
     used_memory -= pages * 0x1000;
 
@@ -197,6 +957,210 @@ void pmm_unalloc(void *addr, uint64_t size) {
     interrupt_unlock(state);
 }
 
+/* Frame reference counts for pages shared between address spaces. A count
+   of 0 means the frame has a single owner and was never shared */
+void pmm_frame_share(void *addr) {
+    uint64_t page = (uint64_t) addr / 0x1000;
+    if (page >= pmm_max_page) {
+        return;
+    }
+
+    // Only the single owner can see 0 here, so nobody else is racing us
+    if (!pmm_pages[page].ref_count) {
+        pmm_pages[page].ref_count = 1;
+    }
+    atomic_inc(&pmm_pages[page].ref_count);
+}
+
+/* Drop a reference, returns 1 if the caller held the last one and should free the frame */
+uint8_t pmm_frame_release(void *addr) {
+    uint64_t page = (uint64_t) addr / 0x1000;
+    if (page >= pmm_max_page || !pmm_pages[page].ref_count) {
+        return 1;
+    }
+
+    return !atomic_dec(&pmm_pages[page].ref_count);
+}
+
+uint32_t pmm_frame_refs(void *addr) {
+    uint64_t page = (uint64_t) addr / 0x1000;
+    if (page >= pmm_max_page) {
+        return 0;
+    }
+    return pmm_pages[page].ref_count;
+}
+
+/* Reverse map bookkeeping, called by the VMM for every user page table
+   entry it creates or removes. 2M pages count once per 4K frame */
+void pmm_frame_map(void *addr) {
+    uint64_t page = (uint64_t) addr / 0x1000;
+    if (page >= pmm_max_page) {
+        return;
+    }
+    atomic_inc(&pmm_pages[page].map_count);
+}
+
+void pmm_frame_unmap(void *addr) {
+    uint64_t page = (uint64_t) addr / 0x1000;
+    if (page >= pmm_max_page || !pmm_pages[page].map_count) {
+        return;
+    }
+    atomic_dec(&pmm_pages[page].map_count);
+}
+
+uint32_t pmm_frame_maps(void *addr) {
+    uint64_t page = (uint64_t) addr / 0x1000;
+    if (page >= pmm_max_page) {
+        return 0;
+    }
+    return pmm_pages[page].map_count;
+}
+
+/* Queue a frame to be freed once nothing can reach it anymore (e.g. after a
+   TLB shootdown). The queue is linked through the page descriptors */
+void pmm_defer_unalloc(void *addr, uint32_t *list) {
+    uint64_t page = (uint64_t) addr / 0x1000;
+    if (page >= pmm_max_page) {
+        return; // Not memory the PMM hands out
+    }
+    pmm_pages[page].next = *list;
+    *list = page;
+}
+
+/* Free a whole list straight into the buddy allocator, a batch at a time,
+   instead of going through the lock once per frame */
+void pmm_unalloc_deferred(uint32_t list) {
+    while (list != PMM_NO_PAGE) {
+        uint64_t freed = 0;
+        interrupt_state_t state = interrupt_lock();
+        lock(pmm_lock);
+
+        while (list != PMM_NO_PAGE && freed < PMM_FREE_BATCH) {
+            uint32_t next = pmm_pages[list].next;
+            buddy_free_block(list, 0);
+            list = next;
+            freed++;
+        }
+
+        available_memory += freed * 0x1000;
+        used_memory -= freed * 0x1000;
+
+        unlock(pmm_lock);
+        interrupt_unlock(state);
+    }
+}
+
+/* NUMA layout, filled in from the SRAT before pmm_numa_setup */
+void pmm_numa_add_range(uint64_t base, uint64_t length, uint8_t node) {
+    if (node_range_count == PMM_MAX_NODE_RANGES || node >= PMM_MAX_NODES) {
+        sprintf("[PMM] Ignoring NUMA range %lx - %lx\n", base, base + length);
+        return;
+    }
+
+    node_ranges[node_range_count].start = base / 0x1000;
+    node_ranges[node_range_count].end = (base + length) / 0x1000;
+    node_ranges[node_range_count].node = node;
+    node_range_count++;
+}
+
+void pmm_numa_set_cpu(uint8_t apic_id, uint8_t node) {
+    apic_nodes[apic_id] = node;
+}
+
+uint8_t pmm_cpu_node(uint8_t apic_id) {
+    return apic_nodes[apic_id] < pmm_node_count ? apic_nodes[apic_id] : 0;
+}
+
+/* Switch to per node free lists. Everything free is on node 0's lists so
+   far, so it all gets pulled off and freed again into the right node.
+   Must run before the other CPUs are started */
+void pmm_numa_setup(uint8_t node_count, uint8_t distances[PMM_MAX_NODES][PMM_MAX_NODES]) {
+    if (node_count < 2) {
+        node_range_count = 0;
+        return;
+    }
+
+    /* Sort every node's fallback list by distance */
+    for (uint8_t n = 0; n < node_count; n++) {
+        for (uint8_t i = 0; i < node_count; i++) {
+            node_order[n][i] = i;
+        }
+        for (uint8_t i = 1; i < node_count; i++) {
+            for (uint8_t j = i; j > 0 && distances[n][node_order[n][j]] < distances[n][node_order[n][j - 1]]; j--) {
+                uint8_t tmp = node_order[n][j];
+                node_order[n][j] = node_order[n][j - 1];
+                node_order[n][j - 1] = tmp;
+            }
+        }
+    }
+
+    interrupt_state_t state = interrupt_lock();
+    lock(pmm_lock);
+
+    /* Take every block off the lists first, with the order kept in prev.
+       Blocks that are off the lists have no order, so nothing merges with
+       them. Until the nodes are filled in below, node 0 still has everything */
+    uint8_t range_count = node_range_count;
+    node_range_count = 0;
+    uint32_t pending = PMM_NO_PAGE;
+    for (uint8_t order = 0; order < PMM_MAX_ORDER; order++) {
+        while (free_lists[0][order] != PMM_NO_PAGE) {
+            uint32_t page = free_lists[0][order];
+            buddy_list_remove(page, order);
+            pmm_pages[page].next = pending;
+            pmm_pages[page].prev = order;
+            pending = page;
+        }
+    }
+
+    uint64_t block;
+    while ((block = extent_take(1, 0)) != PMM_NO_PAGE) {
+        pmm_pages[block].next = pending;
+        pmm_pages[block].prev = PMM_MAX_ORDER;
+        pending = (uint32_t) block;
+    }
+
+    pmm_node_count = node_count;
+    node_range_count = range_count;
+
+    /* Every page keeps its node in the descriptor. The ranges go in back to
+       front so the first one listed wins where they overlap */
+    for (uint8_t i = range_count; i > 0; i--) {
+        pmm_node_range_t *range = &node_ranges[i - 1];
+        uint64_t end = range->end < pmm_max_page ? range->end : pmm_max_page;
+        for (uint64_t page = range->start; page < end; page++) {
+            pmm_pages[page].node = range->node;
+        }
+    }
+
+    while (pending != PMM_NO_PAGE) {
+        uint32_t next = pmm_pages[pending].next;
+        uint8_t order = (uint8_t) pmm_pages[pending].prev;
+        pmm_pages[pending].next = PMM_NO_PAGE;
+        pmm_pages[pending].prev = PMM_NO_PAGE;
+        buddy_free_nodes(pending, 1UL << order);
+        pending = next;
+    }
+
+    unlock(pmm_lock);
+    interrupt_unlock(state);
+}
+
+/* Copy out the free block counts for every node and order, and how many
+   zeroed frames each node has waiting */
+void pmm_get_free_blocks(uint64_t counts[PMM_MAX_NODES][PMM_MAX_ORDER + 1], uint64_t zeroed[PMM_MAX_NODES]) {
+    interrupt_state_t state = interrupt_lock();
+    lock(pmm_lock);
+    for (uint8_t n = 0; n < PMM_MAX_NODES; n++) {
+        for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+            counts[n][order] = free_counts[n][order];
+        }
+        zeroed[n] = zero_pool_count[n];
+    }
+    unlock(pmm_lock);
+    interrupt_unlock(state);
+}
+
 uint64_t pmm_get_free_mem() {
     return available_memory;
 }
@@ -6,6 +6,63 @@
 #define SIZE_OFFSET 8
 #define PTR_AND_ADDR_SIZE 16
 
+#define PMM_MAX_ORDER 10 // Largest buddy block is 4 MiB
+#define PMM_NO_PAGE 0xFFFFFFFF
+#define PMM_ORDER_NONE 0xFF
+
+#define PMM_PAGE_KMALLOC (1<<0) // First page of a page sized kmalloc allocation
+
+#define PMM_CPU_CACHE_SIZE 64
+#define PMM_CPU_CACHE_BATCH 32
+
+#define PMM_FREE_BATCH 256 // Frames given back per pmm_lock hold by pmm_unalloc_deferred
+#define PMM_ZERO_POOL_TARGET 256 // Zeroed frames the idle CPUs keep ready, per node
+
+#define PMM_MAX_NODES 8
+#define PMM_MAX_NODE_RANGES 32
+
+/* Descriptor for every physical page. Only the first page of a free block
+   has an order set, and only it is linked into the free list */
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+    uint8_t order;
+    uint8_t flags;
+    uint8_t node; // NUMA node the page belongs to
+    uint16_t pcid; // PCID of the address space if this frame is a P4 table
+    union {
+        uint32_t alloc_pages; // Size of the kmalloc allocation starting at this page
+        uint32_t rss; // User pages mapped, if this frame is a P4 table
+    };
+    uint32_t ref_count; // Address spaces sharing this frame, 0 if it was never shared
+    uint32_t map_count; // User page table entries pointing at this frame
+    uint32_t vmm_lock; // Lock for the user half page tables if this frame is a P4 table
+} pmm_page_t;
+
+// Physical pages [start, end) that belong to a NUMA node
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint8_t node;
+} pmm_node_range_t;
+
+/* Slot for every max order block, for the tree of free runs. Only the first
+   and last block of a run have anything set */
+typedef struct {
+    uint32_t left;
+    uint32_t right;
+    uint32_t parent;
+    uint32_t length; // Blocks in the run, kept in its first block
+    uint32_t head; // First block of the run, kept in its last block
+    uint8_t red;
+} pmm_extent_t;
+
+// Per-CPU magazine of free 4 KiB frames (page numbers), lives in cpu_locals_t
+typedef struct {
+    uint64_t count;
+    uint64_t frames[PMM_CPU_CACHE_SIZE];
+} __attribute__((packed)) pmm_cpu_cache_t;
+
 typedef void *symbol[];
 
 extern symbol __kernel_end;
@@ -15,11 +72,33 @@ extern symbol __kernel_code_end;
 
 void pmm_memory_setup(stivale_info_t *bootloader_info);
 void *pmm_alloc(uint64_t size);
+void *pmm_try_alloc(uint64_t size);
+void *pmm_alloc_zeroed(uint64_t size);
+void *pmm_alloc_node(uint64_t size, uint8_t node);
+uint8_t pmm_zero_pool_fill();
 void pmm_unalloc(void *addr, uint64_t size);
+uint8_t pmm_try_extend(void *addr, uint64_t pages, uint64_t new_pages);
 uint64_t pmm_get_used_mem();
 uint64_t pmm_get_free_mem();
 uint64_t pmm_get_total_mem();
+void pmm_get_free_blocks(uint64_t counts[PMM_MAX_NODES][PMM_MAX_ORDER + 1], uint64_t zeroed[PMM_MAX_NODES]);
+void pmm_frame_share(void *addr);
+uint8_t pmm_frame_release(void *addr);
+uint32_t pmm_frame_refs(void *addr);
+void pmm_frame_map(void *addr);
+void pmm_frame_unmap(void *addr);
+uint32_t pmm_frame_maps(void *addr);
+void pmm_defer_unalloc(void *addr, uint32_t *list);
+void pmm_unalloc_deferred(uint32_t list);
+void pmm_numa_add_range(uint64_t base, uint64_t length, uint8_t node);
+void pmm_numa_set_cpu(uint8_t apic_id, uint8_t node);
+uint8_t pmm_cpu_node(uint8_t apic_id);
+void pmm_numa_setup(uint8_t node_count, uint8_t distances[PMM_MAX_NODES][PMM_MAX_NODES]);
 
 extern uint64_t cur_pain;
+extern pmm_page_t *pmm_pages;
+extern uint8_t pmm_cpu_caches_enabled;
+extern uint64_t pmm_max_page;
+extern uint8_t pmm_node_count;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,208 @@
+#include "slab.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "mm/memstat.h"
+#include "klibc/math.h"
+#include "klibc/stdlib.h"
+#include "klibc/string.h"
+#include "drivers/serial.h"
+
+#define SLAB_HEADER_SIZE ROUND_UP(sizeof(slab_t), SLAB_ALIGN)
+
+/* Power of two caches backing kmalloc */
+static slab_cache_t size_caches[] = {
+    SLAB_CACHE_INIT("kmalloc-16", 16),
+    SLAB_CACHE_INIT("kmalloc-32", 32),
+    SLAB_CACHE_INIT("kmalloc-64", 64),
+    SLAB_CACHE_INIT("kmalloc-128", 128),
+    SLAB_CACHE_INIT("kmalloc-256", 256),
+    SLAB_CACHE_INIT("kmalloc-512", 512),
+    SLAB_CACHE_INIT("kmalloc-1024", 1024),
+};
+
+/* Caches join this list the first time they're used and never leave it,
+   so it can be walked without the lock */
+static slab_cache_t *cache_list = (slab_cache_t *) 0;
+
+slab_cache_t *slab_cache_list() {
+    return cache_list;
+}
+
+slab_cache_t *slab_size_cache(uint64_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        return (slab_cache_t *) 0;
+    }
+
+    uint64_t index = 0;
+    while ((uint64_t) (SLAB_MIN_SIZE << index) < size) {
+        index++;
+    }
+    return &size_caches[index];
+}
+
+#ifdef KMALLOC_GUARD
+/* The debug heap gives every object its own guarded pages instead */
+void *slab_alloc(slab_cache_t *cache) {
+    return kcalloc(cache->object_size);
+}
+
+void slab_free(void *obj) {
+    kfree(obj);
+}
+
+void slab_free_caller(void *obj, uint64_t caller) {
+    (void) caller;
+    kfree(obj);
+}
+#else
+static lock_t cache_list_lock = {0, 0, 0, 0};
+
+/* kmalloc records its own allocations, objects from named caches are
+   recorded here so every free has an allocation to match */
+static uint8_t slab_named_cache(slab_cache_t *cache) {
+    return cache < size_caches || cache >= size_caches + sizeof(size_caches) / sizeof(size_caches[0]);
+}
+
+static slab_t *slab_grow(slab_cache_t *cache) {
+    slab_t *slab = GET_HIGHER_HALF(slab_t *, pmm_alloc(0x1000));
+    slab->magic = SLAB_MAGIC;
+    slab->in_use = 0;
+    slab->cache = cache;
+    slab->prev = (slab_t *) 0;
+    slab->next = cache->partial;
+    if (cache->partial) {
+        cache->partial->prev = slab;
+    }
+    cache->partial = slab;
+
+    /* Chain every object into the free list */
+    uint8_t *objects = (uint8_t *) slab + SLAB_HEADER_SIZE;
+    slab->free_list = objects;
+    for (uint64_t i = 0; i < cache->objects_per_slab; i++) {
+        void **obj = (void **) (objects + i * cache->object_size);
+        *obj = (i + 1 < cache->objects_per_slab) ? (void *) (objects + (i + 1) * cache->object_size) : (void *) 0;
+    }
+
+    cache->slab_count++;
+    cache->empty_slabs++;
+    return slab;
+}
+
+static void slab_unlink(slab_cache_t *cache, slab_t *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = (slab_t *) 0;
+    slab->prev = (slab_t *) 0;
+}
+
+/* Returns a zeroed object from the cache */
+void *slab_alloc(slab_cache_t *cache) {
+    interrupt_state_t state = interrupt_lock();
+    lock(cache->cache_lock);
+
+    if (!cache->objects_per_slab) {
+        cache->object_size = ROUND_UP(cache->object_size, SLAB_ALIGN);
+        cache->objects_per_slab = (0x1000 - SLAB_HEADER_SIZE) / cache->object_size;
+        assert(cache->objects_per_slab);
+
+        lock(cache_list_lock);
+        cache->next_cache = cache_list;
+        cache_list = cache;
+        unlock(cache_list_lock);
+    }
+
+    slab_t *slab = cache->partial;
+    if (!slab) {
+        slab = slab_grow(cache);
+    }
+
+    if (!slab->in_use) {
+        cache->empty_slabs--;
+    }
+
+    void **obj = slab->free_list;
+    slab->free_list = *obj;
+    slab->in_use++;
+    cache->objects_in_use++;
+
+    // Full slabs aren't on any list until something in them is freed
+    if (!slab->free_list) {
+        slab_unlink(cache, slab);
+    }
+
+    unlock(cache->cache_lock);
+    interrupt_unlock(state);
+
+    memset((uint8_t *) obj, 0, cache->object_size);
+    if (memstat_profiling && slab_named_cache(cache)) {
+        memstat_record_alloc((uint64_t) __builtin_return_address(0), cache->object_size);
+    }
+    return obj;
+}
+
+void slab_free(void *obj) {
+    slab_free_caller(obj, (uint64_t) __builtin_return_address(0));
+}
+
+// Frees for kfree get counted against kfree's caller
+void slab_free_caller(void *obj, uint64_t caller) {
+    slab_t *slab = (slab_t *) ((uint64_t) obj & ~(0xfff));
+    if (slab->magic != SLAB_MAGIC) {
+        sprintf("slab_free: bad object %lx, caller: %lx\n", obj, caller);
+        panic("slab_free on something that isn't a slab object");
+    }
+
+    slab_cache_t *cache = slab->cache;
+    if (memstat_profiling) {
+        memstat_record_free(caller, cache->object_size);
+    }
+    interrupt_state_t state = interrupt_lock();
+    lock(cache->cache_lock);
+
+    // Slab was full, so it goes back on the partial list
+    if (!slab->free_list) {
+        slab->prev = (slab_t *) 0;
+        slab->next = cache->partial;
+        if (cache->partial) {
+            cache->partial->prev = slab;
+        }
+        cache->partial = slab;
+    }
+
+    *(void **) obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    cache->objects_in_use--;
+
+    /* Keep one empty slab around so we don't bounce pages to the PMM */
+    uint8_t release = 0;
+    if (!slab->in_use) {
+        if (cache->empty_slabs) {
+            slab_unlink(cache, slab);
+            cache->slab_count--;
+            slab->magic = 0;
+            release = 1;
+        } else {
+            cache->empty_slabs++;
+        }
+    }
+
+    unlock(cache->cache_lock);
+    interrupt_unlock(state);
+
+    if (release) {
+        pmm_unalloc(GET_LOWER_HALF(void *, slab), 0x1000);
+    }
+}
+
+uint64_t slab_object_size(void *obj) {
+    slab_t *slab = (slab_t *) ((uint64_t) obj & ~(0xfff));
+    return slab->cache->object_size;
+}
+#endif
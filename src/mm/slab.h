@@ -0,0 +1,44 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <stdint.h>
+#include "klibc/lock.h"
+
+#define SLAB_MAGIC 0x51AB51AB
+#define SLAB_ALIGN 16
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 1024 // Anything bigger gets whole pages
+
+struct slab_cache;
+
+/* Header at the start of every slab page, objects follow it */
+typedef struct slab {
+    uint32_t magic;
+    uint32_t in_use;
+    struct slab_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    void *free_list;
+} slab_t;
+
+typedef struct slab_cache {
+    const char *name;
+    uint64_t object_size;
+    uint64_t objects_per_slab;
+    uint64_t slab_count;
+    uint64_t empty_slabs;
+    uint64_t objects_in_use;
+    slab_t *partial; // Slabs with at least one free object
+    lock_t cache_lock;
+    struct slab_cache *next_cache; // Every cache that has been used, for the memory stats
+} slab_cache_t;
+
+#define SLAB_CACHE_INIT(cache_name, size) {cache_name, size, 0, 0, 0, 0, 0, {0, 0, 0, 0}, 0}
+
+void *slab_alloc(slab_cache_t *cache);
+void slab_free(void *obj);
+void slab_free_caller(void *obj, uint64_t caller);
+uint64_t slab_object_size(void *obj);
+slab_cache_t *slab_size_cache(uint64_t size);
+slab_cache_t *slab_cache_list();
+
+#endif
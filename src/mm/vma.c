@@ -0,0 +1,225 @@
+#include "vma.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "mm/slab.h"
+#include "klibc/stdlib.h"
+#include "klibc/string.h"
+#include <stddef.h>
+
+static slab_cache_t vma_cache = SLAB_CACHE_INIT("vma_t", sizeof(vma_t));
+
+static vma_t *vma_find(vma_list_t *list, uint64_t addr) {
+    for (vma_t *vma = list->head; vma && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) {
+            return vma;
+        }
+    }
+    return NULL;
+}
+
+static void vma_link(vma_list_t *list, uint64_t start, uint64_t end, uint16_t perms, uint8_t flags) {
+    vma_t *new_vma = slab_alloc(&vma_cache);
+    new_vma->start = start;
+    new_vma->end = end;
+    new_vma->perms = perms;
+    new_vma->flags = flags;
+
+    vma_t **link = &list->head;
+    while (*link && (*link)->start < start) {
+        link = &(*link)->next;
+    }
+    new_vma->next = *link;
+    *link = new_vma;
+}
+
+/* Add a new area, returns 1 if it overlaps an existing one. Only areas
+   asked for as at least one aligned 2 MiB block get huge pages, so a
+   stray touch of a small mapping never commits 2 MiB */
+int vma_add(vma_list_t *list, uint64_t start, uint64_t end, uint16_t perms) {
+    interrupt_state_t state = interrupt_lock();
+    lock(list->vma_lock);
+
+    for (vma_t *vma = list->head; vma && vma->start < end; vma = vma->next) {
+        if (start < vma->end) {
+            unlock(list->vma_lock);
+            interrupt_unlock(state);
+            return 1;
+        }
+    }
+    uint8_t flags = !(start & 0x1fffff) && end - start >= 0x200000 ? VMA_HUGE : 0;
+    vma_link(list, start, end, perms, flags);
+
+    unlock(list->vma_lock);
+    interrupt_unlock(state);
+    return 0;
+}
+
+/* Cover a range, leaving parts that already have an area alone (ELF segments can share pages) */
+void vma_fill(vma_list_t *list, uint64_t start, uint64_t end, uint16_t perms) {
+    interrupt_state_t state = interrupt_lock();
+    lock(list->vma_lock);
+
+    uint64_t cur = start;
+    while (cur < end) {
+        vma_t *vma = vma_find(list, cur);
+        if (vma) {
+            cur = vma->end;
+            continue;
+        }
+
+        uint64_t gap_end = end;
+        for (vma = list->head; vma; vma = vma->next) {
+            if (vma->start > cur) {
+                if (vma->start < gap_end) {
+                    gap_end = vma->start;
+                }
+                break;
+            }
+        }
+
+        vma_link(list, cur, gap_end, perms, 0);
+        cur = gap_end;
+    }
+
+    unlock(list->vma_lock);
+    interrupt_unlock(state);
+}
+
+/* Remove a range, splitting any area that only partly overlaps it */
+void vma_remove(vma_list_t *list, uint64_t start, uint64_t end) {
+    interrupt_state_t state = interrupt_lock();
+    lock(list->vma_lock);
+
+    vma_t **link = &list->head;
+    while (*link && (*link)->start < end) {
+        vma_t *vma = *link;
+        if (vma->end <= start) {
+            link = &vma->next;
+            continue;
+        }
+
+        if (vma->start < start && vma->end > end) {
+            vma_link(list, end, vma->end, vma->perms, vma->flags);
+            vma->end = start;
+            break;
+        } else if (vma->start < start) {
+            vma->end = start;
+            link = &vma->next;
+        } else if (vma->end > end) {
+            vma->start = end;
+            break;
+        } else {
+            *link = vma->next;
+            kfree(vma);
+        }
+    }
+
+    unlock(list->vma_lock);
+    interrupt_unlock(state);
+}
+
+void vma_clone(vma_list_t *src, vma_list_t *dst) {
+    interrupt_state_t state = interrupt_lock();
+    lock(src->vma_lock);
+    lock(dst->vma_lock);
+
+    vma_t **link = &dst->head;
+    for (vma_t *vma = src->head; vma; vma = vma->next) {
+        vma_t *new_vma = slab_alloc(&vma_cache);
+        new_vma->start = vma->start;
+        new_vma->end = vma->end;
+        new_vma->perms = vma->perms;
+        new_vma->flags = vma->flags;
+        *link = new_vma;
+        link = &new_vma->next;
+    }
+
+    unlock(dst->vma_lock);
+    unlock(src->vma_lock);
+    interrupt_unlock(state);
+}
+
+void vma_clear(vma_list_t *list) {
+    interrupt_state_t state = interrupt_lock();
+    lock(list->vma_lock);
+
+    vma_t *vma = list->head;
+    while (vma) {
+        vma_t *next = vma->next;
+        kfree(vma);
+        vma = next;
+    }
+    list->head = NULL;
+
+    unlock(list->vma_lock);
+    interrupt_unlock(state);
+}
+
+// Whether a fault in this area can be backed by the 2 MiB page at huge_base
+static uint8_t vma_huge_fits(vma_t *vma, uint64_t huge_base, void *p4) {
+    return (vma->flags & VMA_HUGE) && vma->start <= huge_base && huge_base + 0x200000 <= vma->end
+        && vmm_huge_slot_free((void *) huge_base, p4);
+}
+
+/* Fault in a zeroed page if the address is inside an area, returns 1 if it was */
+int vma_handle_fault(vma_list_t *list, void *p4, void *addr) {
+    uint64_t page = (uint64_t) addr & ~(0xfff);
+    uint64_t huge_base = page & ~(0x1fffffUL);
+    interrupt_state_t state = interrupt_lock();
+    lock(list->vma_lock);
+
+    vma_t *vma = vma_find(list, page);
+    if (!vma) {
+        unlock(list->vma_lock);
+        interrupt_unlock(state);
+        return 0;
+    }
+
+    /* Zeroing 2 MiB takes a while, so it happens without the lock and
+       everything gets checked again once the lock is back */
+    if (vma_huge_fits(vma, huge_base, p4)) {
+        unlock(list->vma_lock);
+        interrupt_unlock(state);
+
+        void *huge_phys = pmm_try_alloc(0x200000);
+        if (huge_phys) {
+            memset(GET_HIGHER_HALF(uint8_t *, huge_phys), 0, 0x200000);
+        }
+
+        state = interrupt_lock();
+        lock(list->vma_lock);
+        vma = vma_find(list, page);
+        if (huge_phys && vma && vma_huge_fits(vma, huge_base, p4)) {
+            if (!vmm_map_pages(huge_phys, (void *) huge_base, p4, 512, vma->perms)) {
+                unlock(list->vma_lock);
+                interrupt_unlock(state);
+                return 1;
+            }
+
+            // Something else got mapped in there, take back whatever pages of the block made it in
+            for (uint64_t i = 0; i < 512; i++) {
+                uint64_t phys = (uint64_t) virt_to_phys((void *) (huge_base + i * 0x1000), (page_table_t *) p4);
+                if (phys >= (uint64_t) huge_phys && phys < (uint64_t) huge_phys + 0x200000) {
+                    vmm_unmap_pages((void *) (huge_base + i * 0x1000), p4, 1);
+                }
+            }
+        }
+        if (huge_phys) {
+            pmm_unalloc(huge_phys, 0x200000);
+        }
+        if (!vma) {
+            unlock(list->vma_lock);
+            interrupt_unlock(state);
+            return 0;
+        }
+    }
+
+    void *phys = pmm_alloc_zeroed(0x1000);
+    if (vmm_map_pages(phys, (void *) page, p4, 1, vma->perms)) {
+        pmm_unalloc(phys, 0x1000); // Another thread got here first
+    }
+
+    unlock(list->vma_lock);
+    interrupt_unlock(state);
+    return 1;
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#ifndef VMA_H
+#define VMA_H
+#include <stdint.h>
+#include "klibc/lock.h"
+
+#define VMA_HUGE (1 << 0) // Fault in whole 2 MiB pages where the area covers them
+
+/* A range of user address space that is backed by demand zero pages */
+typedef struct vma {
+    uint64_t start;
+    uint64_t end; // Exclusive
+    uint16_t perms; // VMM flags used when a page gets faulted in
+    uint8_t flags;
+    struct vma *next;
+} vma_t;
+
+/* Sorted by start address, no two areas overlap */
+typedef struct {
+    vma_t *head;
+    lock_t vma_lock;
+} vma_list_t;
+
+int vma_add(vma_list_t *list, uint64_t start, uint64_t end, uint16_t perms);
+void vma_fill(vma_list_t *list, uint64_t start, uint64_t end, uint16_t perms);
+void vma_remove(vma_list_t *list, uint64_t start, uint64_t end);
+void vma_clone(vma_list_t *src, vma_list_t *dst);
+void vma_clear(vma_list_t *list);
+int vma_handle_fault(vma_list_t *list, void *p4, void *addr);
+
+#endif
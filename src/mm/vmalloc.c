@@ -0,0 +1,235 @@
+#include "vmalloc.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "mm/slab.h"
+#include "klibc/stdlib.h"
+#include "klibc/string.h"
+#include "klibc/lock.h"
+#include <stddef.h>
+
+static slab_cache_t vmalloc_area_cache = SLAB_CACHE_INIT("vmalloc_area_t", sizeof(vmalloc_area_t));
+
+/* Sorted by start address */
+static vmalloc_area_t *areas = NULL;
+static lock_t vmalloc_lock = {0, 0, 0, 0};
+
+void vmalloc_init() {
+    page_table_t *p4 = GET_HIGHER_HALF(page_table_t *, base_kernel_cr3);
+    vmm_ensure_table(p4, (VMALLOC_START >> 39) & 0x1ff);
+}
+
+static uint8_t is_vmalloc_addr(void *addr) {
+    return (uint64_t) addr >= VMALLOC_START && (uint64_t) addr < VMALLOC_END;
+}
+
+/* First fit, an area needs room for its guard page too. Sets prev to the
+   area the new one goes after */
+static uint64_t vmalloc_find_gap(uint64_t pages, vmalloc_area_t **prev) {
+    uint64_t start = VMALLOC_START;
+    *prev = NULL;
+
+    for (vmalloc_area_t *area = areas; area; area = area->next) {
+        if (area->start - start >= (pages + 1) * 0x1000) {
+            break;
+        }
+        start = area->start + (area->pages + 1) * 0x1000;
+        *prev = area;
+    }
+
+    if (start + (pages + 1) * 0x1000 > VMALLOC_END) {
+        return 0;
+    }
+    return start;
+}
+
+static void vmalloc_link(vmalloc_area_t *area, vmalloc_area_t *prev) {
+    if (prev) {
+        area->next = prev->next;
+        prev->next = area;
+    } else {
+        area->next = areas;
+        areas = area;
+    }
+}
+
+static void vmalloc_unlink(vmalloc_area_t *area) {
+    vmalloc_area_t **link = &areas;
+    while (*link != area) {
+        link = &(*link)->next;
+    }
+    *link = area->next;
+}
+
+static vmalloc_area_t *vmalloc_find(uint64_t start) {
+    for (vmalloc_area_t *area = areas; area && area->start <= start; area = area->next) {
+        if (area->start == start) {
+            return area;
+        }
+    }
+    return NULL;
+}
+
+// Back a range with zeroed frames, one at a time so they don't have to be contiguous
+static void vmalloc_populate(uint64_t virt, uint64_t pages) {
+    for (uint64_t i = 0; i < pages; i++) {
+        void *phys = pmm_alloc_zeroed(0x1000);
+        vmm_map_pages(phys, (void *) (virt + i * 0x1000), (void *) base_kernel_cr3, 1, VMM_PRESENT | VMM_WRITE);
+    }
+}
+
+/* Zeroed memory that only has to be virtually contiguous. Big buffers get
+   single frames stitched together in the vmalloc region, so they don't
+   depend on the PMM finding a contiguous run */
+void *vmalloc(uint64_t size) {
+    if (size < VMALLOC_MIN_SIZE) {
+        return kcalloc(size);
+    }
+
+    uint64_t pages = (size + 0x1000 - 1) / 0x1000;
+    interrupt_state_t state = interrupt_lock();
+    lock(vmalloc_lock);
+
+    vmalloc_area_t *prev;
+    uint64_t start = vmalloc_find_gap(pages, &prev);
+    if (!start) {
+        unlock(vmalloc_lock);
+        interrupt_unlock(state);
+        return NULL;
+    }
+
+    vmalloc_area_t *area = slab_alloc(&vmalloc_area_cache);
+    area->start = start;
+    area->pages = pages;
+    vmalloc_link(area, prev);
+
+    unlock(vmalloc_lock);
+    interrupt_unlock(state);
+
+    vmalloc_populate(start, pages); // The linked area keeps the range reserved
+    return (void *) start;
+}
+
+/* Resize without copying. Growing maps more frames after the area if the
+   space is free, otherwise the existing frames get mapped again somewhere
+   with enough room. Mapping changes happen after vmalloc_lock is dropped,
+   since unmapping waits on a shootdown that a CPU spinning on the lock with
+   interrupts off would never answer. Until then the area keeps its old
+   range reserved */
+void *vrealloc(void *addr, uint64_t new_size) {
+    if (!addr) {
+        return vmalloc(new_size);
+    }
+
+    if (!is_vmalloc_addr(addr)) {
+        if (new_size < VMALLOC_MIN_SIZE) {
+            return krealloc(addr, new_size);
+        }
+
+        // Moving out of the kmalloc heap is the only time anything gets copied
+        void *new_buffer = vmalloc(new_size);
+        if (new_buffer) {
+            uint64_t old_size = kmalloc_size(addr);
+            memcpy((uint8_t *) addr, (uint8_t *) new_buffer, old_size < new_size ? old_size : new_size);
+            kfree(addr);
+        }
+        return new_buffer;
+    }
+
+    uint64_t new_pages = (new_size + 0x1000 - 1) / 0x1000;
+    if (!new_pages) {
+        new_pages = 1;
+    }
+
+    interrupt_state_t state = interrupt_lock();
+    lock(vmalloc_lock);
+
+    vmalloc_area_t *area = vmalloc_find((uint64_t) addr);
+    if (!area) {
+        panic("vrealloc on something that wasn't vmalloc'd");
+    }
+    uint64_t old_pages = area->pages;
+
+    if (new_pages <= old_pages) {
+        unlock(vmalloc_lock);
+        interrupt_unlock(state);
+
+        vmm_unmap_free_pages((void *) (area->start + new_pages * 0x1000), (void *) base_kernel_cr3, old_pages - new_pages);
+
+        state = interrupt_lock();
+        lock(vmalloc_lock);
+        area->pages = new_pages; // Only now can the tail be handed out again
+        unlock(vmalloc_lock);
+        interrupt_unlock(state);
+        return (void *) area->start;
+    }
+
+    uint64_t limit = area->next ? area->next->start : VMALLOC_END;
+    if (limit - area->start >= (new_pages + 1) * 0x1000) {
+        area->pages = new_pages; // Room to grow in place, reserve it before populating
+        unlock(vmalloc_lock);
+        interrupt_unlock(state);
+
+        vmalloc_populate(area->start + old_pages * 0x1000, new_pages - old_pages);
+        return (void *) area->start;
+    }
+
+    /* Reserve the new range with its own area, the old one holds the old range until it's unmapped */
+    vmalloc_area_t *prev;
+    uint64_t start = vmalloc_find_gap(new_pages, &prev);
+    if (!start) {
+        unlock(vmalloc_lock);
+        interrupt_unlock(state);
+        return NULL;
+    }
+
+    vmalloc_area_t *moved = slab_alloc(&vmalloc_area_cache);
+    moved->start = start;
+    moved->pages = new_pages;
+    vmalloc_link(moved, prev);
+
+    unlock(vmalloc_lock);
+    interrupt_unlock(state);
+
+    for (uint64_t i = 0; i < old_pages; i++) {
+        void *phys = virt_to_phys((void *) (area->start + i * 0x1000), (page_table_t *) base_kernel_cr3);
+        vmm_map_pages(phys, (void *) (start + i * 0x1000), (void *) base_kernel_cr3, 1, VMM_PRESENT | VMM_WRITE);
+    }
+    vmm_unmap_pages((void *) area->start, (void *) base_kernel_cr3, old_pages);
+    vmalloc_populate(start + old_pages * 0x1000, new_pages - old_pages);
+
+    state = interrupt_lock();
+    lock(vmalloc_lock);
+    vmalloc_unlink(area);
+    unlock(vmalloc_lock);
+    interrupt_unlock(state);
+
+    slab_free(area);
+    return (void *) start;
+}
+
+void vfree(void *addr) {
+    if (!is_vmalloc_addr(addr)) {
+        kfree(addr);
+        return;
+    }
+
+    interrupt_state_t state = interrupt_lock();
+    lock(vmalloc_lock);
+    vmalloc_area_t *area = vmalloc_find((uint64_t) addr);
+    if (!area) {
+        panic("vfree on something that wasn't vmalloc'd");
+    }
+    unlock(vmalloc_lock);
+    interrupt_unlock(state);
+
+    /* Unmapped while still linked, so the range can't be handed out before it's flushed */
+    vmm_unmap_free_pages(addr, (void *) base_kernel_cr3, area->pages);
+
+    state = interrupt_lock();
+    lock(vmalloc_lock);
+    vmalloc_unlink(area);
+    unlock(vmalloc_lock);
+    interrupt_unlock(state);
+
+    slab_free(area);
+}
\ No newline at end of file
@@ -0,0 +1,24 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+#include <stdint.h>
+
+/* One P4 entry of the kernel half. Its P3 is made at boot, so every address
+   space forked from the kernel's sees the same mappings */
+#define VMALLOC_START 0xFFFFC00000000000
+#define VMALLOC_END 0xFFFFC08000000000
+
+#define VMALLOC_MIN_SIZE 0x10000 // Anything smaller comes from kmalloc
+
+/* Area of the vmalloc region. It's followed by an unmapped guard page */
+typedef struct vmalloc_area {
+    uint64_t start;
+    uint64_t pages;
+    struct vmalloc_area *next;
+} vmalloc_area_t;
+
+void vmalloc_init();
+void *vmalloc(uint64_t size);
+void *vrealloc(void *addr, uint64_t new_size);
+void vfree(void *addr);
+
+#endif
\ No newline at end of file
@@ -8,23 +8,142 @@
 #include <stddef.h>
 
 #include "proc/scheduler.h"
+#include "proc/event.h"
+#include "sys/smp.h"
+#include "sys/apic.h"
+#include "klibc/hashmap.h"
+#include "io/msr.h"
 
-lock_t vmm_spinlock = {0, 0, 0, 0}; // Spinlock for the VMM
+lock_t vmm_kernel_lock = {0, 0, 0, 0}; // Lock for the kernel half page tables, every space shares them
 uint64_t base_kernel_cr3 = 0;
 
 uint64_t cache_line_size = 0;
 uint8_t vmm_complete = 0;
+int8_t vmm_1g_pages = -1; // Whether the CPU supports 1 GiB pages, -1 if not checked yet
+
+/* The shootdown in flight, only one at a time */
+lock_t shootdown_lock = {0, 0, 0, 0};
+volatile uint64_t shootdown_start = 0;
+volatile uint64_t shootdown_end = 0;
+volatile uint32_t shootdown_pending = 0;
+
+/* Address spaces waiting for the reclaim thread */
+lock_t teardown_lock = {0, 0, 0, 0};
+uint32_t teardown_queue = PMM_NO_PAGE;
+event_t teardown_event = 0;
+
+uint8_t vmm_pcid_enabled = 0;
+lock_t pcid_lock = {0, 0, 0, 0};
+uint64_t pcid_used[VMM_PCID_COUNT / 64] = {1}; // PCID 0 belongs to the kernel CR3
 
 uint64_t vmm_get_base() {
     uint64_t ret;
     asm volatile("movq %%cr3, %0;" : "=r"(ret));
-    return ret;
+    return ret & ~(0xfffUL); // Leave out the PCID
 }
 
+static uint16_t vmm_pcid_of(uint64_t cr3) {
+    uint64_t page = cr3 / 0x1000;
+    if (page >= pmm_max_page) {
+        return 0;
+    }
+    return pmm_pages[page].pcid;
+}
+
+/* Load a CR3, flushing everything it has in the TLB */
 void vmm_set_base(uint64_t new) {
+    if (vmm_pcid_enabled) {
+        new |= vmm_pcid_of(new);
+    }
+    asm volatile("movq %0, %%cr3;" ::"r"(new) : "memory");
+}
+
+static void vmm_pcid_mark_stale(cpu_locals_t *locals, uint16_t pcid) {
+    asm volatile("lock btsq %1, %0;" : "+m"(locals->pcid_stale[pcid / 64]) : "r"((uint64_t) pcid % 64) : "memory");
+}
+
+static uint8_t vmm_pcid_take_stale(cpu_locals_t *locals, uint16_t pcid) {
+    uint8_t ret;
+    asm volatile("lock btrq %2, %0; setc %1;" : "+m"(locals->pcid_stale[pcid / 64]), "=r"(ret) : "r"((uint64_t) pcid % 64) : "memory");
+    return ret;
+}
+
+/* Switch address spaces. With PCIDs the TLB entries this CPU still has for
+   the space are kept, unless a shootdown marked them stale since */
+void vmm_load_space(uint64_t cr3) {
+    if (!vmm_pcid_enabled) {
+        vmm_set_base(cr3);
+        return;
+    }
+
+    uint16_t pcid = vmm_pcid_of(cr3);
+    uint64_t new = cr3 | pcid;
+
+    /* The locked btr also orders it after the active_cr3 store */
+    if (!vmm_pcid_take_stale(get_cpu_locals(), pcid) && pcid != VMM_PCID_SHARED) {
+        new |= VMM_CR3_NOFLUSH;
+    }
     asm volatile("movq %0, %%cr3;" ::"r"(new) : "memory");
 }
 
+/* Enable PCIDs on this CPU, if the BSP could */
+void vmm_pcid_init() {
+    uint32_t a, b, c, d;
+    if (get_cpu_locals()->cpu_index == 0) {
+        __cpuid(1, a, b, c, d);
+        vmm_pcid_enabled = (c >> 17) & 1;
+    }
+
+    if (vmm_pcid_enabled) {
+        uint64_t cr4;
+        asm volatile("movq %%cr4, %0;" : "=r"(cr4));
+        cr4 |= (1 << 17);
+        asm volatile("movq %0, %%cr4;" ::"r"(cr4) : "memory");
+    }
+}
+
+static uint16_t vmm_pcid_alloc() {
+    uint16_t ret = VMM_PCID_SHARED;
+    lock(pcid_lock);
+    for (uint16_t pcid = 1; pcid < VMM_PCID_SHARED; pcid++) {
+        if (!(pcid_used[pcid / 64] & (1UL << (pcid % 64)))) {
+            pcid_used[pcid / 64] |= (1UL << (pcid % 64));
+            ret = pcid;
+            break;
+        }
+    }
+    unlock(pcid_lock);
+    return ret;
+}
+
+static void vmm_pcid_free(uint16_t pcid) {
+    if (!pcid || pcid == VMM_PCID_SHARED) {
+        return;
+    }
+
+    /* The next owner must not see any of the old space's entries */
+    for (uint64_t i = 0; i < cpu_vector.items_count; i++) {
+        cpu_locals_t *locals = hashmap_get_elem(cpu_locals_list, i);
+        if (locals) {
+            vmm_pcid_mark_stale(locals, pcid);
+        }
+    }
+
+    lock(pcid_lock);
+    pcid_used[pcid / 64] &= ~(1UL << (pcid % 64));
+    unlock(pcid_lock);
+}
+
+/* Get the lock for the page tables covering virt. The user half has its
+   own tables in every address space, so it gets the lock kept with its P4 */
+static volatile uint32_t *vmm_space_lock(void *p4, uint64_t virt) {
+    uint64_t page = (uint64_t) p4 / 0x1000;
+    if (virt >= 0x800000000000 || page >= pmm_max_page) {
+        return &vmm_kernel_lock.lock_dat;
+    }
+    return &pmm_pages[page].vmm_lock;
+}
+
 void vmm_invlpg(uint64_t new) {
     asm volatile("invlpg (%0);" ::"r"(new) : "memory");
 }
@@ -83,15 +202,20 @@ page_table_t *traverse_page_table(page_table_t *cur_table, uint64_t offset) {
 void *virt_to_phys(void *virt, page_table_t *p4) {
     uint64_t page4k_offset = ((uint64_t) virt) & 0xfff;
     uint64_t page2m_offset = ((uint64_t) virt) & 0x1fffff;
+    uint64_t page1g_offset = ((uint64_t) virt) & 0x3fffffff;
     pt_off_t offs = vmm_virt_to_offs(virt);
 
     p4 = GET_HIGHER_HALF(page_table_t *, p4);
 
     page_table_t *p3 = traverse_page_table(p4, offs.p4_off);
     if ((uint64_t) p3 > NORMAL_VMA_OFFSET) {
+        if ((get_entry(p3, offs.p3_off) & (VMM_HUGE | VMM_PRESENT)) == (VMM_HUGE | VMM_PRESENT)) {
+            return (void *) (p3->entries[offs.p3_off] & VMM_1G_PERM_MASK & ~(1UL << 63)) + page1g_offset;
+        }
+
         page_table_t *p2 = traverse_page_table(p3, offs.p3_off);
-        if (get_entry(p2, offs.p2_off) & VMM_HUGE) {
-            return (void *) (p2->entries[offs.p2_off] & VMM_4K_PERM_MASK) + page2m_offset;
+        if ((uint64_t) p2 > NORMAL_VMA_OFFSET && (get_entry(p2, offs.p2_off) & (VMM_HUGE | VMM_PRESENT)) == (VMM_HUGE | VMM_PRESENT)) {
+            return (void *) (p2->entries[offs.p2_off] & VMM_2M_PERM_MASK & ~(1UL << 63)) + page2m_offset;
         }
 
         if ((uint64_t) p2 > NORMAL_VMA_OFFSET) {
@@ -118,18 +242,22 @@ void *kernel_address(void *virt) {
 
 void vmm_ensure_table(page_table_t *table, uint16_t offset) {
     if (!(table->entries[offset] & VMM_PRESENT)) {
-        uint64_t new_table = (uint64_t) pmm_alloc(0x1000);
-        memset(GET_HIGHER_HALF(uint8_t *, new_table), 0, 0x1000);
+        uint64_t new_table = (uint64_t) pmm_alloc_zeroed(0x1000);
         table->entries[offset] = new_table | VMM_PRESENT | VMM_WRITE | VMM_USER;
     }
 }
 
+/* Split a 2M page into 4K pages. The translations stay the same, so any
+   stale TLB entries are still correct until the caller changes something */
 void vmm_remap_to_4k(page_table_t *p2, uint16_t offset) {
     uint64_t new_pml1 = (uint64_t) pmm_alloc(0x1000);
     uint64_t *new_pml1_virt = (void *) (new_pml1 + NORMAL_VMA_OFFSET);
 
-    uint64_t represented_range = p2->entries[offset] & VMM_4K_PERM_MASK;
-    uint64_t perms = p2->entries[offset] & 0xfff;
+    uint64_t represented_range = p2->entries[offset] & VMM_2M_PERM_MASK & ~(1UL << 63);
+    uint64_t perms = p2->entries[offset] & 0xfff & ~((uint64_t) VMM_HUGE);
+    if (p2->entries[offset] & VMM_HUGE_PAT) {
+        perms |= VMM_HUGE; // The 4K PAT bit is in the same place as the huge bit
+    }
     memset((uint8_t *) new_pml1_virt, 0, 0x1000); // Touch the address there in case our data is living there
 
     uint64_t cur_pos = represented_range;
@@ -139,21 +267,131 @@ void vmm_remap_to_4k(page_table_t *p2, uint16_t offset) {
     }
 
     p2->entries[offset] = new_pml1 | VMM_PRESENT | VMM_WRITE | VMM_USER;
-    vmm_invlpg(represented_range); // Invalidate any previous mappings
+}
+
+/* Split a 1G page into 2M pages */
+void vmm_remap_to_2m(page_table_t *p3, uint16_t offset) {
+    uint64_t new_pml2 = (uint64_t) pmm_alloc(0x1000);
+    uint64_t *new_pml2_virt = (void *) (new_pml2 + NORMAL_VMA_OFFSET);
+
+    uint64_t represented_range = p3->entries[offset] & VMM_1G_PERM_MASK & ~(1UL << 63);
+    uint64_t perms = p3->entries[offset] & (0xfff | VMM_HUGE_PAT);
+
+    uint64_t cur_pos = represented_range;
+    for (uint64_t i = 0; i < 512; i++) {
+        new_pml2_virt[i] = cur_pos | perms;
+        cur_pos += 0x200000;
+    }
+
+    p3->entries[offset] = new_pml2 | VMM_PRESENT | VMM_WRITE | VMM_USER;
+}
+
+static uint8_t vmm_has_1g_pages() {
+    if (vmm_1g_pages == -1) {
+        uint32_t a, b, c, d;
+        __cpuid(0x80000001, a, b, c, d);
+        vmm_1g_pages = (d >> 26) & 1;
+    }
+    return vmm_1g_pages;
+}
+
+/* The kernel half is the same in every address space, so its entries are
+   global and survive CR3 loads */
+static uint16_t vmm_global_perms(uint64_t virt, uint16_t perms) {
+    return virt >= NORMAL_VMA_OFFSET ? perms | VMM_GLOBAL : perms;
+}
+
+/* Keep the reverse map in the page descriptors up to date for user entries,
+   and the resident page count kept with the P4 */
+static void vmm_rmap_add(uint64_t entry, void *p4) {
+    if (entry & VMM_PRESENT && entry & VMM_USER) {
+        pmm_frame_map((void *) (entry & VMM_4K_PERM_MASK & ~(1UL << 63)));
+        pmm_pages[(uint64_t) p4 / 0x1000].rss++;
+    }
+}
+
+static void vmm_rmap_remove(uint64_t entry, void *p4) {
+    if (entry & VMM_PRESENT && entry & VMM_USER) {
+        pmm_frame_unmap((void *) (entry & VMM_4K_PERM_MASK & ~(1UL << 63)));
+        pmm_pages[(uint64_t) p4 / 0x1000].rss--;
+    }
+}
+
+/* Try to map a 1G (kernel only) or 2M page at the start of a range. Only
+   empty slots are used. Returns how many 4K pages were covered, or 0 */
+static uint64_t vmm_map_huge(page_table_t *p4, uint64_t virt, uint64_t phys, uint64_t count, uint16_t perms) {
+    pt_off_t offs = vmm_virt_to_offs((void *) virt);
+    void *space = p4;
+    p4 = GET_HIGHER_HALF(page_table_t *, p4);
+
+    if (!(virt & 0x1fffff) && !(phys & 0x1fffff) && count >= 512) {
+        vmm_ensure_table(p4, offs.p4_off);
+        page_table_t *p3 = traverse_page_table(p4, offs.p4_off);
+
+        if (virt >= NORMAL_VMA_OFFSET && !(virt & 0x3fffffff) && !(phys & 0x3fffffff) && count >= 0x40000
+            && !(p3->entries[offs.p3_off] & VMM_PRESENT) && vmm_has_1g_pages()) {
+            p3->entries[offs.p3_off] = phys | vmm_global_perms(virt, perms) | VMM_HUGE;
+            vmm_invlpg(virt);
+            return 0x40000;
+        }
+
+        if (p3->entries[offs.p3_off] & VMM_HUGE) {
+            return 0;
+        }
+
+        vmm_ensure_table(p3, offs.p3_off);
+        page_table_t *p2 = traverse_page_table(p3, offs.p3_off);
+        if (!(p2->entries[offs.p2_off] & VMM_PRESENT)) {
+            p2->entries[offs.p2_off] = phys | vmm_global_perms(virt, perms) | VMM_HUGE;
+            vmm_invlpg(virt);
+
+            if (perms & VMM_USER) {
+                for (uint64_t i = 0; i < 512; i++) {
+                    pmm_frame_map((void *) (phys + i * 0x1000));
+                }
+                pmm_pages[(uint64_t) space / 0x1000].rss += 512;
+            }
+            return 512;
+        }
+    }
+
+    return 0;
+}
+
+/* Check if nothing at all is mapped in the 2M region around an address */
+uint8_t vmm_huge_slot_free(void *virt, void *p4) {
+    pt_off_t offs = vmm_virt_to_offs(virt);
+    page_table_t *table = GET_HIGHER_HALF(page_table_t *, p4);
+
+    if (!(table->entries[offs.p4_off] & VMM_PRESENT)) {
+        return 1;
+    }
+    table = traverse_page_table(table, offs.p4_off);
+
+    if (!(table->entries[offs.p3_off] & VMM_PRESENT)) {
+        return 1;
+    }
+    if (table->entries[offs.p3_off] & VMM_HUGE) {
+        return 0;
+    }
+    table = traverse_page_table(table, offs.p3_off);
+
+    return !(table->entries[offs.p2_off] & VMM_PRESENT);
 }
 
 /* Check if an address is mapped */
 uint8_t is_mapped(void *data) {
     interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
+    volatile uint32_t *space_lock = vmm_space_lock((void *) vmm_get_base(), (uint64_t) data);
+    spinlock_lock(space_lock);
     uint64_t phys_addr = (uint64_t) virt_to_phys(data, (void *) vmm_get_base());
 
     if (phys_addr == 0xFFFFFFFFFFFFFFFF) {
-        unlock(vmm_spinlock);
+        spinlock_unlock(space_lock);
         interrupt_unlock(state);
         return 0;
     } else {
-        unlock(vmm_spinlock);
+        spinlock_unlock(space_lock);
         interrupt_unlock(state);
         return 1;
     }
@@ -162,12 +400,13 @@ uint8_t is_mapped(void *data) {
 uint8_t range_mapped(void *data, uint64_t size) {
     uint64_t cur_addr = (uint64_t) data & ~(0xfff);
     uint64_t addr_not_rounded = (uint64_t) data;
-    uint64_t end_addr = (addr_not_rounded + size) & ~(0xfff);
+    uint64_t end_addr = (addr_not_rounded + size + 0x1000 - 1) & ~(0xfff); // Include the last partial page
     uint64_t rounded_size = end_addr - cur_addr;
     uint64_t pages = ((rounded_size + 0x1000 - 1) / 0x1000);
 
     for (uint64_t i = 0; i < pages; i++) {
-        if (!is_mapped((void *) cur_addr)) {
+        // Demand paged memory counts as mapped, fault it in now for the caller
+        if (!is_mapped((void *) cur_addr) && !vmm_handle_fault((void *) cur_addr, 0)) {
             return 0;
         }
         cur_addr += 0x1000;
@@ -176,67 +415,250 @@ uint8_t range_mapped(void *data, uint64_t size) {
     return 1;
 }
 
-/* TODO: Sync page tables for any CPUs running with the same CR3 */
-
-/* Get a table for a set of offsets into the table */
-pt_ptr_t vmm_get_table(pt_off_t *offs, page_table_t *p4) {
-    pt_ptr_t ret;
+/* Get the P1 table for a set of offsets. Missing tables are only created
+   with VMM_WALK_CREATE and huge pages only split with VMM_WALK_SPLIT,
+   otherwise NULL is returned */
+static page_table_t *vmm_get_table(pt_off_t *offs, page_table_t *p4, uint8_t flags) {
     p4 = GET_HIGHER_HALF(page_table_t *, p4);
 
-    vmm_ensure_table(p4, offs->p4_off);
+    if (!(get_entry(p4, offs->p4_off) & VMM_PRESENT)) {
+        if (!(flags & VMM_WALK_CREATE)) {
+            return (page_table_t *) 0;
+        }
+        vmm_ensure_table(p4, offs->p4_off);
+    }
     page_table_t *p3 = traverse_page_table(p4, offs->p4_off);
-    ret.p3 = p3;
 
-    vmm_ensure_table(p3, offs->p3_off);
-    page_table_t *p2 = traverse_page_table(p3, offs->p3_off);
-    ret.p2 = p2;
-    
-    uint64_t p2_entry = get_entry(p2, offs->p2_off);
-    if (!(p2_entry & VMM_HUGE) && p2_entry & VMM_PRESENT) {
-        ret.p1 = traverse_page_table(p2, offs->p2_off);
-        return ret;
+    uint64_t p3_entry = get_entry(p3, offs->p3_off);
+    if (p3_entry & VMM_HUGE && p3_entry & VMM_PRESENT) {
+        if (!(flags & VMM_WALK_SPLIT)) {
+            return (page_table_t *) 0;
+        }
+        /* Remap to 2 MiB pages, the P2 entry gets split below */
+        vmm_remap_to_2m(p3, offs->p3_off);
+    } else if (!(p3_entry & VMM_PRESENT)) {
+        if (!(flags & VMM_WALK_CREATE)) {
+            return (page_table_t *) 0;
+        }
+        vmm_ensure_table(p3, offs->p3_off);
     }
+    page_table_t *p2 = traverse_page_table(p3, offs->p3_off);
 
+    uint64_t p2_entry = get_entry(p2, offs->p2_off);
     if (p2_entry & VMM_HUGE && p2_entry & VMM_PRESENT) {
+        if (!(flags & VMM_WALK_SPLIT)) {
+            return (page_table_t *) 0;
+        }
         /* Remap to 4 Kib pages */
         vmm_remap_to_4k(p2, offs->p2_off);
+    } else if (!(p2_entry & VMM_PRESENT)) {
+        if (!(flags & VMM_WALK_CREATE)) {
+            return (page_table_t *) 0;
+        }
+        vmm_ensure_table(p2, offs->p2_off);
     }
 
-    vmm_ensure_table(p2, offs->p2_off); // If the table didn't get remapped, ensure there is a table
-    ret.p1 = traverse_page_table(p2, offs->p2_off);
+    return traverse_page_table(p2, offs->p2_off);
+}
 
-    return ret;
+/* How many pages from virt are left in the same P1 table, up to count */
+static uint64_t vmm_table_run(uint64_t virt, uint64_t count) {
+    uint64_t run = 512 - ((virt >> 12) & 0x1ff);
+    return run < count ? run : count;
+}
+
+/* Note a changed page, the flush happens once at the end of the operation */
+static void vmm_flush_add(vmm_flush_t *flush, uint64_t virt) {
+    if (!flush->pages || virt < flush->start) {
+        flush->start = virt;
+    }
+    if (virt + 0x1000 > flush->end) {
+        flush->end = virt + 0x1000;
+    }
+    flush->pages++;
+}
+
+/* Toggling PGE flushes everything, global pages and every PCID included */
+static void vmm_flush_global() {
+    uint64_t cr4;
+    asm volatile("movq %%cr4, %0;" : "=r"(cr4));
+    asm volatile("movq %0, %%cr4;" ::"r"(cr4 ^ (1 << 7)) : "memory");
+    asm volatile("movq %0, %%cr4;" ::"r"(cr4) : "memory");
+}
+
+/* Kernel half entries are global, and invlpg drops a global entry under
+   every PCID, so kernel ranges need no more than user ones */
+static void vmm_flush_range(uint64_t start, uint64_t end) {
+    if ((end - start) / 0x1000 > VMM_FLUSH_THRESHOLD) {
+        // Cheaper than a long run of invlpgs. Reloading CR3 keeps global pages, so the kernel half needs PGE
+        if (end > 0x800000000000) {
+            vmm_flush_global();
+        } else {
+            vmm_set_base(vmm_get_base());
+        }
+        return;
+    }
+
+    for (uint64_t virt = start; virt < end; virt += 0x1000) {
+        vmm_invlpg(virt);
+    }
+}
+
+/* Flush a range on this CPU only. Enough for new mappings, since
+   entries that weren't present can't be in any TLB */
+static void vmm_flush_local(vmm_flush_t *flush, void *p4) {
+    if (!flush->pages) {
+        return;
+    }
+
+    /* Another address space's user half isn't in this CPU's TLB */
+    if (flush->end <= 0x800000000000 && vmm_get_base() != (uint64_t) p4) {
+        return;
+    }
+
+    vmm_flush_range(flush->start, flush->end);
+}
+
+/* Flush a range everywhere. Must be called without any page table lock
+   held, the other CPUs may be spinning on it with interrupts off */
+static void vmm_flush_finish(vmm_flush_t *flush, void *p4) {
+    if (flush->pages) {
+        vmm_shootdown(p4, flush->start, flush->end);
+    }
+}
+
+/* Handle the shootdown aimed at this CPU, if there is one */
+static void vmm_shootdown_ack() {
+    cpu_locals_t *locals = get_cpu_locals();
+    if (locals->tlb_shootdown) {
+        vmm_flush_range(shootdown_start, shootdown_end);
+        locals->tlb_shootdown = 0;
+        atomic_dec(&shootdown_pending);
+    }
+}
+
+void vmm_shootdown_handler(int_reg_t *r) {
+    (void) r;
+    vmm_shootdown_ack();
+}
+
+/* Called from spinlock_lock's spin loop while a shootdown is in flight. A CPU
+   spinning with interrupts off never sees the IPI, and the initiator may hold
+   the lock it wants. CPUs still booting have no locals yet, and aren't targets */
+void vmm_shootdown_poll() {
+    if (read_msr(0xC0000101)) {
+        vmm_shootdown_ack();
+    }
+}
+
+/* Invalidate a range on every CPU that could have it cached: all of them
+   for the kernel half, otherwise only the ones running p4 right now. All
+   of the targets get one IPI and this waits until they've flushed. With
+   PCIDs, everyone else flushes the space the next time they load it */
+void vmm_shootdown(void *p4, uint64_t start, uint64_t end) {
+    uint8_t kernel_half = end > 0x800000000000;
+    uint16_t pcid = vmm_pcid_of((uint64_t) p4);
+    if (start >= end) {
+        return;
+    }
+
+    if (kernel_half || vmm_get_base() == (uint64_t) p4) {
+        vmm_flush_range(start, end);
+    } else if (vmm_pcid_enabled) {
+        vmm_pcid_mark_stale(get_cpu_locals(), pcid);
+    }
+
+    if (cores_booted < 2 || !cpu_locals_list) {
+        return; // Nobody else to tell
+    }
+
+    interrupt_state_t state = interrupt_lock();
+    while (spinlock_check_and_lock(&shootdown_lock.lock_dat)) {
+        vmm_shootdown_ack(); // Whoever holds it might be waiting on us
+        asm volatile("pause");
+    }
+
+    shootdown_start = start;
+    shootdown_end = end;
+    asm volatile("mfence" ::: "memory"); // Page table writes go out before active_cr3 is read
+
+    cpu_locals_t *self = get_cpu_locals();
+    if (!kernel_half && vmm_pcid_enabled) {
+        /* Before reading active_cr3, so a CPU switching in either sees this or gets the IPI */
+        for (uint64_t i = 0; i < cpu_vector.items_count; i++) {
+            cpu_locals_t *locals = hashmap_get_elem(cpu_locals_list, i);
+            if (locals && locals != self) {
+                vmm_pcid_mark_stale(locals, pcid);
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i < cpu_vector.items_count; i++) {
+        cpu_locals_t *locals = hashmap_get_elem(cpu_locals_list, i);
+        if (!locals || locals == self) {
+            continue;
+        }
+
+        if (kernel_half || locals->active_cr3 == (uint64_t) p4) {
+            atomic_inc(&shootdown_pending);
+            locals->tlb_shootdown = 1;
+            send_ipi(locals->apic_id, (1 << 14) | VMM_SHOOTDOWN_IPI);
+        }
+    }
+
+    while (shootdown_pending) {
+        asm volatile("pause");
+    }
+
+    unlock(shootdown_lock);
+    interrupt_unlock(state);
 }
 
 /* Map pages */
 int vmm_map_pages(void *phys, void *virt, void *p4, uint64_t count, uint16_t perms) {
     interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
+    volatile uint32_t *space_lock = vmm_space_lock(p4, (uint64_t) virt);
+    spinlock_lock(space_lock);
 
     int ret = 0;
+    vmm_flush_t flush = {0, 0, 0};
 
-    uint8_t *cur_virt = (uint8_t *) (((uint64_t) virt) & VMM_4K_PERM_MASK);
+    uint64_t cur_virt = ((uint64_t) virt) & VMM_4K_PERM_MASK;
     uint64_t cur_phys = ((uint64_t) phys) & VMM_4K_PERM_MASK;
-
-    for (uint64_t page = 0; page < count; page++) {
-        pt_off_t offs = vmm_virt_to_offs((void *) cur_virt);
-        pt_ptr_t ptrs = vmm_get_table(&offs, p4);
-
-        /* Set the addresses */
-        if (!(ptrs.p1->entries[offs.p1_off] & VMM_PRESENT)) {
-            ptrs.p1->entries[offs.p1_off] = cur_phys | perms;
-            vmm_invlpg((uint64_t) cur_virt); // Invalidate pages
-            cur_phys += 0x1000;
-            cur_virt += 0x1000;
-        } else {
-            ret = 1;
-            cur_phys += 0x1000;
-            cur_virt += 0x1000;
-            continue;
+    uint64_t page = 0;
+
+    while (page < count) {
+        /* Use a 2M or 1G page when the range is aligned and big enough */
+        uint64_t run = vmm_map_huge(p4, cur_virt, cur_phys, count - page, perms);
+
+        if (!run) {
+            pt_off_t offs = vmm_virt_to_offs((void *) cur_virt);
+            run = vmm_table_run(cur_virt, count - page);
+
+            /* Don't split huge pages that are already there, just skip them */
+            page_table_t *p1 = vmm_get_table(&offs, p4, VMM_WALK_CREATE);
+            if (!p1) {
+                ret = 1;
+            } else {
+                for (uint64_t i = 0; i < run; i++) {
+                    if (!(p1->entries[offs.p1_off + i] & VMM_PRESENT)) {
+                        p1->entries[offs.p1_off + i] = (cur_phys + i * 0x1000) | vmm_global_perms(cur_virt, perms);
+                        vmm_rmap_add(p1->entries[offs.p1_off + i], p4);
+                        vmm_flush_add(&flush, cur_virt + i * 0x1000);
+                    } else {
+                        ret = 1;
+                    }
+                }
+            }
         }
+
+        page += run;
+        cur_phys += run * 0x1000;
+        cur_virt += run * 0x1000;
     }
 
-    unlock(vmm_spinlock);
+    spinlock_unlock(space_lock);
+    vmm_flush_local(&flush, p4);
     interrupt_unlock(state);
     return ret;
 }
@@ -244,54 +666,145 @@ int vmm_map_pages(void *phys, void *virt, void *p4, uint64_t count, uint16_t per
 /* Remap pages */
 int vmm_remap_pages(void *phys, void *virt, void *p4, uint64_t count, uint16_t perms) {
     interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
+    volatile uint32_t *space_lock = vmm_space_lock(p4, (uint64_t) virt);
+    spinlock_lock(space_lock);
 
     int ret = 0;
+    vmm_flush_t flush = {0, 0, 0};
 
-    uint8_t *cur_virt = (uint8_t *) (((uint64_t) virt) & VMM_4K_PERM_MASK);
+    uint64_t cur_virt = ((uint64_t) virt) & VMM_4K_PERM_MASK;
     uint64_t cur_phys = ((uint64_t) phys) & VMM_4K_PERM_MASK;
+    uint64_t page = 0;
 
-    for (uint64_t page = 0; page < count; page++) {
+    while (page < count) {
         pt_off_t offs = vmm_virt_to_offs((void *) cur_virt);
-        pt_ptr_t ptrs = vmm_get_table(&offs, p4);
+        uint64_t run = vmm_table_run(cur_virt, count - page);
+        page_table_t *p1 = vmm_get_table(&offs, p4, VMM_WALK_CREATE | VMM_WALK_SPLIT);
 
         /* Set the addresses */
-        ptrs.p1->entries[offs.p1_off] = cur_phys | (perms | VMM_PRESENT);
+        for (uint64_t i = 0; i < run; i++) {
+            vmm_rmap_remove(p1->entries[offs.p1_off + i], p4);
+            p1->entries[offs.p1_off + i] = (cur_phys + i * 0x1000) | vmm_global_perms(cur_virt, perms | VMM_PRESENT);
+            vmm_rmap_add(p1->entries[offs.p1_off + i], p4);
+            vmm_flush_add(&flush, cur_virt + i * 0x1000);
+        }
 
-        vmm_invlpg((uint64_t) cur_virt); // Invalidate pages
-        cur_phys += 0x1000;
-        cur_virt += 0x1000;
+        page += run;
+        cur_phys += run * 0x1000;
+        cur_virt += run * 0x1000;
     }
 
-    unlock(vmm_spinlock);
+    spinlock_unlock(space_lock);
+    vmm_flush_finish(&flush, p4);
+    interrupt_unlock(state);
+    return ret;
+}
+
+/* Unmap pages, giving the frames back to the PMM too if release is set */
+static int vmm_unmap_range(void *virt, void *p4, uint64_t count, uint8_t release) {
+    interrupt_state_t state = interrupt_lock();
+    volatile uint32_t *space_lock = vmm_space_lock(p4, (uint64_t) virt);
+    spinlock_lock(space_lock);
+
+    int ret = 0;
+    vmm_flush_t flush = {0, 0, 0};
+    uint32_t deferred = PMM_NO_PAGE;
+
+    uint64_t cur_virt = ((uint64_t) virt) & VMM_4K_PERM_MASK;
+    uint64_t page = 0;
+
+    while (page < count) {
+        pt_off_t offs = vmm_virt_to_offs((void *) cur_virt);
+        uint64_t run = vmm_table_run(cur_virt, count - page);
+        page_table_t *p1 = vmm_get_table(&offs, p4, VMM_WALK_SPLIT);
+
+        if (!p1) {
+            ret = 1; // Nothing mapped in this whole table
+        } else {
+            for (uint64_t i = 0; i < run; i++) {
+                uint64_t entry = p1->entries[offs.p1_off + i];
+                if (entry & VMM_PRESENT) {
+                    p1->entries[offs.p1_off + i] = 0;
+                    vmm_flush_add(&flush, cur_virt + i * 0x1000);
+                    vmm_rmap_remove(entry, p4);
+
+                    /* Other CPUs can still reach the frame until they've flushed */
+                    void *phys = (void *) (entry & VMM_4K_PERM_MASK & ~(1UL << 63));
+                    if (release && pmm_frame_release(phys)) {
+                        pmm_defer_unalloc(phys, &deferred);
+                    }
+                } else {
+                    ret = 1;
+                }
+            }
+        }
+
+        page += run;
+        cur_virt += run * 0x1000;
+    }
+
+    spinlock_unlock(space_lock);
+    vmm_flush_finish(&flush, p4);
+    pmm_unalloc_deferred(deferred);
     interrupt_unlock(state);
     return ret;
 }
 
 /* Unmap pages */
 int vmm_unmap_pages(void *virt, void *p4, uint64_t count) {
+    return vmm_unmap_range(virt, p4, count, 0);
+}
+
+/* Unmap pages and free the frames that aren't shared anymore */
+int vmm_unmap_free_pages(void *virt, void *p4, uint64_t count) {
+    return vmm_unmap_range(virt, p4, count, 1);
+}
+
+/* Change the permissions of mapped pages, copy on write pages stay read only */
+int vmm_protect_pages(void *virt, void *p4, uint64_t count, uint16_t perms) {
     interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
+    volatile uint32_t *space_lock = vmm_space_lock(p4, (uint64_t) virt);
+    spinlock_lock(space_lock);
 
     int ret = 0;
-    uint64_t cur_virt = (uint64_t) virt;
+    vmm_flush_t flush = {0, 0, 0};
 
-    for (uint64_t page = 0; page < count; page++) {
+    uint64_t cur_virt = ((uint64_t) virt) & VMM_4K_PERM_MASK;
+    uint64_t page = 0;
+    uint64_t perm_mask = VMM_PRESENT | VMM_WRITE | VMM_USER | VMM_WRITE_THROUGH | VMM_NO_CACHE;
+
+    while (page < count) {
         pt_off_t offs = vmm_virt_to_offs((void *) cur_virt);
-        pt_ptr_t ptrs = vmm_get_table(&offs, p4);
+        uint64_t run = vmm_table_run(cur_virt, count - page);
+        page_table_t *p1 = vmm_get_table(&offs, p4, VMM_WALK_SPLIT);
 
-        /* Set the addresses */
-        if ((ptrs.p1->entries[offs.p1_off] & VMM_PRESENT)) {
-            ptrs.p1->entries[offs.p1_off] = 0;
-        } else {
+        if (!p1) {
             ret = 1;
+        } else {
+            for (uint64_t i = 0; i < run; i++) {
+                uint64_t entry = p1->entries[offs.p1_off + i];
+                if (!(entry & VMM_PRESENT)) {
+                    ret = 1;
+                    continue;
+                }
+
+                uint64_t new_perms = perms & perm_mask;
+                if (entry & VMM_COW) {
+                    new_perms &= ~((uint64_t) VMM_WRITE);
+                }
+                p1->entries[offs.p1_off + i] = (entry & ~perm_mask) | new_perms | VMM_PRESENT;
+                vmm_rmap_remove(entry, p4);
+                vmm_rmap_add(p1->entries[offs.p1_off + i], p4);
+                vmm_flush_add(&flush, cur_virt + i * 0x1000);
+            }
         }
 
-        vmm_invlpg(cur_virt); // Invalidate pages
-        cur_virt += 0x1000;
+        page += run;
+        cur_virt += run * 0x1000;
     }
 
-    unlock(vmm_spinlock);
+    spinlock_unlock(space_lock);
+    vmm_flush_finish(&flush, p4);
     interrupt_unlock(state);
     return ret;
 }
@@ -299,89 +812,119 @@ int vmm_unmap_pages(void *virt, void *p4, uint64_t count) {
 /* Set the PAT entries */
 void vmm_set_pat_pages(void *virt, void *p4, uint64_t count, uint8_t pat_entry) {
     interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
+    volatile uint32_t *space_lock = vmm_space_lock(p4, (uint64_t) virt);
+    spinlock_lock(space_lock);
 
     uint64_t cur_virt = (uint64_t) virt;
+    uint64_t page = 0;
+
+    uint8_t bit1 = (pat_entry & (1<<0)) == (1<<0);
+    uint8_t bit2 = (pat_entry & (1<<1)) == (1<<1);
+    uint8_t bit3 = (pat_entry & (1<<2)) == (1<<2);
 
-    page_table_t *p4_offset = GET_HIGHER_HALF(page_table_t *, p4);
+    while (page < count) {
+        if ((uint64_t) virt_to_phys((void *) cur_virt, p4) == 0xFFFFFFFFFFFFFFFF) {
+            cur_virt += 0x1000;
+            page++;
+            continue;
+        }
 
-    for (uint64_t page = 0; page < count; page++) {
         pt_off_t offs = vmm_virt_to_offs((void *) cur_virt);
-        
-        if ((uint64_t) virt_to_phys(virt, p4) != 0xFFFFFFFFFFFFFFFF) {
-            page_table_t *p3 = traverse_page_table(p4_offset, offs.p4_off);
-            if (p3) {
-                page_table_t *p2 = traverse_page_table(p3, offs.p3_off);
-                if (p2) {
-                    page_table_t *p1 = traverse_page_table(p2, offs.p2_off);
-                    uint64_t cur_data = get_entry(p1, offs.p1_off);
-                    uint8_t bit1 = (pat_entry & (1<<0)) == (1<<0);
-                    uint8_t bit2 = (pat_entry & (1<<1)) == (1<<1);
-                    uint8_t bit3 = (pat_entry & (1<<2)) == (1<<2);
-
-                    cur_data |= (bit1 << 3) | (bit2 << 4) | (bit3 << 7);
-                    p1->entries[offs.p1_off] = cur_data;
-                }
+        page_table_t *p3 = traverse_page_table(GET_HIGHER_HALF(page_table_t *, p4), offs.p4_off);
+        if (p3->entries[offs.p3_off] & VMM_HUGE) {
+            vmm_remap_to_2m(p3, offs.p3_off);
+        }
+
+        /* Keep 2M pages that are covered completely, split the rest */
+        page_table_t *p2 = traverse_page_table(p3, offs.p3_off);
+        if (p2->entries[offs.p2_off] & VMM_HUGE) {
+            if (!(cur_virt & 0x1fffff) && count - page >= 512) {
+                p2->entries[offs.p2_off] |= (bit1 << 3) | (bit2 << 4) | ((uint64_t) bit3 << 12);
+                cur_virt += 0x200000;
+                page += 512;
+                continue;
             }
+            vmm_remap_to_4k(p2, offs.p2_off);
         }
-        vmm_invlpg(cur_virt);
+
+        page_table_t *p1 = traverse_page_table(p2, offs.p2_off);
+        uint64_t cur_data = get_entry(p1, offs.p1_off);
+
+        cur_data |= (bit1 << 3) | (bit2 << 4) | (bit3 << 7);
+        p1->entries[offs.p1_off] = cur_data;
+
         cur_virt += 0x1000;
+        page++;
     }
 
-    unlock(vmm_spinlock);
+    spinlock_unlock(space_lock);
+    vmm_shootdown(p4, (uint64_t) virt & ~(0xfffUL), cur_virt);
     interrupt_unlock(state);
 }
 
 void *vmm_fork_higher_half(void *old) {
     interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
+    lock(vmm_kernel_lock);
     page_table_t *old_p4 = GET_HIGHER_HALF(page_table_t *, old);
-    void *ret = pmm_alloc(0x1000);
+    void *ret = pmm_alloc_zeroed(0x1000);
     page_table_t *new_p4 = GET_HIGHER_HALF(page_table_t *, ret);
-
-    memset((uint8_t *) new_p4, 0, 0x1000);
+    pmm_pages[(uint64_t) ret / 0x1000].pcid = vmm_pcid_enabled ? vmm_pcid_alloc() : 0;
+    pmm_pages[(uint64_t) ret / 0x1000].vmm_lock = 0;
+    pmm_pages[(uint64_t) ret / 0x1000].rss = 0;
 
     for (uint16_t i = 256; i < 512; i++) {
         new_p4->entries[i] = old_p4->entries[i];
     }
 
-    unlock(vmm_spinlock);
+    unlock(vmm_kernel_lock);
     interrupt_unlock(state);
     return ret;
 }
 
+/* Copy on write fork. Every user frame gets shared with the child, and
+   writable pages get write protected in both address spaces */
 void *vmm_fork(void *old) {
     void *ret = vmm_fork_higher_half(old);
     page_table_t *table = GET_HIGHER_HALF(page_table_t *, old);
+    page_table_t *new_table = GET_HIGHER_HALF(page_table_t *, ret);
     interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
+    /* Nobody can see the child yet, only the parent needs locking */
+    volatile uint32_t *space_lock = vmm_space_lock(old, 0);
+    spinlock_lock(space_lock);
     for (uint64_t w = 0; w < 256; w++) {
         /* P4 */
         if (table->entries[w] & VMM_PRESENT) {
             page_table_t *table_z = GET_HIGHER_HALF(page_table_t *, table->entries[w] & VMM_4K_PERM_MASK);
+            vmm_ensure_table(new_table, w);
+            page_table_t *new_z = traverse_page_table(new_table, w);
             for (uint64_t z = 0; z < 512; z++) {
                 /* P3 */
                 if (table_z->entries[z] & VMM_PRESENT) {
                     page_table_t *table_y = GET_HIGHER_HALF(page_table_t *, table_z->entries[z] & VMM_4K_PERM_MASK);
+                    vmm_ensure_table(new_z, z);
+                    page_table_t *new_y = traverse_page_table(new_z, z);
                     for (uint64_t y = 0; y < 512; y++) {
                         /* P2 */
                         if (table_y->entries[y] & VMM_PRESENT) {
+                            if (table_y->entries[y] & VMM_HUGE) {
+                                /* Copy on write is tracked per 4K frame, so split it */
+                                vmm_remap_to_4k(table_y, y);
+                            }
                             page_table_t *table_x = GET_HIGHER_HALF(page_table_t *, table_y->entries[y] & VMM_4K_PERM_MASK);
+                            vmm_ensure_table(new_y, y);
+                            page_table_t *new_x = traverse_page_table(new_y, y);
                             for (uint64_t x = 0; x < 512; x++) {
                                 /* P1 */
-                                if (table_x->entries[x] & VMM_PRESENT) {
-                                    pt_off_t offs = {w, z, y, x};
-                                    void *virt = vmm_offs_to_virt(offs);
-                                    void *phys = virt_to_phys(virt, GET_LOWER_HALF(page_table_t *, table));
-                                    void *new_phys = pmm_alloc(0x1000);
-
-                                    /* Copy the data */
-                                    memcpy64(GET_HIGHER_HALF(void *, phys), GET_HIGHER_HALF(void *, new_phys), 0x200);
-
-                                    /* Map new page */
-                                    unlock(vmm_spinlock);
-                                    vmm_map_pages(new_phys, virt, ret, 1, table_x->entries[x] & ~(VMM_4K_PERM_MASK));
-                                    lock(vmm_spinlock);
+                                uint64_t entry = table_x->entries[x];
+                                if (entry & VMM_PRESENT) {
+                                    if (entry & VMM_WRITE && !(entry & VMM_SHARED)) {
+                                        entry = (entry & ~((uint64_t) VMM_WRITE)) | VMM_COW;
+                                        table_x->entries[x] = entry;
+                                    }
+
+                                    pmm_frame_share((void *) (entry & VMM_4K_PERM_MASK));
+                                    new_x->entries[x] = entry;
+                                    vmm_rmap_add(entry, ret);
                                 }
                             }
                         }
@@ -389,74 +932,162 @@ void *vmm_fork(void *old) {
                 }
             }
         }
-    } 
-    unlock(vmm_spinlock);
+    }
+
+    spinlock_unlock(space_lock);
+
+    /* The parent's writable entries are now read only, its other threads
+       can't keep writing through old TLB entries */
+    vmm_shootdown(old, 0, 0x800000000000);
+
     interrupt_unlock(state);
     return ret;
 }
 
-uint8_t is_mapped_in_userspace(void *phys_address) {
-    page_table_t *table = GET_HIGHER_HALF(page_table_t *, vmm_get_base());
-    uint8_t ret = 0;
-    interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
-    for (uint64_t w = 0; w < 256; w++) {
-        /* P4 */
-        if (table->entries[w] & VMM_PRESENT) {
-            page_table_t *table_z = GET_HIGHER_HALF(page_table_t *, table->entries[w] & VMM_4K_PERM_MASK);
-            for (uint64_t z = 0; z < 512; z++) {
-                /* P3 */
-                if (table_z->entries[z] & VMM_PRESENT) {
-                    page_table_t *table_y = GET_HIGHER_HALF(page_table_t *, table_z->entries[z] & VMM_4K_PERM_MASK);
-                    for (uint64_t y = 0; y < 512; y++) {
-                        /* P2 */
-                        if (table_y->entries[y] & VMM_PRESENT) {
-                            page_table_t *table_x = GET_HIGHER_HALF(page_table_t *, table_y->entries[y] & VMM_4K_PERM_MASK);
-                            for (uint64_t x = 0; x < 512; x++) {
-                                /* P1 */
-                                if (table_x->entries[x] & VMM_PRESENT) {
-                                    pt_off_t offs = {w, z, y, x};
-                                    void *virt = vmm_offs_to_virt(offs);
-                                    void *phys = virt_to_phys(virt, GET_LOWER_HALF(page_table_t *, table));
-                                    if (phys == phys_address && table_x->entries[x] & VMM_USER) {
-                                        unlock(vmm_spinlock);
-                                        ret = 1;
-                                        return ret;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+/* Get the P1 entry for an address without creating tables, NULL if there isn't one */
+static uint64_t *vmm_get_pte(void *virt, void *p4) {
+    pt_off_t offs = vmm_virt_to_offs(virt);
+    page_table_t *table = GET_HIGHER_HALF(page_table_t *, p4);
+
+    if (!(table->entries[offs.p4_off] & VMM_PRESENT)) {
+        return NULL;
+    }
+    table = traverse_page_table(table, offs.p4_off);
+
+    if (!(table->entries[offs.p3_off] & VMM_PRESENT) || table->entries[offs.p3_off] & VMM_HUGE) {
+        return NULL;
+    }
+    table = traverse_page_table(table, offs.p3_off);
+
+    if (!(table->entries[offs.p2_off] & VMM_PRESENT) || table->entries[offs.p2_off] & VMM_HUGE) {
+        return NULL;
+    }
+    table = traverse_page_table(table, offs.p2_off);
+
+    return &table->entries[offs.p1_off];
+}
+
+/* Give the faulting address space its own writable copy of a COW page.
+   Returns 2 if other CPUs may still have the old entry cached, with the
+   old frame (if it has to be freed) put on deferred */
+static int vmm_resolve_cow(void *virt, void *p4, uint64_t err, uint32_t *deferred) {
+    uint64_t *entry = vmm_get_pte(virt, p4);
+    if (!entry || !(*entry & VMM_PRESENT)) {
+        return 0;
+    }
+
+    if (!(*entry & VMM_COW)) {
+        /* Another CPU already resolved it, this TLB still had the read only entry */
+        if (*entry & VMM_WRITE && (!(err & VMM_FAULT_USER) || *entry & VMM_USER)) {
+            vmm_invlpg((uint64_t) virt);
+            return 1;
         }
-    } 
-    unlock(vmm_spinlock);
-    interrupt_unlock(state);
-    return ret;
+        return 0;
+    }
+
+    void *phys = (void *) (*entry & VMM_4K_PERM_MASK);
+    uint64_t perms = ((*entry & 0xfff) & ~((uint64_t) VMM_COW)) | VMM_WRITE;
+
+    if (pmm_frame_refs(phys) <= 1) {
+        // Everyone else dropped the frame already, so just take it
+        *entry = (uint64_t) phys | perms;
+        vmm_invlpg((uint64_t) virt);
+        return 1; // Only made writable, stale read only entries just fault again
+    }
+
+    void *new_phys = pmm_alloc(0x1000);
+    memcpy64(GET_HIGHER_HALF(uint64_t *, phys), GET_HIGHER_HALF(uint64_t *, new_phys), 0x200);
+    vmm_rmap_remove(*entry, p4);
+    *entry = (uint64_t) new_phys | perms;
+    vmm_rmap_add(*entry, p4);
+
+    if (pmm_frame_release(phys)) {
+        pmm_defer_unalloc(phys, deferred);
+    }
+    return 2;
 }
 
-uint8_t range_mapped_in_userspace(void *data, uint64_t size) {
-    uint64_t cur_addr = (uint64_t) data & ~(0xfff);
-    uint64_t addr_not_rounded = (uint64_t) data;
-    uint64_t end_addr = (addr_not_rounded + size) & ~(0xfff);
-    uint64_t rounded_size = end_addr - cur_addr;
-    uint64_t pages = ((rounded_size + 0x1000 - 1) / 0x1000);
+/* Called from the page fault handler with the faulting CR3 still loaded.
+   Returns 1 if the fault was resolved and the access can be retried */
+int vmm_handle_fault(void *addr, uint64_t err) {
+    if ((uint64_t) addr >= 0x800000000000) {
+        return 0;
+    }
 
-    for (uint64_t i = 0; i < pages; i++) {
-        if (!is_mapped_in_userspace((void *) cur_addr)) {
+    /* Not present, see if the current process has an area covering it */
+    if (!(err & VMM_FAULT_PRESENT)) {
+        if (!scheduler_enabled || !get_cpu_locals()->current_thread) {
             return 0;
         }
-        cur_addr += 0x1000;
+
+        process_t *process = get_cur_process();
+        if (!process || process->cr3 != vmm_get_base()) {
+            return 0;
+        }
+        return vma_handle_fault(&process->vmas, (void *) process->cr3, addr);
     }
 
-    return 1;
+    int ret = 0;
+    uint32_t deferred = PMM_NO_PAGE;
+    interrupt_state_t state = interrupt_lock();
+    volatile uint32_t *space_lock = vmm_space_lock((void *) vmm_get_base(), (uint64_t) addr);
+    spinlock_lock(space_lock);
+
+    if (err & VMM_FAULT_PRESENT && err & VMM_FAULT_WRITE) {
+        ret = vmm_resolve_cow(addr, (void *) vmm_get_base(), err, &deferred);
+    }
+
+    spinlock_unlock(space_lock);
+
+    if (ret == 2) {
+        /* Other threads must stop reading the old frame before it can go */
+        uint64_t page = (uint64_t) addr & ~(0xfffUL);
+        vmm_shootdown((void *) vmm_get_base(), page, page + 0x1000);
+        pmm_unalloc_deferred(deferred);
+    }
+
+    interrupt_unlock(state);
+    return ret != 0;
 }
 
+/* Whether a virtual address is a present user page in a space, read from
+   its own page table entry */
+uint8_t is_user_page(void *virt, void *p4) {
+    pt_off_t offs = vmm_virt_to_offs(virt);
+    interrupt_state_t state = interrupt_lock();
+    volatile uint32_t *space_lock = vmm_space_lock(p4, (uint64_t) virt);
+    spinlock_lock(space_lock);
+
+    uint8_t ret = 0;
+    page_table_t *p4_table = GET_HIGHER_HALF(page_table_t *, p4);
+    uint64_t entry = get_entry(p4_table, offs.p4_off);
+    if (entry & VMM_PRESENT && entry & VMM_USER) {
+        page_table_t *p3 = traverse_page_table(p4_table, offs.p4_off);
+        entry = get_entry(p3, offs.p3_off);
+        if (entry & VMM_PRESENT && entry & VMM_USER && !(entry & VMM_HUGE)) {
+            page_table_t *p2 = traverse_page_table(p3, offs.p3_off);
+            entry = get_entry(p2, offs.p2_off);
+            if (entry & VMM_PRESENT && entry & VMM_USER && !(entry & VMM_HUGE)) {
+                page_table_t *p1 = traverse_page_table(p2, offs.p2_off);
+                entry = get_entry(p1, offs.p1_off);
+            }
+        }
+        ret = (entry & VMM_PRESENT) && (entry & VMM_USER);
+    }
+
+    spinlock_unlock(space_lock);
+    interrupt_unlock(state);
+    return ret;
+}
+
+/* Free an address space's user half, its tables and the P4. Every frame
+   goes on one list that the PMM frees in batches at the end */
 void vmm_deconstruct_address_space(void *old) {
     page_table_t *table = GET_HIGHER_HALF(page_table_t *, old);
+    uint32_t deferred = PMM_NO_PAGE;
     interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
+    volatile uint32_t *space_lock = vmm_space_lock(old, 0);
+    spinlock_lock(space_lock);
     for (uint64_t w = 0; w < 256; w++) {
         /* P4 */
         if (table->entries[w] & VMM_PRESENT) {
@@ -468,27 +1099,81 @@ void vmm_deconstruct_address_space(void *old) {
                     for (uint64_t y = 0; y < 512; y++) {
                         /* P2 */
                         if (table_y->entries[y] & VMM_PRESENT) {
+                            if (table_y->entries[y] & VMM_HUGE) {
+                                /* Huge user pages are never shared, give the frames back one by one */
+                                uint64_t base = table_y->entries[y] & VMM_2M_PERM_MASK & ~(1UL << 63);
+                                for (uint64_t x = 0; x < 512; x++) {
+                                    if (table_y->entries[y] & VMM_USER) {
+                                        pmm_frame_unmap((void *) (base + x * 0x1000));
+                                    }
+                                    if (pmm_frame_release((void *) (base + x * 0x1000))) {
+                                        pmm_defer_unalloc((void *) (base + x * 0x1000), &deferred);
+                                    }
+                                }
+                                continue;
+                            }
                             page_table_t *table_x = GET_HIGHER_HALF(page_table_t *, table_y->entries[y] & VMM_4K_PERM_MASK);
                             for (uint64_t x = 0; x < 512; x++) {
                                 /* P1 */
                                 if (table_x->entries[x] & VMM_PRESENT) {
                                     void *phys = (void *) (table_x->entries[x] & VMM_4K_PERM_MASK);
+                                    vmm_rmap_remove(table_x->entries[x], old);
 
-                                    pmm_unalloc(phys, 0x1000);
+                                    if (pmm_frame_release(phys)) {
+                                        pmm_defer_unalloc(phys, &deferred);
+                                    }
                                 }
                             }
-                            pmm_unalloc(GET_LOWER_HALF(void *, table_x), 0x1000);
+                            pmm_defer_unalloc(GET_LOWER_HALF(void *, table_x), &deferred);
                         }
                     }
-                    pmm_unalloc(GET_LOWER_HALF(void *, table_y), 0x1000);
+                    pmm_defer_unalloc(GET_LOWER_HALF(void *, table_y), &deferred);
                 }
             }
-            pmm_unalloc(GET_LOWER_HALF(void *, table_z), 0x1000);
+            pmm_defer_unalloc(GET_LOWER_HALF(void *, table_z), &deferred);
         }
     }
-    pmm_unalloc(old, 0x1000);
-    unlock(vmm_spinlock);
+    spinlock_unlock(space_lock); // The lock goes away with the P4
+
+    vmm_pcid_free(pmm_pages[(uint64_t) old / 0x1000].pcid);
+    pmm_pages[(uint64_t) old / 0x1000].pcid = 0;
+    pmm_defer_unalloc(old, &deferred);
+    interrupt_unlock(state);
+
+    pmm_unalloc_deferred(deferred);
+}
+
+/* Hand a dead address space to the reclaim thread, so exit and exec don't
+   wait for it to be freed. Nothing may run on it anymore. The queue is
+   chained through the P4 frames' descriptors, like the deferred frees */
+void vmm_queue_teardown(void *old) {
+    interrupt_state_t state = interrupt_lock();
+    lock(teardown_lock);
+    pmm_pages[(uint64_t) old / 0x1000].next = teardown_queue;
+    teardown_queue = (uint64_t) old / 0x1000;
+    unlock(teardown_lock);
     interrupt_unlock(state);
+
+    trigger_event(&teardown_event);
+}
+
+void vmm_reclaim_thread() {
+    while (1) {
+        await_event(&teardown_event);
+
+        interrupt_state_t state = interrupt_lock();
+        lock(teardown_lock);
+        uint32_t queue = teardown_queue;
+        teardown_queue = PMM_NO_PAGE;
+        unlock(teardown_lock);
+        interrupt_unlock(state);
+
+        while (queue != PMM_NO_PAGE) {
+            uint32_t next = pmm_pages[queue].next;
+            vmm_deconstruct_address_space((void *) ((uint64_t) queue * 0x1000));
+            queue = next;
+        }
+    }
 }
 
 int vmm_map(void *phys, void *virt, uint64_t count, uint16_t perms) {
@@ -503,6 +1188,10 @@ int vmm_unmap(void *virt, uint64_t count) {
     return vmm_unmap_pages(virt, (void *) vmm_get_base(), count);
 }
 
+int vmm_protect(void *virt, uint64_t count, uint16_t perms) {
+    return vmm_protect_pages(virt, (void *) vmm_get_base(), count, perms);
+}
+
 void vmm_set_pat(void *virt, uint64_t count, uint8_t pat_entry) {
     vmm_set_pat_pages(virt, (void *) vmm_get_base(), count, pat_entry);
 }
\ No newline at end of file
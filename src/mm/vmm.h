@@ -1,9 +1,11 @@
 #ifndef VMM_H
 #define VMM_H
 #include <stdint.h>
+#include "sys/int/isr.h"
 
 #define VMM_4K_PERM_MASK (~(0xfff))
 #define VMM_2M_PERM_MASK (~(0x1fffff))
+#define VMM_1G_PERM_MASK (~(0x3fffffff))
 
 #define VMM_PRESENT (1<<0)
 #define VMM_WRITE (1<<1)
@@ -13,9 +15,28 @@
 #define VMM_ACCESS (1<<5)
 #define VMM_DIRTY (1<<6)
 #define VMM_HUGE (1<<7)
+#define VMM_GLOBAL (1<<8) // Kept in the TLB across CR3 loads, kernel half only
+#define VMM_COW (1<<9) // Available to software, marks a read only copy on write page
+#define VMM_SHARED (1<<10) // Available to software, shared memory that fork doesn't make copy on write
+#define VMM_HUGE_PAT (1<<12) // The PAT bit moves here in 2M and 1G entries
+
+#define VMM_FAULT_PRESENT (1<<0)
+#define VMM_FAULT_WRITE (1<<1)
+#define VMM_FAULT_USER (1<<2)
+
+#define VMM_WALK_CREATE (1<<0) // Allocate missing page tables
+#define VMM_WALK_SPLIT (1<<1) // Split huge pages that are in the way
+
+#define VMM_FLUSH_THRESHOLD 32 // Past this many pages a range flush reloads CR3, or toggles PGE for the kernel half
+#define VMM_SHOOTDOWN_IPI 249
+
+#define VMM_PCID_COUNT 4096
+#define VMM_PCID_SHARED 4095 // Handed out once the rest are used, always flushed on load
+#define VMM_CR3_NOFLUSH (1UL << 63) // Keep the PCID's TLB entries when loading CR3
 
 #define NORMAL_VMA_OFFSET (0xFFFF800000000000)
 #define KERNEL_VMA_OFFSET (0xFFFFFFFF80000000)
+#define KERNEL_VMA_BOOT_SIZE (0x80000000) // qloader2 maps the first 2 GiB at KERNEL_VMA_OFFSET
 
 #define GET_HIGHER_HALF(type, lower_half) ((type) ((uint64_t) (lower_half) + NORMAL_VMA_OFFSET))
 #define GET_LOWER_HALF(type, higher_half) ((type) ((uint64_t) (higher_half) - NORMAL_VMA_OFFSET))
@@ -31,6 +52,12 @@ typedef struct {
     uint64_t entries[512];
 } page_table_t;
 
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t pages;
+} vmm_flush_t;
+
 typedef struct {
     page_table_t *p4;
     page_table_t *p3;
@@ -40,21 +67,26 @@ typedef struct {
 
 extern uint64_t base_kernel_cr3;
 extern uint8_t vmm_complete;
+extern uint8_t vmm_pcid_enabled;
 
 int vmm_map(void *phys, void *virt, uint64_t count, uint16_t perms);
 int vmm_remap(void *phys, void *virt, uint64_t count, uint16_t perms);
 int vmm_unmap(void *virt, uint64_t count);
+int vmm_protect(void *virt, uint64_t count, uint16_t perms);
 void vmm_set_pat(void *virt, uint64_t count, uint8_t pat_entry);
 int vmm_map_pages(void *phys, void *virt, void *p4, uint64_t count, uint16_t perms);
 int vmm_remap_pages(void *phys, void *virt, void *p4, uint64_t count, uint16_t perms);
 int vmm_unmap_pages(void *virt, void *p4, uint64_t count);
+int vmm_unmap_free_pages(void *virt, void *p4, uint64_t count);
+int vmm_protect_pages(void *virt, void *p4, uint64_t count, uint16_t perms);
 void vmm_set_pat_pages(void *virt, void *p4, uint64_t count, uint8_t pat_entry);
 void vmm_set_base(uint64_t new);
+void vmm_load_space(uint64_t cr3);
+void vmm_pcid_init();
 void *virt_to_phys(void *virt, page_table_t *p4);
 void *kernel_address(void *virt);
 uint8_t is_mapped(void *data);
-uint8_t is_mapped_in_userspace(void *phys_address);
-uint8_t range_mapped_in_userspace(void *data, uint64_t size);
+uint8_t is_user_page(void *virt, void *p4);
 uint8_t range_mapped(void *data, uint64_t size);
 uint64_t vmm_get_base();
 
@@ -63,7 +95,15 @@ void vmm_clflush(void *addr, uint64_t count);
 void *vmm_fork_higher_half(void *old);
 void *vmm_fork(void *old);
 void vmm_deconstruct_address_space(void *old);
+void vmm_queue_teardown(void *old);
+void vmm_reclaim_thread();
+int vmm_handle_fault(void *addr, uint64_t err);
+uint8_t vmm_huge_slot_free(void *virt, void *p4);
+void vmm_shootdown(void *p4, uint64_t start, uint64_t end);
+void vmm_shootdown_handler(int_reg_t *r);
+void vmm_shootdown_poll();
 
 uint64_t get_entry(page_table_t *cur_table, uint64_t offset);
+void vmm_ensure_table(page_table_t *table, uint16_t offset);
 
 #endif
\ No newline at end of file
@@ -2,7 +2,50 @@
 #include "proc/scheduler.h"
 #include "sys/smp.h"
 #include "klibc/lock.h"
-#include "drivers/pit.h"
+#include "sys/timer.h"
+
+#define EVENT_WAIT_BUCKETS 64
+
+/* Waiting threads, hashed by the address of the event they wait on */
+static thread_queue_t event_waiters[EVENT_WAIT_BUCKETS];
+static volatile uint8_t event_wake_deferred = 0; // An interrupt handler triggered while sched_lock was held
+
+static thread_queue_t *event_bucket(event_t *e) {
+    return &event_waiters[((uint64_t) e >> 2) % EVENT_WAIT_BUCKETS];
+}
+
+/* Hand the event to a waiter, sched_lock must be held */
+static void event_wake_waiter(thread_t *thread) {
+    atomic_dec((uint32_t *) thread->event);
+    event_cancel_wait(thread);
+    if (thread->state == WAIT_EVENT_TIMEOUT) {
+        sleep_queue_remove(thread->sleep_node);
+    }
+    sched_wake(thread);
+}
+
+void event_cancel_wait(thread_t *thread) {
+    thread_queue_remove(event_bucket(thread->event), thread);
+}
+
+/* Wake waiters whose event was triggered without sched_lock, sched_lock must be held */
+void event_run_deferred() {
+    if (!event_wake_deferred) {
+        return;
+    }
+    event_wake_deferred = 0;
+
+    for (uint64_t i = 0; i < EVENT_WAIT_BUCKETS; i++) {
+        thread_t *thread = event_waiters[i].head;
+        while (thread) {
+            thread_t *next = thread->queue_next;
+            if (*thread->event) {
+                event_wake_waiter(thread);
+            }
+            thread = next;
+        }
+    }
+}
 
 void await_event(event_t *e) {
     if (*e) {
@@ -11,22 +54,59 @@ void await_event(event_t *e) {
     }
 
     interrupt_safe_lock(sched_lock);
+    if (*e) { // Triggered before we got the lock
+        atomic_dec((uint32_t *) e);
+        interrupt_safe_unlock(sched_lock);
+        return;
+    }
+
     thread_t *current_thread = get_cur_thread();
     current_thread->event = e;
     current_thread->state = WAIT_EVENT;
+    thread_queue_push(event_bucket(e), current_thread);
     force_unlocked_schedule();
 }
 
 void await_event_timeout(event_t *e, uint64_t timeout) {
     interrupt_safe_lock(sched_lock);
+    if (*e) {
+        atomic_dec((uint32_t *) e);
+        interrupt_safe_unlock(sched_lock);
+        return;
+    }
+
     thread_t *current_thread = get_cur_thread();
     current_thread->event = e;
     current_thread->state = WAIT_EVENT_TIMEOUT;
     current_thread->event_timeout = timeout;
-    current_thread->event_wait_start = global_ticks;
+    current_thread->event_wait_start = timer_now_ms();
+    thread_queue_push(event_bucket(e), current_thread);
+    sleep_queue_insert(timer_now_us() + timeout * 1000, current_thread->tid); // The sleep queue wakes us if nothing triggers
     force_unlocked_schedule();
 }
 
 void trigger_event(event_t *e) {
     atomic_inc((uint32_t *) e);
+
+    /* An interrupt handler can't wait for sched_lock, the code it interrupted may hold it */
+    if (get_cpu_locals()->in_irq) {
+        if (spinlock_check_and_lock(&sched_lock.lock_dat)) {
+            event_wake_deferred = 1;
+            get_cpu_locals()->need_resched = 1; // An idle CPU has no tick to run the deferred wakeup on
+            return;
+        }
+        sched_lock.current_holder = __FUNCTION__;
+    } else {
+        interrupt_safe_lock(sched_lock);
+    }
+
+    thread_queue_t *bucket = event_bucket(e);
+    for (thread_t *thread = bucket->head; thread && *e; thread = thread->queue_next) {
+        if (thread->event == e) {
+            event_wake_waiter(thread);
+            break;
+        }
+    }
+
+    interrupt_safe_unlock(sched_lock);
 }
\ No newline at end of file
@@ -4,8 +4,14 @@
 
 typedef int event_t;
 
+struct thread;
+
 void await_event(event_t *e);
 void await_event_timeout(event_t *e, uint64_t timeout);
 void trigger_event(event_t *e);
 
+/* Wait list upkeep for the scheduler, sched_lock must be held */
+void event_cancel_wait(struct thread *thread);
+void event_run_deferred();
+
 #endif
\ No newline at end of file
@@ -4,14 +4,16 @@
 #include "mm/pmm.h"
 #include "drivers/serial.h"
 #include "drivers/tty/tty.h"
-#include "drivers/pit.h"
+#include "sys/timer.h"
 #include "klibc/string.h"
 #include "klibc/stdlib.h"
 #include "klibc/auxv.h"
 #include <stddef.h>
 
-void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *export_cr3, auxv_auxc_group_t *auxv_out) {
-    uint64_t time_s = global_ticks;
+/* Only pages holding file data are loaded up front, the rest of each segment
+   and most of the stack get faulted in through the areas added to vmas */
+void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *export_cr3, auxv_auxc_group_t *auxv_out, vma_list_t *vmas) {
+    uint64_t time_s = timer_now_ms();
     uint64_t time_read = 0;
 
     sprintf("Reading ELF: %s\n", path);
@@ -23,10 +25,10 @@ void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *e
     }
     char elf_magic[4];
 
-    time_s = global_ticks;
+    time_s = timer_now_ms();
     fd_seek(fd, 0, SEEK_SET);
     fd_read(fd, elf_magic, 4);
-    time_read += global_ticks - time_s;
+    time_read += timer_now_ms() - time_s;
 
     if (strncmp("\x7f""ELF", elf_magic, 4)) {
         sprintf("Elf magic invalid!\n");
@@ -35,10 +37,10 @@ void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *e
     }
 
     elf_ehdr_t *ehdr = kmalloc(sizeof(elf_ehdr_t));
-    time_s = global_ticks;
+    time_s = timer_now_ms();
     fd_seek(fd, 0, SEEK_SET);
     fd_read(fd, ehdr, sizeof(elf_ehdr_t));
-    time_read += global_ticks - time_s;
+    time_read += timer_now_ms() - time_s;
     if (ehdr->iden_bytes[4] != 2) {
         sprintf("32-bit ELF! (iden_bytes[4] == %u) Not loading.\n", ehdr->iden_bytes[4]);
     }
@@ -47,7 +49,7 @@ void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *e
     elf_phdr_t *phdrs = kmalloc(sizeof(elf_phdr_t) * ehdr->e_phnum);
     elf_shdr_t *shdrs = kmalloc(sizeof(elf_shdr_t) * ehdr->e_shnum);
 
-    time_s = global_ticks;
+    time_s = timer_now_ms();
     fd_seek(fd, ehdr->e_shoff, SEEK_SET);
     for (uint64_t i = 0; i < ehdr->e_shnum; i++) {
         fd_read(fd, (void *) ((uint64_t) shdrs + (i * sizeof(elf_shdr_t))), sizeof(elf_shdr_t));
@@ -57,16 +59,16 @@ void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *e
     for (uint64_t i = 0; i < ehdr->e_phnum; i++) {
         fd_read(fd, (void *) ((uint64_t) phdrs + (i * sizeof(elf_phdr_t))), sizeof(elf_phdr_t));
     }
-    time_read += global_ticks - time_s;
+    time_read += timer_now_ms() - time_s;
     sprintf("Read 1: %lu\n", time_read);
 
     uint64_t shstr_index = ehdr->e_shstrndx;
     void *shstr_data = kmalloc(shdrs[shstr_index].sh_size);
 
-    time_s = global_ticks;
+    time_s = timer_now_ms();
     fd_seek(fd, shdrs[shstr_index].sh_offset, SEEK_SET);
     fd_read(fd, shstr_data, shdrs[shstr_index].sh_size);
-    time_read += global_ticks - time_s;
+    time_read += timer_now_ms() - time_s;
 
     int loaded_dynamic_linker = 0;
     uint64_t dynamic_linker_entry = 0;
@@ -83,30 +85,53 @@ void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *e
     for (uint64_t i = 0; i < ehdr->e_phnum; i++) {
         if (phdrs[i].p_type == PT_LOAD) {
             if (phdrs[i].p_memsz == 0) continue; // Empty phdr :/
-            uint64_t pages = (phdrs[i].p_memsz + 0x1000 - 1) / 0x1000;
-
-            void *virt = (void *) phdrs[i].p_vaddr + base;
-            void *region_phys = pmm_alloc(phdrs[i].p_memsz);
-            void *region_virt = GET_HIGHER_HALF(void *, region_phys);
-            region_virt = (void *) ((uint64_t) region_virt + ((phdrs[i].p_vaddr + base) & 0xfff));
-            memset(region_virt, 0, phdrs[i].p_memsz);
-
-            time_s = global_ticks;
-            fd_seek(fd, phdrs[i].p_offset, SEEK_SET);
-            fd_read(fd, region_virt, phdrs[i].p_filesz);
-            time_read += global_ticks - time_s;
-
-            vmm_remap_pages(region_phys, virt, elf_address_space, pages, VMM_PRESENT | VMM_USER | VMM_WRITE);
+            uint64_t page_offset = (phdrs[i].p_vaddr + base) & 0xfff;
+            uint64_t pages = (page_offset + phdrs[i].p_memsz + 0x1000 - 1) / 0x1000;
+            uint64_t file_pages = (page_offset + phdrs[i].p_filesz + 0x1000 - 1) / 0x1000;
+            uint64_t virt = (phdrs[i].p_vaddr + base) & ~(0xfff);
+
+            void *region_phys = file_pages ? pmm_try_alloc(file_pages * 0x1000) : NULL;
+            uint64_t file_end = page_offset + phdrs[i].p_filesz;
+            if (region_phys) {
+                uint8_t *region_virt = GET_HIGHER_HALF(uint8_t *, region_phys);
+
+                /* Only zero what the file data doesn't cover */
+                memset(region_virt, 0, page_offset);
+                memset(region_virt + file_end, 0, file_pages * 0x1000 - file_end);
+
+                time_s = timer_now_ms();
+                fd_seek(fd, phdrs[i].p_offset, SEEK_SET);
+                fd_read(fd, region_virt + page_offset, phdrs[i].p_filesz);
+                time_read += timer_now_ms() - time_s;
+
+                vmm_remap_pages(region_phys, (void *) virt, elf_address_space, file_pages, VMM_PRESENT | VMM_USER | VMM_WRITE);
+            } else {
+                /* No contiguous run that big, the segment doesn't need one so load it a page at a time */
+                for (uint64_t j = 0; j < file_pages; j++) {
+                    void *page_phys = pmm_alloc_zeroed(0x1000);
+                    uint64_t start = j ? j * 0x1000 : page_offset;
+                    uint64_t end = (j + 1) * 0x1000 < file_end ? (j + 1) * 0x1000 : file_end;
+
+                    time_s = timer_now_ms();
+                    fd_seek(fd, phdrs[i].p_offset + start - page_offset, SEEK_SET);
+                    fd_read(fd, GET_HIGHER_HALF(uint8_t *, page_phys) + (start - j * 0x1000), end - start);
+                    time_read += timer_now_ms() - time_s;
+
+                    vmm_remap_pages(page_phys, (void *) (virt + j * 0x1000), elf_address_space, 1, VMM_PRESENT | VMM_USER | VMM_WRITE);
+                }
+            }
+
+            vma_fill(vmas, virt, virt + pages * 0x1000, VMM_PRESENT | VMM_USER | VMM_WRITE);
         } else if (phdrs[i].p_type == PT_INTERP) {
             char *ld_path = kcalloc(phdrs[i].p_filesz + 1);
 
-            time_s = global_ticks;
+            time_s = timer_now_ms();
             fd_seek(fd, phdrs[i].p_offset, SEEK_SET);
             fd_read(fd, ld_path, phdrs[i].p_filesz);
-            time_read += global_ticks - time_s;
-            time_s = global_ticks;
-            load_elf_addrspace(ld_path, &dynamic_linker_entry, 0x800000000, elf_address_space, NULL);
-            sprintf("Dyn Linker Load: %lu\n", global_ticks - time_s);
+            time_read += timer_now_ms() - time_s;
+            time_s = timer_now_ms();
+            load_elf_addrspace(ld_path, &dynamic_linker_entry, 0x800000000, elf_address_space, NULL, vmas);
+            sprintf("Dyn Linker Load: %lu\n", timer_now_ms() - time_s);
 
             loaded_dynamic_linker = 1;
 
@@ -140,13 +165,15 @@ void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *e
         *entry_out = dynamic_linker_entry;
     } else {
         *entry_out = ehdr->e_entry + base;
-        void *virt_stack = (void *) USER_STACK_START;
-        void *phys_stack_region = pmm_alloc(USER_STACK_SIZE);
-        void *virt_stack_region = GET_HIGHER_HALF(void *, phys_stack_region);
-        memset(virt_stack_region, 0, USER_STACK_SIZE);
+        uint64_t stack_bottom = USER_STACK_START & ~(0xfff);
+        uint64_t stack_top = stack_bottom + USER_STACK_PAGES * 0x1000;
+
+        /* argv and friends get written through the direct map, so the top of the stack has to be there already */
+        void *phys_stack_region = pmm_alloc_zeroed(USER_STACK_COMMIT);
+        vmm_map_pages(phys_stack_region, (void *) (stack_top - USER_STACK_COMMIT), elf_address_space, 
+            USER_STACK_COMMIT / 0x1000, VMM_PRESENT | VMM_USER | VMM_WRITE);
 
-        vmm_map_pages(phys_stack_region, virt_stack, elf_address_space, USER_STACK_PAGES, 
-            VMM_PRESENT | VMM_USER | VMM_WRITE);
+        vma_fill(vmas, stack_bottom, stack_top, VMM_PRESENT | VMM_USER | VMM_WRITE);
     }
 
     if (auxv_out) {
@@ -167,12 +194,15 @@ void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *e
 int64_t load_elf(char *path) {
     uint64_t entry_point = 0;
     auxv_auxc_group_t auxv_info;
-    void *address_space = load_elf_addrspace(path, &entry_point, 0, NULL, &auxv_info);
+    vma_list_t vmas = {0, {0, 0, 0, 0}};
+    void *address_space = load_elf_addrspace(path, &entry_point, 0, NULL, &auxv_info, &vmas);
     if (!address_space) {
+        vma_clear(&vmas);
         return -1;
     }
 
     process_t *process = create_process(path, address_space);
+    process->vmas.head = vmas.head; // Hand the areas over to the process
     thread_t *thread = create_thread(path, (void *) entry_point, USER_STACK, 3);
     int64_t pid = add_process(process);
 
@@ -49,6 +49,6 @@ typedef struct elf_shdr {
 } __attribute__((packed)) elf_shdr_t;
 
 int64_t load_elf(char *path);
-void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *export_cr3, auxv_auxc_group_t *auxv_out);
+void *load_elf_addrspace(char *path, uint64_t *entry_out, uint64_t base, void *export_cr3, auxv_auxc_group_t *auxv_out, vma_list_t *vmas);
 
 #endif
\ No newline at end of file
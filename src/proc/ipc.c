@@ -3,7 +3,7 @@
 #include "scheduler.h"
 #include "sys/smp.h"
 #include "klibc/stdlib.h"
-#include "drivers/pit.h"
+#include "sys/timer.h"
 
 /* IPC server init includes */
 #include "drivers/vesa.h"
@@ -60,10 +60,10 @@ union ipc_err write_ipc_server(int pid, int port, void *buf, int size) {
     }
 
     if (!handle->listening) {
-        uint64_t start_tick = global_ticks;
+        uint64_t start_tick = timer_now_ms();
         uint64_t listening = 1;
         while (!handle->listening) {
-            if (start_tick + IPC_CONNECT_TIMEOUT_MS > global_ticks) {
+            if (start_tick + IPC_CONNECT_TIMEOUT_MS > timer_now_ms()) {
                 listening = 0;
                 break;
             }
@@ -77,9 +77,9 @@ union ipc_err write_ipc_server(int pid, int port, void *buf, int size) {
     }
 
     if (spinlock_check_and_lock(&handle->connect_lock.lock_dat)) { // Was locked
-        uint64_t start_ticks = global_ticks;
+        uint64_t start_ticks = timer_now_ms();
         uint8_t got_lock = 0;
-        while (start_ticks + IPC_CONNECT_TIMEOUT_MS > global_ticks) {
+        while (start_ticks + IPC_CONNECT_TIMEOUT_MS > timer_now_ms()) {
             if (!spinlock_check_and_lock(&handle->connect_lock.lock_dat)) {
                 got_lock = 1;
                 break; // We own the lock now
@@ -134,10 +134,10 @@ union ipc_err read_ipc_server(int pid, int port, void *buf, int size) {
     }
 
     if (!handle->listening) {
-        uint64_t start_tick = global_ticks;
+        uint64_t start_tick = timer_now_ms();
         uint64_t listening = 1;
         while (!handle->listening) {
-            if (start_tick + IPC_CONNECT_TIMEOUT_MS <= global_ticks) {
+            if (start_tick + IPC_CONNECT_TIMEOUT_MS <= timer_now_ms()) {
                 listening = 0;
                 break;
             }
@@ -151,9 +151,9 @@ union ipc_err read_ipc_server(int pid, int port, void *buf, int size) {
     }
 
     if (spinlock_check_and_lock(&handle->connect_lock.lock_dat)) { // Was locked
-        uint64_t start_ticks = global_ticks;
+        uint64_t start_ticks = timer_now_ms();
         uint8_t got_lock = 0;
-        while (start_ticks + IPC_CONNECT_TIMEOUT_MS > global_ticks) {
+        while (start_ticks + IPC_CONNECT_TIMEOUT_MS > timer_now_ms()) {
             if (!spinlock_check_and_lock(&handle->connect_lock.lock_dat)) {
                 got_lock = 1;
                 break; // We own the lock now
@@ -196,5 +196,6 @@ union ipc_err read_ipc_server(int pid, int port, void *buf, int size) {
 void setup_ipc_servers() {
     /* VESA IPC server */
     thread_t *vesa_ipc = create_thread("VESA IPC server", vesa_ipc_server, (uint64_t) kcalloc(TASK_STACK_SIZE) + TASK_STACK_SIZE, 0);
+    sched_set_policy(vesa_ipc, SCHED_POLICY_FAIR, SCHED_NICE_SERVICE); // Not queued yet, so no lock needed
     add_new_child_thread(vesa_ipc, 0);
 }
\ No newline at end of file
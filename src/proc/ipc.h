@@ -7,6 +7,7 @@
 #define IPC_OPERATION_READ 0
 
 #define IPC_CONNECT_TIMEOUT_MS 50
+#define IPC_MAX_TRANSFER 0x100000 // Largest buffer one read or write can pass, the kernel copies it
 
 #define IPC_INVALID_PARAM 6
 #define IPC_OPERATION_NOT_SUPPORTED 5
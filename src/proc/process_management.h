@@ -4,6 +4,7 @@
 #include "fs/fd.h"
 #include "klibc/hashmap.h"
 #include "proc/sleep_queue.h"
+#include "mm/vma.h"
 
 #define DEFAULT_BRK 0x10000000000
 
@@ -62,6 +63,8 @@ typedef struct {
     uint64_t current_brk;
     lock_t brk_lock;
 
+    vma_list_t vmas; // Demand paged areas of the address space
+
     uint64_t local_watchpoint1; // DR2
     uint64_t local_watchpoint2; // DR3
     uint8_t local_watchpoint1_active;
@@ -76,7 +79,7 @@ typedef struct {
     uint64_t permissions; // Misc permission flags
 } process_t;
 
-typedef struct {
+typedef struct thread {
     char name[50]; // The name of the task
 
     task_regs_t regs; // The task's registers
@@ -87,9 +90,24 @@ typedef struct {
     uint64_t tsc_started; // The last time this task was started
     uint64_t tsc_stopped; // The last time this task was stopped
     uint64_t tsc_total; // The total time this task has been running for
+    uint64_t last_ran_us; // timer_now_us when the task last stopped running
 
     uint8_t state; // State of the task
     int cpu; // CPU the task is running on
+    int last_cpu; // CPU the task last ran on, -1 if it never ran
+    int queue_cpu; // CPU whose run queue holds the task, -1 if not queued
+    struct thread *queue_next; // Run queue or event wait list links
+    struct thread *queue_prev;
+    struct thread *fair_left; // Fair class run queue tree links
+    struct thread *fair_right;
+    struct thread *fair_parent;
+    uint8_t fair_red;
+
+    uint8_t sched_policy; // SCHED_POLICY_FAIR or SCHED_POLICY_FIFO
+    uint8_t rt_priority; // FIFO priority, higher runs first
+    int8_t nice; // Fair share weight, -20 gets the most CPU and 19 the least
+    uint64_t vruntime; // Weighted TSC cycles run, the fair class runs the lowest first
+    uint64_t affinity; // Bitmask of the CPUs the task may run on
 
     int64_t tid; // Task ID
     int64_t parent_pid; // The pid of the parent process
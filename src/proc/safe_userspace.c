@@ -1,39 +1,74 @@
 #include "safe_userspace.h"
 #include "mm/vmm.h"
 #include "klibc/stdlib.h"
+#include "klibc/string.h"
+#include "klibc/errno.h"
 #include "proc/scheduler.h"
 #include "sys/smp.h"
 
+extern extable_entry_t __extable_start[];
+extern extable_entry_t __extable_end[];
+
+/* Pointers from ring 3 have to stay in the lower half. Kernel threads, and
+   calls made with ignore_ring set, can pass anything */
+uint8_t userspace_range_ok(void *addr, uint64_t size) {
+    if (get_cur_thread()->ring != 3 || get_cpu_locals()->ignore_ring) {
+        return 1;
+    }
+
+    uint64_t end = (uint64_t) addr + size;
+    return end >= (uint64_t) addr && end <= 0x800000000000;
+}
+
+int copy_from_userspace(void *dst, void *src, uint64_t size) {
+    if (!userspace_range_ok(src, size) || memcpy_from_userspace(dst, src, size)) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+int copy_to_userspace(void *dst, void *src, uint64_t size) {
+    if (!userspace_range_ok(dst, size) || memcpy_to_userspace(dst, src, size)) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
 char *check_and_copy_string(char *userspace_string) {
-    uint64_t string_length = 0;
-    int found_string_null = 0;
-    for (uint64_t i = 0; i < 4096; i++) {
-        if (!range_mapped((void *) ((uint64_t) userspace_string + i), sizeof(char)) || ((uint64_t) userspace_string + 1 + i > 0x7fffffffffff && get_cur_thread()->ring == 3 && (!get_cpu_locals()->ignore_ring))) {
-            sprintf("mapping error\n");
-            if (!range_mapped((void *) ((uint64_t) userspace_string + i), sizeof(char))) {
-                sprintf("range_mapped check failed (addr: %lx)\n", ((uint64_t) userspace_string + i));
-            }
-            if ((((uint64_t) userspace_string + 1 + i) > 0x7fffffffffff && get_cur_thread()->ring == 3 && (!get_cpu_locals()->ignore_ring))) {
-                sprintf("userspace check failed (current ring: %u) address: %lx\n", get_cur_thread()->ring, (uint64_t) userspace_string + 1 + i);
-            }
-            return (void *) 0;
-        }
-        string_length++;
-        if (!userspace_string[i]) {
-            found_string_null = 1;
-            break;
-        }
+    if (!userspace_range_ok(userspace_string, 1)) {
+        sprintf("userspace check failed (current ring: %u) address: %lx\n", get_cur_thread()->ring, (uint64_t) userspace_string);
+        return (void *) 0;
+    }
+
+    /* Don't let the string run into the kernel half */
+    uint64_t max = 4096;
+    if (!userspace_range_ok(userspace_string, max)) {
+        max = 0x800000000000 - (uint64_t) userspace_string;
     }
 
-    if (!found_string_null) {
-        sprintf("failed to find null in string\n");
+    int64_t string_length = strlen_from_userspace(userspace_string, max);
+    if (string_length < 0) {
+        sprintf("bad string or no null in string (addr: %lx)\n", (uint64_t) userspace_string);
         return (void *) 0;
     }
 
-    char *ret = kcalloc(string_length);
-    for (uint64_t i = 0; i < string_length; i++) {
-        ret[i] = userspace_string[i];
+    char *ret = kcalloc(string_length + 1);
+    if (strcpy_from_userspace(ret, userspace_string, string_length + 1) != string_length) {
+        kfree(ret); // Changed under us
+        return (void *) 0;
     }
 
     return ret;
+}
+
+/* Kernel mode faults the VMM couldn't resolve end up here. If they came from
+   one of the user copy routines, continue at its fixup instead of panicking */
+uint8_t extable_fixup(int_reg_t *r) {
+    for (extable_entry_t *entry = __extable_start; entry < __extable_end; entry++) {
+        if (entry->fault_rip == r->rip) {
+            r->rip = entry->fixup_rip;
+            return 1;
+        }
+    }
+    return 0;
 }
\ No newline at end of file
@@ -1,7 +1,23 @@
 #ifndef SAFE_USERSPACE_H
 #define SAFE_USERSPACE_H
 #include <stdint.h>
+#include "sys/int/isr.h"
+
+typedef struct {
+    uint64_t fault_rip;
+    uint64_t fixup_rip;
+} extable_entry_t;
+
+/* Raw copies in asm/user_copy.asm, they recover from faults but don't check anything */
+extern uint64_t memcpy_from_userspace(void *dst, void *src, uint64_t byte_count);
+extern uint64_t memcpy_to_userspace(void *dst, void *src, uint64_t byte_count);
+extern int64_t strcpy_from_userspace(char *dst, char *src, uint64_t max);
+extern int64_t strlen_from_userspace(char *str, uint64_t max);
 
 char *check_and_copy_string(char *userspace_string);
+uint8_t userspace_range_ok(void *addr, uint64_t size);
+int copy_from_userspace(void *dst, void *src, uint64_t size);
+int copy_to_userspace(void *dst, void *src, uint64_t size);
+uint8_t extable_fixup(int_reg_t *r);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,442 @@
+#include "sched_policy.h"
+#include "sys/timer.h"
+#include "sys/smp.h"
+#include <stddef.h>
+
+#define SCHED_NICE_0_WEIGHT 1024
+#define SCHED_FAIR_WAKE_CREDIT_US (sched_period * 1000) // How far behind the queue a woken thread may start
+#define SCHED_RT_PERIOD_US 1000000
+#define SCHED_RT_RUNTIME_US 950000 // FIFO threads leave the rest of each period to the fair class
+
+/* Weight per nice level, each level gets about 10% more CPU than the one after it */
+static const uint32_t nice_weights[SCHED_NICE_MAX - SCHED_NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548, 7620, 6100, 4904, 3906,
+    /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+    /*   0 */ 1024, 820, 655, 526, 423,
+    /*   5 */ 335, 272, 215, 172, 137,
+    /*  10 */ 110, 87, 70, 56, 45,
+    /*  15 */ 36, 29, 23, 18, 15
+};
+
+/* Real time FIFO, a queue per priority and the highest non-empty one runs */
+
+static void fifo_enqueue(run_queue_t *queue, thread_t *thread, int flags) {
+    thread_queue_t *level = &queue->rt[thread->rt_priority];
+    if (flags & SCHED_ENQUEUE_PREEMPTED) {
+        thread_queue_insert_after(level, NULL, thread); // Preemption doesn't cost it its place
+    } else {
+        thread_queue_push(level, thread);
+    }
+    queue->rt_bitmap |= 1U << thread->rt_priority;
+}
+
+static void fifo_dequeue(run_queue_t *queue, thread_t *thread) {
+    thread_queue_t *level = &queue->rt[thread->rt_priority];
+    thread_queue_remove(level, thread);
+    if (!level->head) {
+        queue->rt_bitmap &= ~(1U << thread->rt_priority);
+    }
+}
+
+static thread_t *fifo_pick(run_queue_t *queue) {
+    if (!queue->rt_bitmap) {
+        return NULL;
+    }
+    return queue->rt[31 - __builtin_clz(queue->rt_bitmap)].head;
+}
+
+static thread_t *fifo_next(run_queue_t *queue, thread_t *thread) {
+    int priority = SCHED_RT_PRIORITIES;
+    if (thread) {
+        if (thread->queue_next) {
+            return thread->queue_next;
+        }
+        priority = thread->rt_priority;
+    }
+
+    while (--priority >= 0) {
+        if (queue->rt[priority].head) {
+            return queue->rt[priority].head;
+        }
+    }
+    return NULL;
+}
+
+static void fifo_charge(run_queue_t *queue, thread_t *thread, uint64_t tsc) {
+    queue->rt_tsc += tsc;
+}
+
+/* Start a new period once the old one is over, then check the budget */
+static int fifo_throttled(run_queue_t *queue) {
+    uint64_t now = timer_now_us();
+    if (now - queue->rt_period_start >= SCHED_RT_PERIOD_US) {
+        queue->rt_period_start = now;
+        queue->rt_tsc = 0;
+    }
+    return queue->rt_tsc >= timer_us_to_tsc(SCHED_RT_RUNTIME_US);
+}
+
+/* Weighted fair share, the thread that has had the least weighted run time goes next */
+
+#define FAIR_RED(thread) ((thread) && (thread)->fair_red)
+
+static void fair_rotate_left(thread_tree_t *tree, thread_t *x) {
+    thread_t *y = x->fair_right;
+    x->fair_right = y->fair_left;
+    if (y->fair_left) {
+        y->fair_left->fair_parent = x;
+    }
+
+    y->fair_parent = x->fair_parent;
+    if (!x->fair_parent) {
+        tree->root = y;
+    } else if (x == x->fair_parent->fair_left) {
+        x->fair_parent->fair_left = y;
+    } else {
+        x->fair_parent->fair_right = y;
+    }
+
+    y->fair_left = x;
+    x->fair_parent = y;
+}
+
+static void fair_rotate_right(thread_tree_t *tree, thread_t *x) {
+    thread_t *y = x->fair_left;
+    x->fair_left = y->fair_right;
+    if (y->fair_right) {
+        y->fair_right->fair_parent = x;
+    }
+
+    y->fair_parent = x->fair_parent;
+    if (!x->fair_parent) {
+        tree->root = y;
+    } else if (x == x->fair_parent->fair_right) {
+        x->fair_parent->fair_right = y;
+    } else {
+        x->fair_parent->fair_left = y;
+    }
+
+    y->fair_right = x;
+    x->fair_parent = y;
+}
+
+static thread_t *fair_tree_next(thread_t *thread) {
+    if (thread->fair_right) {
+        thread = thread->fair_right;
+        while (thread->fair_left) {
+            thread = thread->fair_left;
+        }
+        return thread;
+    }
+
+    while (thread->fair_parent && thread == thread->fair_parent->fair_right) {
+        thread = thread->fair_parent;
+    }
+    return thread->fair_parent;
+}
+
+/* Equal vruntimes go to the right, so they run in the order they came in */
+static void fair_tree_insert(thread_tree_t *tree, thread_t *thread) {
+    thread_t *parent = NULL;
+    thread_t **link = &tree->root;
+    uint8_t leftmost = 1;
+    while (*link) {
+        parent = *link;
+        if (thread->vruntime < parent->vruntime) {
+            link = &parent->fair_left;
+        } else {
+            link = &parent->fair_right;
+            leftmost = 0;
+        }
+    }
+
+    thread->fair_parent = parent;
+    thread->fair_left = NULL;
+    thread->fair_right = NULL;
+    thread->fair_red = 1;
+    *link = thread;
+    if (leftmost) {
+        tree->leftmost = thread;
+    }
+    tree->count++;
+
+    thread_t *z = thread;
+    while (FAIR_RED(z->fair_parent)) {
+        thread_t *p = z->fair_parent;
+        thread_t *g = p->fair_parent;
+        if (p == g->fair_left) {
+            thread_t *uncle = g->fair_right;
+            if (FAIR_RED(uncle)) {
+                p->fair_red = 0;
+                uncle->fair_red = 0;
+                g->fair_red = 1;
+                z = g;
+            } else {
+                if (z == p->fair_right) {
+                    z = p;
+                    fair_rotate_left(tree, z);
+                    p = z->fair_parent;
+                }
+                p->fair_red = 0;
+                g->fair_red = 1;
+                fair_rotate_right(tree, g);
+            }
+        } else {
+            thread_t *uncle = g->fair_left;
+            if (FAIR_RED(uncle)) {
+                p->fair_red = 0;
+                uncle->fair_red = 0;
+                g->fair_red = 1;
+                z = g;
+            } else {
+                if (z == p->fair_left) {
+                    z = p;
+                    fair_rotate_right(tree, z);
+                    p = z->fair_parent;
+                }
+                p->fair_red = 0;
+                g->fair_red = 1;
+                fair_rotate_left(tree, g);
+            }
+        }
+    }
+    tree->root->fair_red = 0;
+}
+
+static void fair_transplant(thread_tree_t *tree, thread_t *u, thread_t *v) {
+    if (!u->fair_parent) {
+        tree->root = v;
+    } else if (u == u->fair_parent->fair_left) {
+        u->fair_parent->fair_left = v;
+    } else {
+        u->fair_parent->fair_right = v;
+    }
+    if (v) {
+        v->fair_parent = u->fair_parent;
+    }
+}
+
+/* x may be NULL, so its parent comes along. A NULL x is the left child
+   whenever the parent's left is NULL, its sibling can't be */
+static void fair_delete_fixup(thread_tree_t *tree, thread_t *x, thread_t *p) {
+    while (x != tree->root && !FAIR_RED(x)) {
+        if (x == p->fair_left) {
+            thread_t *w = p->fair_right;
+            if (FAIR_RED(w)) {
+                w->fair_red = 0;
+                p->fair_red = 1;
+                fair_rotate_left(tree, p);
+                w = p->fair_right;
+            }
+            if (!FAIR_RED(w->fair_left) && !FAIR_RED(w->fair_right)) {
+                w->fair_red = 1;
+                x = p;
+                p = x->fair_parent;
+            } else {
+                if (!FAIR_RED(w->fair_right)) {
+                    w->fair_left->fair_red = 0;
+                    w->fair_red = 1;
+                    fair_rotate_right(tree, w);
+                    w = p->fair_right;
+                }
+                w->fair_red = p->fair_red;
+                p->fair_red = 0;
+                w->fair_right->fair_red = 0;
+                fair_rotate_left(tree, p);
+                x = tree->root;
+            }
+        } else {
+            thread_t *w = p->fair_left;
+            if (FAIR_RED(w)) {
+                w->fair_red = 0;
+                p->fair_red = 1;
+                fair_rotate_right(tree, p);
+                w = p->fair_left;
+            }
+            if (!FAIR_RED(w->fair_right) && !FAIR_RED(w->fair_left)) {
+                w->fair_red = 1;
+                x = p;
+                p = x->fair_parent;
+            } else {
+                if (!FAIR_RED(w->fair_left)) {
+                    w->fair_right->fair_red = 0;
+                    w->fair_red = 1;
+                    fair_rotate_left(tree, w);
+                    w = p->fair_left;
+                }
+                w->fair_red = p->fair_red;
+                p->fair_red = 0;
+                w->fair_left->fair_red = 0;
+                fair_rotate_right(tree, p);
+                x = tree->root;
+            }
+        }
+    }
+    if (x) {
+        x->fair_red = 0;
+    }
+}
+
+static void fair_tree_remove(thread_tree_t *tree, thread_t *z) {
+    if (tree->leftmost == z) {
+        tree->leftmost = fair_tree_next(z);
+    }
+
+    thread_t *x;
+    thread_t *x_parent;
+    uint8_t removed_red = z->fair_red;
+    if (!z->fair_left) {
+        x = z->fair_right;
+        x_parent = z->fair_parent;
+        fair_transplant(tree, z, x);
+    } else if (!z->fair_right) {
+        x = z->fair_left;
+        x_parent = z->fair_parent;
+        fair_transplant(tree, z, x);
+    } else {
+        thread_t *y = z->fair_right;
+        while (y->fair_left) {
+            y = y->fair_left;
+        }
+        removed_red = y->fair_red;
+        x = y->fair_right;
+
+        if (y->fair_parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = y->fair_parent;
+            fair_transplant(tree, y, y->fair_right);
+            y->fair_right = z->fair_right;
+            y->fair_right->fair_parent = y;
+        }
+
+        fair_transplant(tree, z, y);
+        y->fair_left = z->fair_left;
+        y->fair_left->fair_parent = y;
+        y->fair_red = z->fair_red;
+    }
+
+    z->fair_left = NULL;
+    z->fair_right = NULL;
+    z->fair_parent = NULL;
+    tree->count--;
+    if (!removed_red) {
+        fair_delete_fixup(tree, x, x_parent);
+    }
+}
+
+static void fair_update_min(run_queue_t *queue, thread_t *running) {
+    uint64_t floor = running->vruntime;
+    if (queue->fair.leftmost && queue->fair.leftmost->vruntime < floor) {
+        floor = queue->fair.leftmost->vruntime;
+    }
+    if (floor > queue->min_vruntime) {
+        queue->min_vruntime = floor;
+    }
+}
+
+static void fair_enqueue(run_queue_t *queue, thread_t *thread, int flags) {
+    /* A thread back from waiting gets a little credit, not all of the time it missed */
+    if (!(flags & SCHED_ENQUEUE_PREEMPTED)) {
+        uint64_t credit = timer_us_to_tsc(SCHED_FAIR_WAKE_CREDIT_US);
+        if (queue->min_vruntime > credit && thread->vruntime < queue->min_vruntime - credit) {
+            thread->vruntime = queue->min_vruntime - credit;
+        }
+    }
+
+    fair_tree_insert(&queue->fair, thread);
+}
+
+static void fair_dequeue(run_queue_t *queue, thread_t *thread) {
+    fair_tree_remove(&queue->fair, thread);
+}
+
+static thread_t *fair_pick(run_queue_t *queue) {
+    return queue->fair.leftmost;
+}
+
+static thread_t *fair_next(run_queue_t *queue, thread_t *thread) {
+    return thread ? fair_tree_next(thread) : queue->fair.leftmost;
+}
+
+static void fair_charge(run_queue_t *queue, thread_t *thread, uint64_t tsc) {
+    thread->vruntime += tsc * SCHED_NICE_0_WEIGHT / nice_weights[thread->nice - SCHED_NICE_MIN];
+    fair_update_min(queue, thread);
+}
+
+/* Keep the thread's lead or lag over the queue it leaves */
+static void fair_migrate(run_queue_t *from, run_queue_t *to, thread_t *thread) {
+    uint64_t lag = thread->vruntime > from->min_vruntime ? thread->vruntime - from->min_vruntime : 0;
+    thread->vruntime = to->min_vruntime + lag;
+}
+
+static sched_class_t fifo_class = {"fifo", fifo_enqueue, fifo_dequeue, fifo_pick, fifo_next, fifo_charge, NULL, fifo_throttled};
+static sched_class_t fair_class = {"fair", fair_enqueue, fair_dequeue, fair_pick, fair_next, fair_charge, fair_migrate, NULL};
+
+/* In the order they get to run */
+static sched_class_t *sched_classes[] = {&fifo_class, &fair_class};
+#define SCHED_CLASS_COUNT (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
+sched_class_t *sched_class_of(thread_t *thread) {
+    return thread->sched_policy == SCHED_POLICY_FIFO ? &fifo_class : &fair_class;
+}
+
+thread_t *sched_policy_pick(run_queue_t *queue) {
+    for (uint64_t i = 0; i < SCHED_CLASS_COUNT; i++) {
+        if (sched_classes[i]->throttled && sched_classes[i]->throttled(queue)) {
+            continue;
+        }
+
+        thread_t *thread = sched_classes[i]->pick(queue);
+        if (thread) {
+            return thread;
+        }
+    }
+
+    /* Throttling makes room for other classes, it never leaves the CPU idle */
+    for (uint64_t i = 0; i < SCHED_CLASS_COUNT; i++) {
+        thread_t *thread = sched_classes[i]->pick(queue);
+        if (thread) {
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+/* Walk every queued thread, class by class. NULL gets the first */
+thread_t *sched_policy_next(run_queue_t *queue, thread_t *thread) {
+    uint64_t i = 0;
+    if (thread) {
+        thread_t *next = sched_class_of(thread)->next(queue, thread);
+        if (next) {
+            return next;
+        }
+
+        while (sched_classes[i] != sched_class_of(thread)) {
+            i++;
+        }
+        i++;
+    }
+
+    for (; i < SCHED_CLASS_COUNT; i++) {
+        thread_t *first = sched_classes[i]->next(queue, NULL);
+        if (first) {
+            return first;
+        }
+    }
+    return NULL;
+}
+
+/* Whether waking a thread should kick the one running off its CPU now */
+int sched_policy_preempts(thread_t *waking, thread_t *running) {
+    cpu_locals_t *locals = running->cpu != -1 ? hashmap_get_elem(cpu_locals_list, (uint64_t) running->cpu) : NULL;
+    if (locals && running->tid == locals->idle_tid) {
+        return 1; // Anything beats idling, and an idle CPU has no tick coming
+    }
+    if (waking->sched_policy != SCHED_POLICY_FIFO) {
+        return 0; // Fair threads wait for the tick
+    }
+    return running->sched_policy != SCHED_POLICY_FIFO || waking->rt_priority > running->rt_priority;
+}
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef SCHED_POLICY_H
+#define SCHED_POLICY_H
+#include <stdint.h>
+#include "proc/scheduler.h"
+
+#define SCHED_ENQUEUE_PREEMPTED 1 // The thread was running and got preempted, rather than woken or yielding
+
+/* A scheduling class, the scheduler runs the first thread the classes
+   offer in order. Everything here is called with sched_lock held */
+typedef struct {
+    char *name;
+    void (*enqueue)(run_queue_t *queue, thread_t *thread, int flags);
+    void (*dequeue)(run_queue_t *queue, thread_t *thread);
+    thread_t *(*pick)(run_queue_t *queue); // The next thread to run, left queued
+    thread_t *(*next)(run_queue_t *queue, thread_t *thread); // For walking the class's threads, NULL gets the first
+    void (*charge)(run_queue_t *queue, thread_t *thread, uint64_t tsc); // The thread ran for tsc cycles
+    void (*migrate)(run_queue_t *from, run_queue_t *to, thread_t *thread); // Optional, before moving CPUs
+    int (*throttled)(run_queue_t *queue); // Optional, pass the class over for now
+} sched_class_t;
+
+sched_class_t *sched_class_of(thread_t *thread);
+thread_t *sched_policy_pick(run_queue_t *queue);
+thread_t *sched_policy_next(run_queue_t *queue, thread_t *thread);
+int sched_policy_preempts(thread_t *waking, thread_t *running);
+
+#endif
\ No newline at end of file
@@ -18,90 +18,40 @@ typedef struct {
 hashmap_t *futex_waiters = (void *) 0; // a hashmap of futex address -> thread **
 lock_t futex_lock = {0, 0, 0, 0};
 
+/* Only reserves the range, pages get zeroed and mapped when they are first touched */
 void *psuedo_mmap(void *base, uint64_t len, syscall_reg_t *r) {
     interrupt_safe_lock(sched_lock);
     len = (len + 0x1000 - 1) / 0x1000;
     process_t *process = processes[get_cur_pid()];
-    if (!process) { r->rdx = ESRCH; interrupt_safe_unlock(sched_lock); return (void *) 0; } // bruh
-
-    void *phys = pmm_alloc(len * 0x1000);
-    memset(GET_HIGHER_HALF(void *, phys), 0, len * 0x1000);
+    interrupt_safe_unlock(sched_lock);
+    if (!process) { r->rdx = ESRCH; return (void *) 0; } // bruh
 
     if (base) {
-        uint64_t mapped = 0;
-        int map_err = 0;
-        for (uint64_t i = 0; i < len; i++) {
-            int err = vmm_map_pages(phys, (void *) ((uint64_t) base + i * 0x1000), 
-                (void *) process->cr3, 1, 
-                VMM_WRITE | VMM_USER | VMM_PRESENT);
-            phys = (void *) ((uint64_t) phys + 0x1000);
-            
-            if (err) {
-                mapped = i;
-                map_err = 1;
-                break;
-            }
+        uint64_t start = (uint64_t) base & ~(0xfff);
+        uint64_t end = start + len * 0x1000;
+        if (end > 0x800000000000 || end < start) {
+            r->rdx = EINVAL;
+            return (void *) 0;
         }
 
-        if (map_err) {
-            /* Unmap the error */
-            for (uint64_t i = 0; i < mapped; i++) {
-                vmm_unmap_pages((void *) ((uint64_t) base + i * 0x1000), 
-                    (void *) process->cr3, 1);
-            }
-            phys = (void *) ((uint64_t) phys - (0x1000 * mapped));
+        if (vma_add(&process->vmas, start, end, VMM_WRITE | VMM_USER | VMM_PRESENT)) {
             r->rdx = ENOMEM;
-            pmm_unalloc(phys, len * 0x1000);
-
-            interrupt_safe_unlock(sched_lock);
             return (void *) 0;
-        } else {
-            void *ret = (void *) base;
-
-            interrupt_safe_unlock(sched_lock);
-            return ret;
         }
+        return base;
     } else {
         lock(process->brk_lock);
-        uint64_t mapped = 0;
-        int map_err = 0;
-        for (uint64_t i = 0; i < len; i++) {
-            int err = vmm_map_pages(phys, (void *) ((uint64_t) process->current_brk + i * 0x1000), 
-                (void *) process->cr3, 1, 
-                VMM_WRITE | VMM_USER | VMM_PRESENT);
-            
-            phys = (void *) ((uint64_t) phys + 0x1000);
-            
-            if (err) {
-                mapped = i;
-                map_err = 1;
-                break;
-            }
-        }
-
-        if (map_err) {
-            /* Unmap the error */
-            for (uint64_t i = 0; i < mapped; i++) {
-                vmm_unmap_pages((void *) ((uint64_t) process->current_brk + i * 0x1000), 
-                    (void *) process->cr3, 1);
-            }
-            r->rdx = ENOMEM;
-            phys = (void *) ((uint64_t) phys - (0x1000 * mapped));
-            pmm_unalloc(phys, len * 0x1000);
-
+        void *ret = (void *) process->current_brk;
+        if (vma_add(&process->vmas, process->current_brk, process->current_brk + len * 0x1000, 
+            VMM_WRITE | VMM_USER | VMM_PRESENT)) {
             unlock(process->brk_lock);
-
-            interrupt_safe_unlock(sched_lock);
+            r->rdx = ENOMEM;
             return (void *) 0;
-        } else {
-            void *ret = (void *) process->current_brk;
-            process->current_brk += len * 0x1000;
-
-            unlock(process->brk_lock);
-
-            interrupt_safe_unlock(sched_lock);
-            return ret;
         }
+        process->current_brk += len * 0x1000;
+        unlock(process->brk_lock);
+
+        return ret;
     }
 }
 
@@ -120,14 +70,9 @@ int munmap(char *addr, uint64_t len) {
         return -EINVAL;
     }
 
-    for (uint64_t i = 0; i < len; i++) {
-        void *phys = virt_to_phys(addr, (void *) vmm_get_base());
-        vmm_unmap(addr, 1);
-        if ((uint64_t) phys != 0xffffffffffffffff) {
-            pmm_unalloc(phys, 0x1000);
-        }
-        addr += 0x1000;
-    }
+    vma_remove(&process->vmas, (uint64_t) addr, (uint64_t) addr + len * 0x1000);
+
+    vmm_unmap_free_pages(addr, (void *) vmm_get_base(), len);
     return 0;
 }
 
@@ -137,6 +82,7 @@ int fork(syscall_reg_t *r) {
     void *new_cr3 = vmm_fork((void *) process->cr3); // Fork address space
 
     process_t *forked_process = create_process(process->name, new_cr3);
+    vma_clone(&process->vmas, &forked_process->vmas);
     int64_t new_pid = add_new_pid(1);
     processes[new_pid] = forked_process;
     forked_process->pid = new_pid;
@@ -185,6 +131,7 @@ int fork(syscall_reg_t *r) {
     thread->regs.rip = r->rcx;
     thread->regs.rflags = r->r11;
     memcpy((uint8_t *) old_thread->sse_region, (uint8_t *) thread->sse_region, 512);
+    sched_inherit(thread, old_thread);
 
     interrupt_safe_unlock(sched_lock);
 
@@ -200,14 +147,16 @@ void execve(char *executable_path, char **argv, char **envp, syscall_reg_t *r) {
     uint64_t envc = 0;
     int found_null_argv = 0;
     int found_null_envp = 0;
+    uint64_t error = EFAULT;
 
     for (uint64_t i = 0; i < 128; i++) {
-        if (!range_mapped((void *) ((uint64_t) argv + (sizeof(char *) * i)), sizeof(char *)) || ((uint64_t) argv + 8 + (sizeof(char *) * i)) > 0x7fffffffffff) {
+        char *arg;
+        if (copy_from_userspace(&arg, &argv[i], sizeof(char *))) {
             r->rdx = EFAULT;
             return;
         }
 
-        if (!argv[i]) {
+        if (!arg) {
             found_null_argv = 1;
             break;
         }
@@ -215,12 +164,13 @@ void execve(char *executable_path, char **argv, char **envp, syscall_reg_t *r) {
     }
 
     for (uint64_t i = 0; i < 128; i++) {
-        if (!range_mapped((void *) ((uint64_t) envp + (sizeof(char *) * i)), sizeof(char *)) || ((uint64_t) envp + 8 + (sizeof(char *) * i)) > 0x7fffffffffff) {
+        char *env;
+        if (copy_from_userspace(&env, &envp[i], sizeof(char *))) {
             r->rdx = EFAULT;
             return;
         }
 
-        if (!envp[i]) {
+        if (!env) {
             found_null_envp = 1;
             break;
         }
@@ -237,7 +187,10 @@ void execve(char *executable_path, char **argv, char **envp, syscall_reg_t *r) {
     char *kernel_exec_path = (void *) 0;
 
     for (uint64_t i = 0; i < argc; i++) {
-        char *string = argv[i];
+        char *string;
+        if (copy_from_userspace(&string, &argv[i], sizeof(char *))) {
+            goto fault_return;
+        }
         void *kernel_string = check_and_copy_string(string);
         if (!kernel_string) {
             goto fault_return;
@@ -247,7 +200,10 @@ void execve(char *executable_path, char **argv, char **envp, syscall_reg_t *r) {
     }
 
     for (uint64_t i = 0; i < envc; i++) {
-        char *string = envp[i];
+        char *string;
+        if (copy_from_userspace(&string, &envp[i], sizeof(char *))) {
+            goto fault_return;
+        }
         void *kernel_string = check_and_copy_string(string);
         if (!kernel_string) {
             goto fault_return;
@@ -261,6 +217,20 @@ void execve(char *executable_path, char **argv, char **envp, syscall_reg_t *r) {
         goto fault_return;
     }
 
+    /* The strings and pointers go into the stack pages mapped at exec, so
+       they have to fit in those */
+    uint64_t args_size = (argc + envc + 2) * sizeof(char *) + 16;
+    for (uint64_t i = 0; i < argc; i++) {
+        args_size += strlen(kernel_argv[i]) + 1;
+    }
+    for (uint64_t i = 0; i < envc; i++) {
+        args_size += strlen(kernel_envp[i]) + 1;
+    }
+    if (args_size > USER_ARGS_MAX) {
+        error = E2BIG;
+        goto fault_return;
+    }
+
     urm_execve_data data;
     data.argv = kernel_argv;
     data.envp = kernel_envp;
@@ -290,7 +260,7 @@ fault_return:
     if (kernel_exec_path) {
         kfree(kernel_exec_path);
     }
-    r->rdx = EFAULT;
+    r->rdx = error;
     return;
 failed:
     sprintf("returning, execVE failed\n");
@@ -336,7 +306,7 @@ int futex_wake(uint32_t *futex) {
     for (uint32_t i = 0; i < waiting_threads->count; i++) {
         if (waiting_threads->waiting[i]) {
             interrupt_safe_lock(sched_lock);
-            waiting_threads->waiting[i]->state = READY;
+            sched_wake(waiting_threads->waiting[i]);
             interrupt_safe_unlock(sched_lock);
 
             waiting_threads->waiting[i] = NULL;
@@ -13,12 +13,15 @@
 #include "io/msr.h"
 #include "mm/vmm.h"
 #include "mm/pmm.h"
+#include "mm/slab.h"
 #include "sys/smp.h"
 #include "sys/apic.h"
 #include <stddef.h>
 
-#include "drivers/pit.h"
+#include "sys/timer.h"
 #include "urm.h"
+#include "event.h"
+#include "sched_policy.h"
 
 extern char syscall_stub[];
 
@@ -29,14 +32,18 @@ process_t **processes;
 
 uint64_t process_count = 0;
 
+#define SCHED_CACHE_HOT_US 500 // A thread that ran this recently still has a warm cache
+#define SCHED_RETRY_US 1000 // How soon a timer interrupt that lost the race for sched_lock tries again
+#define SCHED_BALANCE_INTERVAL 4 // Schedules between imbalance checks on a busy CPU
+#define SCHED_HOT_STEAL_FAILS 8 // Refused steals before cache hot threads may move
+
 uint8_t scheduler_enabled = 0;
 interrupt_safe_lock_t sched_lock = {0, 0, 0, 0, -1};
+static slab_cache_t thread_cache = SLAB_CACHE_INIT("thread_t", sizeof(thread_t));
 
 task_regs_t default_kernel_regs = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x10,0x8,0,0x202,0,0x1F80,0x33f};
 task_regs_t default_user_regs = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x23,0x1B,0,0x202,0,0x1F80,0x33f};
 
-int scheduler_ran = 0;
-
 uint64_t get_thread_list_size() {
     return threads_list_size;
 }
@@ -49,22 +56,23 @@ void unlock_scheduler() {
     interrupt_safe_unlock(sched_lock);
 }
 
-void send_scheduler_ipis() {
-    madt_ent0_t **cpus = (madt_ent0_t **) vector_items(&cpu_vector);
-    for (uint64_t i = 0; i < cpu_vector.items_count; i++) {
-        if (i < cpu_vector.items_count) {
-            if ((cpus[i]->cpu_flags & 1 || cpus[i]->cpu_flags & 2) && cpus[i]->apic_id != get_lapic_id()) {
-                send_ipi(cpus[i]->apic_id, (1 << 14) | 253); // Send interrupt 253
-                while (!scheduler_ran) { asm("pause"); }
-                scheduler_ran = 0;
-            }
-        }
-    }
-}
-
 void _idle() {
     while (1) {
-        asm volatile("hlt");
+        /* A wakeup IPI couldn't schedule, or an interrupt queued something here */
+        if (get_cpu_locals()->need_resched || get_cpu_locals()->run_queue.count) {
+            yield();
+            continue;
+        }
+
+        /* Nothing else to run, so zero frames for the pool until it's full */
+        if (!pmm_zero_pool_fill()) {
+            asm volatile("cli");
+            if (get_cpu_locals()->need_resched || get_cpu_locals()->run_queue.count) {
+                asm volatile("sti");
+            } else {
+                asm volatile("sti; hlt"); // No interrupt can land between sti and hlt
+            }
+        }
     }
 }
 
@@ -89,6 +97,7 @@ void init_sched_cpu_locals() {
     get_cpu_locals()->idle_start_tsc = read_tsc();
     get_cpu_locals()->currently_idle = 1;
     get_cpu_locals()->total_tsc = read_tsc();
+    get_cpu_locals()->sched_online = 1;
 }
 
 /* Initialize the BSP for scheduling */
@@ -97,6 +106,9 @@ void scheduler_init_bsp() {
     asm volatile("fxsave %0;"::"m"(default_sse_state));
 
     init_sched_cpu_locals(); // Sets up CPU locals for the scheduler including the idle task
+
+    timer_init_cpu();
+    timer_arm(timer_now_us() + sched_period * 1000);
 }
 
 /* Initilialize an AP for scheduling */
@@ -104,6 +116,8 @@ void scheduler_init_ap() {
     init_scheduler_msr();
 
     init_sched_cpu_locals(); // Sets up CPU locals for the scheduler including the idle task
+    timer_init_cpu();
+    timer_arm(timer_now_us() + sched_period * 1000);
 }
 
 /* Create a new thread *and* add it to the list */
@@ -120,6 +134,9 @@ int64_t start_thread(thread_t *thread) {
     thread->tid = tid;
 
     threads[tid] = thread;
+    if (thread->state == READY) {
+        sched_wake(thread);
+    }
 
     interrupt_safe_unlock(sched_lock);
     return tid;
@@ -128,7 +145,7 @@ int64_t start_thread(thread_t *thread) {
 /* Allocate data for a new thread data block and return it */
 thread_t *create_thread(char *name, void (*main)(), uint64_t rsp, uint8_t ring) {
     /* Allocate new task and it's kernel stack */
-    thread_t *new_task = kcalloc(sizeof(thread_t));
+    thread_t *new_task = slab_alloc(&thread_cache);
     new_task->kernel_stack = (uint64_t) kcalloc(0x1000) + 0x1000;
 
     /* Setup ring */
@@ -144,6 +161,16 @@ thread_t *create_thread(char *name, void (*main)(), uint64_t rsp, uint8_t ring)
     new_task->regs.cr3 = base_kernel_cr3;
     new_task->sleep_node = kcalloc(sizeof(sleep_queue_t));
     new_task->state = READY;
+    new_task->cpu = -1;
+    new_task->last_cpu = -1;
+    new_task->queue_cpu = -1;
+    new_task->queue_next = NULL;
+    new_task->queue_prev = NULL;
+    new_task->sched_policy = SCHED_POLICY_FAIR;
+    new_task->rt_priority = 0;
+    new_task->nice = 0;
+    new_task->vruntime = 0;
+    new_task->affinity = SCHED_AFFINITY_ALL;
     strcpy(name, new_task->name);
     memcpy((uint8_t *) default_sse_state, (uint8_t *) new_task->sse_region, 512);
 
@@ -210,6 +237,9 @@ int64_t add_new_child_thread_no_stack_init(thread_t *thread, int64_t pid) {
     int64_t index = add_to_process(new_parent, 1);
 
     new_parent->threads[index] = thread->tid;
+    if (thread->state == READY) {
+        sched_wake(thread);
+    }
 
     interrupt_safe_unlock(sched_lock);
     return new_tid;
@@ -336,6 +366,9 @@ done:
     index = add_to_process(new_parent, 1);
 
     new_parent->threads[index] = thread->tid;
+    if (thread->state == READY) {
+        sched_wake(thread);
+    }
 
     interrupt_safe_unlock(sched_lock);
     return new_tid;
@@ -413,6 +446,303 @@ thread_t *add_basic_kernel_thread(char *name, void (*main)(), uint8_t init_state
     return added_thread;
 }
 
+void thread_queue_push(thread_queue_t *queue, thread_t *thread) {
+    thread->queue_next = NULL;
+    thread->queue_prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->queue_next = thread;
+    } else {
+        queue->head = thread;
+    }
+    queue->tail = thread;
+    queue->count++;
+}
+
+void thread_queue_remove(thread_queue_t *queue, thread_t *thread) {
+    if (thread->queue_prev) {
+        thread->queue_prev->queue_next = thread->queue_next;
+    } else {
+        queue->head = thread->queue_next;
+    }
+    if (thread->queue_next) {
+        thread->queue_next->queue_prev = thread->queue_prev;
+    } else {
+        queue->tail = thread->queue_prev;
+    }
+    thread->queue_next = NULL;
+    thread->queue_prev = NULL;
+    queue->count--;
+}
+
+/* Link a thread in behind another, or at the head if after is NULL */
+void thread_queue_insert_after(thread_queue_t *queue, thread_t *after, thread_t *thread) {
+    thread->queue_prev = after;
+    thread->queue_next = after ? after->queue_next : queue->head;
+    if (thread->queue_next) {
+        thread->queue_next->queue_prev = thread;
+    } else {
+        queue->tail = thread;
+    }
+    if (after) {
+        after->queue_next = thread;
+    } else {
+        queue->head = thread;
+    }
+    queue->count++;
+}
+
+static cpu_locals_t *sched_cpu(int cpu) {
+    if (cpu < 0) {
+        return NULL;
+    }
+
+    cpu_locals_t *locals = hashmap_get_elem(cpu_locals_list, (uint64_t) cpu);
+    if (!locals || !locals->sched_online) {
+        return NULL;
+    }
+    return locals;
+}
+
+/* Whether the thread's affinity lets it run on a CPU */
+static int sched_allowed(thread_t *thread, int cpu) {
+    return cpu >= 0 && cpu < 64 && (thread->affinity & (1UL << cpu)) && sched_cpu(cpu);
+}
+
+/* Shortest run queue the thread may use, for threads with no CPU to go back to */
+static int sched_least_loaded_cpu(thread_t *thread) {
+    cpu_locals_t *best = NULL;
+    for (uint64_t i = 0; i < cpu_vector.items_count; i++) {
+        cpu_locals_t *locals = sched_cpu((int) i);
+        if (locals && sched_allowed(thread, (int) i) && (!best || locals->run_queue.count < best->run_queue.count)) {
+            best = locals;
+        }
+    }
+    return best ? best->cpu_index : get_cpu_locals()->cpu_index;
+}
+
+/* Where a thread should be queued, the CPU it last ran on if it's still allowed there */
+static int sched_home_cpu(thread_t *thread) {
+    if (sched_allowed(thread, thread->last_cpu)) {
+        return thread->last_cpu;
+    }
+    return sched_least_loaded_cpu(thread);
+}
+
+/* Let the thread's class fix up per queue state before it changes CPUs */
+static void sched_migrate(thread_t *thread, int from, int to) {
+    sched_class_t *class = sched_class_of(thread);
+    if (from != to && sched_cpu(from) && class->migrate) {
+        class->migrate(&sched_cpu(from)->run_queue, &sched_cpu(to)->run_queue, thread);
+    }
+}
+
+static void sched_enqueue_flags(thread_t *thread, int cpu, int flags) {
+    if (thread->queue_cpu != -1) {
+        return;
+    }
+
+    run_queue_t *queue = &sched_cpu(cpu)->run_queue;
+    sched_class_of(thread)->enqueue(queue, thread, flags);
+    queue->count++;
+    thread->queue_cpu = cpu;
+}
+
+void sched_enqueue(thread_t *thread, int cpu) {
+    sched_enqueue_flags(thread, cpu, 0);
+}
+
+void sched_dequeue(thread_t *thread) {
+    if (thread->queue_cpu == -1) {
+        return;
+    }
+
+    run_queue_t *queue = &sched_cpu(thread->queue_cpu)->run_queue;
+    sched_class_of(thread)->dequeue(queue, thread);
+    queue->count--;
+    thread->queue_cpu = -1;
+}
+
+/* Make a CPU schedule now instead of at its next timer tick. For this
+   CPU the IPI stays pending until sched_lock is dropped */
+static void sched_kick(int cpu) {
+    cpu_locals_t *locals = sched_cpu(cpu);
+    if (locals) {
+        send_ipi(locals->apic_id, (1 << 14) | 253);
+    }
+}
+
+/* Wake one idle CPU, which steals from the busiest when it schedules */
+static void sched_kick_idle() {
+    for (uint64_t i = 0; i < cpu_vector.items_count; i++) {
+        cpu_locals_t *locals = sched_cpu((int) i);
+        if (locals && locals != get_cpu_locals() && locals->currently_idle && !locals->need_resched) {
+            sched_kick((int) i);
+            return;
+        }
+    }
+}
+
+/* Make a thread runnable, preferring the CPU it last ran on */
+void sched_wake(thread_t *thread) {
+    thread->state = READY;
+    if (thread->cpu != -1) {
+        return; // Still switching out, schedule() queues it
+    }
+
+    int cpu = sched_home_cpu(thread);
+    sched_migrate(thread, thread->last_cpu, cpu);
+    sched_enqueue(thread, cpu);
+
+    /* A busy CPU gets to it on its next tick unless it outranks what's running,
+       an idle one would sleep through it */
+    cpu_locals_t *locals = sched_cpu(cpu);
+    if (locals->currently_idle || !locals->current_thread || locals->current_thread->tid == locals->idle_tid
+        || sched_policy_preempts(thread, locals->current_thread)) {
+        sched_kick(cpu);
+    }
+}
+
+/* Runnable threads a CPU has, counting the one it's running */
+static uint64_t sched_load(cpu_locals_t *locals) {
+    return locals->run_queue.count + (locals->currently_idle ? 0 : 1);
+}
+
+/* Whether a queued thread is worth moving away from its warm cache */
+static int sched_can_migrate(thread_t *thread, int cpu, int allow_hot) {
+    if (thread->cpu != -1 || !sched_allowed(thread, cpu)) {
+        return 0;
+    }
+    return allow_hot || timer_now_us() - thread->last_ran_us >= SCHED_CACHE_HOT_US;
+}
+
+/* Pull a thread from the busiest CPU onto this one, called from pick_task */
+static void sched_balance() {
+    cpu_locals_t *self = get_cpu_locals();
+    uint64_t self_load = self->run_queue.count; // Nothing is running here while we pick
+
+    cpu_locals_t *busiest = NULL;
+    uint64_t busiest_load = 0;
+    for (uint64_t i = 0; i < cpu_vector.items_count; i++) {
+        cpu_locals_t *locals = sched_cpu((int) i);
+        if (!locals || locals == self || !locals->run_queue.count) {
+            continue;
+        }
+
+        /* Leaving the NUMA node costs more, so it needs a bigger imbalance */
+        uint64_t load = sched_load(locals);
+        if (locals->numa_node != self->numa_node) {
+            load--;
+        }
+
+        if (load > busiest_load) {
+            busiest = locals;
+            busiest_load = load;
+        }
+    }
+
+    /* Moving one thread has to shrink the gap, not flip it */
+    if (!busiest || busiest_load <= self_load + 1) {
+        return;
+    }
+
+    /* Take the thread that waited longest, its cache is the coldest */
+    int allow_hot = self->steal_failures >= SCHED_HOT_STEAL_FAILS;
+    thread_t *thread = sched_policy_next(&busiest->run_queue, NULL);
+    while (thread && !sched_can_migrate(thread, (int) self->cpu_index, allow_hot)) {
+        thread = sched_policy_next(&busiest->run_queue, thread);
+    }
+
+    if (!thread) {
+        self->steal_failures++;
+        return;
+    }
+
+    self->steal_failures = 0;
+    sched_migrate(thread, thread->queue_cpu, (int) self->cpu_index);
+    sched_dequeue(thread);
+    sched_enqueue(thread, (int) self->cpu_index);
+}
+
+/* Change a thread's class and priority, a nice level for the fair class */
+int sched_set_policy(thread_t *thread, uint8_t policy, int priority) {
+    if (policy == SCHED_POLICY_FIFO) {
+        if (priority < 0 || priority >= SCHED_RT_PRIORITIES) {
+            return EINVAL;
+        }
+    } else if (policy == SCHED_POLICY_FAIR) {
+        if (priority < SCHED_NICE_MIN || priority > SCHED_NICE_MAX) {
+            return EINVAL;
+        }
+    } else {
+        return EINVAL;
+    }
+
+    /* Queued threads have to move to their new class's queue */
+    int cpu = thread->queue_cpu;
+    sched_dequeue(thread);
+    thread->sched_policy = policy;
+    thread->rt_priority = policy == SCHED_POLICY_FIFO ? (uint8_t) priority : 0;
+    thread->nice = policy == SCHED_POLICY_FAIR ? (int8_t) priority : 0;
+
+    if (cpu != -1) {
+        sched_enqueue(thread, cpu);
+        if (sched_cpu(cpu)->current_thread && sched_policy_preempts(thread, sched_cpu(cpu)->current_thread)) {
+            sched_kick(cpu);
+        }
+    } else if (thread->cpu != -1) {
+        sched_kick(thread->cpu); // It might not outrank what's waiting anymore
+    }
+    return 0;
+}
+
+/* Restrict a thread to a set of CPUs, at least one of which has to be online */
+int sched_set_affinity(thread_t *thread, uint64_t affinity) {
+    uint64_t online = 0;
+    for (uint64_t i = 0; i < cpu_vector.items_count && i < 64; i++) {
+        if (sched_cpu((int) i)) {
+            online |= 1UL << i;
+        }
+    }
+    if (!(affinity & online)) {
+        return EINVAL;
+    }
+
+    thread->affinity = affinity;
+    if (thread->queue_cpu != -1 && !sched_allowed(thread, thread->queue_cpu)) {
+        int from = thread->queue_cpu;
+        sched_dequeue(thread);
+        int cpu = sched_least_loaded_cpu(thread);
+        sched_migrate(thread, from, cpu);
+        sched_enqueue(thread, cpu);
+        if (sched_cpu(cpu)->currently_idle) {
+            sched_kick(cpu);
+        }
+    } else if (thread->cpu != -1 && !sched_allowed(thread, thread->cpu)) {
+        sched_kick(thread->cpu); // schedule() requeues it somewhere it's allowed
+    }
+    return 0;
+}
+
+/* New threads get their creator's class, priority and affinity */
+void sched_inherit(thread_t *child, thread_t *parent) {
+    child->sched_policy = parent->sched_policy;
+    child->rt_priority = parent->rt_priority;
+    child->nice = parent->nice;
+    child->affinity = parent->affinity;
+    child->vruntime = parent->vruntime;
+}
+
+/* Take a thread off any run, wait or sleep queue it's on */
+void sched_detach(thread_t *thread) {
+    sched_dequeue(thread);
+    if (thread->state == WAIT_EVENT || thread->state == WAIT_EVENT_TIMEOUT) {
+        event_cancel_wait(thread);
+    }
+    if (thread->state == SLEEP || thread->state == WAIT_EVENT_TIMEOUT) {
+        sleep_queue_remove(thread->sleep_node);
+    }
+}
+
 void kill_thread(int64_t tid) {
     char thread_name[50] = "";
     if (threads[tid]) {
@@ -422,14 +752,16 @@ void kill_thread(int64_t tid) {
     interrupt_safe_lock(sched_lock);
     thread_t *thread = threads[tid];
     assert(thread);
+    sched_detach(thread);
     thread->state = BLOCKED;
 
     if (thread->cpu != -1) {
-        uint8_t cpu = (uint8_t) thread->cpu;
+        int cpu = thread->cpu;
         interrupt_safe_unlock(sched_lock);
-        send_ipi(cpu, (1 << 14) | 253); // Reschedule, in case the cpu is still running the thread
+        sched_kick(cpu); // Reschedule, in case the cpu is still running the thread
         while (thread->cpu != -1) { asm("pause"); }
         interrupt_safe_lock(sched_lock);
+        sched_detach(thread); // Someone may have woken it while the lock was dropped
     }
 
     if (thread->parent) {
@@ -444,35 +776,25 @@ void kill_thread(int64_t tid) {
 }
 
 int64_t pick_task() {
-    int64_t tid_ret = -1;
-
     if (!(get_cur_thread())) {
-        return tid_ret;
+        return -1;
     }
 
-    /* Prioritze tasks right after the current task */
-    for (int64_t t = get_cur_thread()->tid + 1; (uint64_t) t < threads_list_size; t++) {
-        thread_t *task = threads[t];
-        if (task) {
-            if (task->state == READY || task->state == WAIT_EVENT || task->state == WAIT_EVENT_TIMEOUT) {
-                tid_ret = task->tid;
-                return tid_ret;
-            }
-        }
+    /* Steal when there's nothing to run, and now and then when busy */
+    cpu_locals_t *self = get_cpu_locals();
+    if (!self->run_queue.count || ++self->balance_countdown >= SCHED_BALANCE_INTERVAL) {
+        self->balance_countdown = 0;
+        sched_balance();
     }
 
-    /* Then look at the rest of the tasks */
-    for (int64_t t = 0; t < get_cur_thread()->tid + 1; t++) {
-        thread_t *task = threads[t];
-        if (task) {
-            if (task->state == READY || task->state == WAIT_EVENT || task->state == WAIT_EVENT_TIMEOUT) {
-                tid_ret = task->tid;
-                return tid_ret;
-            }
-        }
+    /* The run queue only holds READY threads, so whatever the classes pick can run */
+    thread_t *task = sched_policy_pick(&self->run_queue);
+    if (!task) {
+        return -1; // Idle
     }
 
-    return tid_ret; // Return -1 by default for idle
+    sched_dequeue(task);
+    return task->tid;
 }
 
 void yield() {
@@ -491,6 +813,7 @@ void force_unlocked_schedule() {
 void schedule_runner(int_reg_t *r) {
     if (!spinlock_check_and_lock(&sched_lock.lock_dat)) {
         sched_lock.current_holder = __FUNCTION__;
+        get_cpu_locals()->preempting = 1;
         schedule(r);
     } else {
         if (get_cpu_locals()->currently_idle) {
@@ -500,23 +823,33 @@ void schedule_runner(int_reg_t *r) {
             get_cpu_locals()->active_tsc_count += read_tsc() - get_cpu_locals()->active_start_tsc;
             get_cpu_locals()->active_start_tsc = read_tsc();
         }
+        timer_arm_before(timer_now_us() + SCHED_RETRY_US); // The timer is one shot, so it has to be rearmed
     }
 }
 
-void schedule_bsp(int_reg_t *r) {
-    send_scheduler_ipis();
-    schedule_runner(r);
+/* This CPU's LAPIC timer, for a preemption tick or a sleeper's deadline */
+void schedule_timer(int_reg_t *r) {
+    if (scheduler_enabled) {
+        schedule_runner(r);
+    } else {
+        timer_arm(timer_now_us() + sched_period * 1000);
+    }
 }
 
-void schedule_ap(int_reg_t *r) {
+/* Another CPU woke a thread for us or is killing ours */
+void schedule_ipi(int_reg_t *r) {
+    get_cpu_locals()->need_resched = 1; // Left set if sched_lock was taken, for the idle loop
     schedule_runner(r);
-    scheduler_ran = 1;
 }
 
 void schedule(int_reg_t *r) {
     int used_to_be_idle = 0;
     int used_to_be_active = 0;
 
+    get_cpu_locals()->need_resched = 0;
+    int preempted = get_cpu_locals()->preempting; // Timer or IPI, rather than a yield
+    get_cpu_locals()->preempting = 0;
+
     thread_t *running_task = get_cur_thread();
     if (running_task) {
         running_task->regs.rax = r->rax;
@@ -556,66 +889,40 @@ void schedule(int_reg_t *r) {
 
         running_task->tsc_stopped = read_tsc();
         running_task->tsc_total += running_task->tsc_stopped - running_task->tsc_started;
+        if (running_task->tid != get_cpu_locals()->idle_tid) {
+            sched_class_of(running_task)->charge(&get_cpu_locals()->run_queue, running_task, running_task->tsc_stopped - running_task->tsc_started);
+        }
         
         running_task->cpu = -1;
+        running_task->last_cpu = (int) get_cpu_locals()->cpu_index;
+        running_task->last_ran_us = timer_now_us();
 
         if (running_task->running) {
             running_task->running = 0;
         }
 
         /* If we were previously running the task, then it is ready again since we are switching */
-        if (running_task->state == RUNNING && running_task->tid != get_cpu_locals()->idle_tid) {
+        if ((running_task->state == RUNNING || running_task->state == READY) && running_task->tid != get_cpu_locals()->idle_tid) {
             running_task->state = READY;
-            assert(running_task->state == READY);
+            int cpu = sched_home_cpu(running_task); // Only moves if its affinity changed
+            sched_migrate(running_task, running_task->last_cpu, cpu);
+            sched_enqueue_flags(running_task, cpu, preempted ? SCHED_ENQUEUE_PREEMPTED : 0);
         }
     }
 
-    int64_t tid_run;
-    int64_t picked_first = -1;
-repick_task:
+    advance_time(); // Wake sleepers that are due
+    event_run_deferred(); // Wake anyone an interrupt handler couldn't
+
     // Run the next thread
-    tid_run = pick_task();
+    int64_t tid_run = pick_task();
     if (tid_run == -1) {
         /* Idle */
         get_cpu_locals()->current_thread = threads[get_cpu_locals()->idle_tid];
-        running_task = get_cur_thread();
-        goto picked;
     } else {
-        if (picked_first == -1) {
-            picked_first = tid_run;
-        } else if (picked_first == tid_run) {
-            tid_run = -1;
-            get_cpu_locals()->current_thread = threads[get_cpu_locals()->idle_tid];
-            running_task = get_cur_thread();
-            goto picked;
-        }
-        thread_t *to_run = threads[tid_run];
-        get_cpu_locals()->current_thread = to_run;
-        running_task = get_cur_thread();
-
-        if (to_run->state == WAIT_EVENT) {
-            if (*to_run->event) {
-                atomic_dec((uint32_t *) to_run->event);
-                to_run->state = READY;
-                goto picked;
-            } else {
-                goto repick_task;
-            }
-        } else if (to_run->state == WAIT_EVENT_TIMEOUT) {
-            if (*to_run->event) {
-                atomic_dec((uint32_t *) to_run->event);
-                to_run->state = READY;
-                goto picked;
-            } else if (to_run->event_wait_start - global_ticks >= to_run->event_timeout) {
-                to_run->state = READY;
-                goto picked;
-            } else {
-                goto repick_task;
-            }
-        }
+        get_cpu_locals()->current_thread = threads[tid_run];
     }
+    running_task = get_cur_thread();
 
-picked:
     if (tid_run != -1) {
         assert(running_task->state == READY);
         assert(running_task->running == 0);
@@ -677,8 +984,11 @@ picked:
     get_cpu_locals()->thread_kernel_stack = running_task->kernel_stack;
     get_cpu_locals()->thread_user_stack = running_task->user_stack;
 
+    /* Publish the new CR3 before loading it, so a shootdown that misses
+       this CPU can only have changed entries the CR3 load flushes anyway */
+    get_cpu_locals()->active_cr3 = running_task->regs.cr3;
     if (vmm_get_base() != running_task->regs.cr3) {
-        vmm_set_base(running_task->regs.cr3);
+        vmm_load_space(running_task->regs.cr3);
     }
 
     if (get_cpu_locals()->currently_idle) {
@@ -697,6 +1007,21 @@ picked:
 
     get_cpu_locals()->total_tsc = read_tsc();
 
+    /* Tick only while there's something to preempt, otherwise sleep until the next sleeper is due */
+    uint64_t deadline = sleep_queue_next_deadline((int) get_cpu_locals()->cpu_index);
+    if (!get_cpu_locals()->currently_idle) {
+        uint64_t tick = timer_now_us() + sched_period * 1000;
+        if (tick < deadline) {
+            deadline = tick;
+        }
+
+        /* Idle CPUs have no tick to steal on, so hand them the threads waiting here */
+        if (get_cpu_locals()->run_queue.count) {
+            sched_kick_idle();
+        }
+    }
+    timer_arm(deadline);
+
     interrupt_safe_unlock(sched_lock);
 }
 
@@ -16,6 +16,16 @@
 #define WAIT_EVENT 4
 #define WAIT_EVENT_TIMEOUT 5
 
+#define sched_period 8 // ms a thread runs before it can be preempted
+
+#define SCHED_POLICY_FAIR 0 // Weighted fair share by nice level, the default
+#define SCHED_POLICY_FIFO 1 // Real time, runs until it blocks or a higher priority wakes
+#define SCHED_RT_PRIORITIES 32
+#define SCHED_NICE_MIN -20
+#define SCHED_NICE_MAX 19
+#define SCHED_NICE_SERVICE -10 // Kernel services that need low latency. Not FIFO, spinlock holders can still be preempted
+#define SCHED_AFFINITY_ALL 0xFFFFFFFFFFFFFFFF
+
 #define TASK_STACK_SIZE 0x4000
 #define TASK_STACK_PAGES (TASK_STACK_SIZE + 0x1000 - 1) / 0x1000
 #define VM_OFFSET 0xFFFF800000000000
@@ -24,16 +34,55 @@
 #define USER_STACK_PAGES (USER_STACK_SIZE + 0x1000 - 1) / 0x1000
 #define USER_STACK 0x7FFFFFFFFFF0 // Alignment
 #define USER_STACK_START (USER_STACK - USER_STACK_SIZE + 16)
+#define USER_STACK_COMMIT 0x10000 // Mapped at exec, the rest is demand paged
+#define USER_ARGS_MAX (USER_STACK_COMMIT - 0x1000) // argv and envp are copied into the committed stack, the rest is for auxv
+
+/* FIFO of threads, linked through queue_next and queue_prev */
+typedef struct {
+    thread_t *head;
+    thread_t *tail;
+    uint64_t count;
+} thread_queue_t;
+
+/* Red-black tree of threads ordered by vruntime, linked through the fair_ fields */
+typedef struct {
+    thread_t *root;
+    thread_t *leftmost; // Lowest vruntime, kept so picking doesn't walk the tree
+    uint64_t count;
+} thread_tree_t;
+
+/* A CPU's runnable threads, split up by scheduling class */
+typedef struct {
+    thread_queue_t rt[SCHED_RT_PRIORITIES]; // FIFO threads, one queue per priority
+    uint32_t rt_bitmap; // Bit set for each priority with queued threads
+    uint64_t rt_tsc; // TSC cycles FIFO threads have used this period
+    uint64_t rt_period_start; // When the current throttling period started, in us
+    thread_tree_t fair; // Fair threads, ties go after the threads already there
+    uint64_t min_vruntime; // Never goes backwards, woken threads start near it
+    uint64_t count;
+} run_queue_t;
 
 /* Scheduling */
 void schedule(int_reg_t *r);
-void schedule_ap(int_reg_t *r);
-void schedule_bsp(int_reg_t *r);
+void schedule_timer(int_reg_t *r);
+void schedule_ipi(int_reg_t *r);
 void scheduler_init_bsp();
 void scheduler_init_ap();
 void yield();
 void force_unlocked_schedule();
 
+/* Run queues, sched_lock must be held */
+void thread_queue_push(thread_queue_t *queue, thread_t *thread);
+void thread_queue_remove(thread_queue_t *queue, thread_t *thread);
+void thread_queue_insert_after(thread_queue_t *queue, thread_t *after, thread_t *thread);
+void sched_enqueue(thread_t *thread, int cpu);
+void sched_dequeue(thread_t *thread);
+void sched_wake(thread_t *thread);
+void sched_detach(thread_t *thread);
+int sched_set_policy(thread_t *thread, uint8_t policy, int priority);
+int sched_set_affinity(thread_t *thread, uint64_t affinity);
+void sched_inherit(thread_t *child, thread_t *parent);
+
 /* "API" */
 int64_t add_new_child_thread(thread_t *task, int64_t pid);
 int64_t add_new_child_thread_no_stack_init(thread_t *thread, int64_t pid);
@@ -0,0 +1,202 @@
+#include "shm.h"
+#include "scheduler.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
+#include "mm/vma.h"
+#include "sys/smp.h"
+#include "klibc/string.h"
+#include "klibc/stdlib.h"
+#include "klibc/errno.h"
+#include "klibc/hashmap.h"
+#include "klibc/lock.h"
+#include <stddef.h>
+
+hashmap_t *shm_objects = NULL;
+lock_t shm_lock = {0, 0, 0, 0};
+int64_t next_shm_id = 1;
+
+/* Mappings keep their own references, only the last one frees a frame */
+static void shm_free_frames(shm_object_t *object) {
+    for (uint64_t i = 0; i < object->pages; i++) {
+        if (pmm_frame_release(object->frames[i])) {
+            pmm_unalloc(object->frames[i], 0x1000);
+        }
+    }
+
+    kfree(object->frames);
+    kfree(object);
+}
+
+/* Whether a process may create another object of pages pages, shm_lock must be held */
+static uint8_t shm_within_limits(int64_t owner_pid, uint64_t pages) {
+    uint64_t objects = 0;
+    uint64_t owned_pages = 0;
+    if (shm_objects) {
+        HASHMAP_ITERABLE(shm_objects)
+            shm_object_t *object = HASHMAP_ITERABLE_GET->data;
+            if (object->owner_pid == owner_pid) {
+                objects++;
+                owned_pages += object->pages;
+            }
+        HASHMAP_ITERABLE_END
+    }
+    return objects < SHM_MAX_PROCESS_OBJECTS && owned_pages + pages <= SHM_MAX_PROCESS_PAGES;
+}
+
+/* Only the owner, or root, can map or destroy an object */
+static uint8_t shm_permitted(shm_object_t *object) {
+    process_t *caller = get_cur_process();
+    return caller->pid == object->owner_pid || caller->uid == 0;
+}
+
+/* Create an object of size bytes, returns its ID or a negative errno */
+int64_t shm_create(uint64_t size, int64_t owner_pid) {
+    uint64_t pages = (size + 0x1000 - 1) / 0x1000;
+    if (!pages) {
+        return -EINVAL;
+    }
+    if (pages > SHM_MAX_PAGES) {
+        return -ENOMEM;
+    }
+
+    lock(shm_lock);
+    uint8_t allowed = shm_within_limits(owner_pid, pages);
+    unlock(shm_lock);
+    if (!allowed) {
+        return -ENOSPC;
+    }
+
+    shm_object_t *object = kcalloc(sizeof(shm_object_t));
+    object->owner_pid = owner_pid;
+    object->pages = pages;
+    object->frames = kcalloc(sizeof(void *) * pages);
+    for (uint64_t i = 0; i < pages; i++) {
+        object->frames[i] = pmm_try_alloc(0x1000); // Userspace picks the size, so running out isn't fatal
+        if (!object->frames[i]) {
+            object->pages = i;
+            shm_free_frames(object);
+            return -ENOMEM;
+        }
+        memset(GET_HIGHER_HALF(uint8_t *, object->frames[i]), 0, 0x1000);
+    }
+
+    lock(shm_lock);
+    if (!shm_objects) {
+        shm_objects = init_hashmap();
+    }
+    if (!shm_within_limits(owner_pid, pages)) { // Another thread of the process got there first
+        unlock(shm_lock);
+        shm_free_frames(object);
+        return -ENOSPC;
+    }
+    object->id = next_shm_id++;
+    hashmap_set_elem(shm_objects, object->id, object);
+    unlock(shm_lock);
+
+    return object->id;
+}
+
+/* Map an object into the brk region of a process, which has to be the
+   caller or one of its children. Returns 0 or a negative errno */
+int shm_map(int64_t id, int64_t pid, void **mapped_addr) {
+    interrupt_safe_lock(sched_lock);
+    if (pid < 0 || (uint64_t) pid >= process_list_size || !processes[pid]) {
+        interrupt_safe_unlock(sched_lock);
+        return -ESRCH;
+    }
+    process_t *process = processes[pid];
+    interrupt_safe_unlock(sched_lock);
+
+    process_t *caller = get_cur_process();
+    if (process != caller && process->ppid != caller->pid && caller->uid != 0) {
+        return -EPERM;
+    }
+
+    /* Held the whole time, so the object can't be destroyed under us */
+    lock(shm_lock);
+    shm_object_t *object = shm_objects ? hashmap_get_elem(shm_objects, id) : NULL;
+    if (!object) {
+        unlock(shm_lock);
+        return -ENOENT;
+    }
+    if (!shm_permitted(object)) {
+        unlock(shm_lock);
+        return -EPERM;
+    }
+
+    lock(process->brk_lock);
+    void *addr = (void *) process->current_brk;
+    if (vma_add(&process->vmas, process->current_brk, process->current_brk + object->pages * 0x1000,
+        VMM_PRESENT | VMM_USER | VMM_WRITE)) {
+        unlock(process->brk_lock);
+        unlock(shm_lock);
+        return -ENOMEM;
+    }
+    process->current_brk += object->pages * 0x1000;
+    unlock(process->brk_lock);
+
+    /* The frames aren't contiguous, so map page by page. VMM_SHARED keeps
+       fork from turning them copy on write */
+    for (uint64_t i = 0; i < object->pages; i++) {
+        pmm_frame_share(object->frames[i]);
+        if (vmm_map_pages(object->frames[i], (void *) ((uint64_t) addr + i * 0x1000), (void *) process->cr3, 1,
+            VMM_PRESENT | VMM_USER | VMM_WRITE | VMM_SHARED)) {
+            pmm_frame_release(object->frames[i]);
+
+            /* Undo what got mapped, the unmap drops those references again */
+            vmm_unmap_free_pages(addr, (void *) process->cr3, i);
+            vma_remove(&process->vmas, (uint64_t) addr, (uint64_t) addr + object->pages * 0x1000);
+            unlock(shm_lock);
+            return -ENOMEM;
+        }
+    }
+    unlock(shm_lock);
+
+    *mapped_addr = addr;
+    return 0;
+}
+
+static void shm_free_object(shm_object_t *object) {
+    hashmap_remove_elem(shm_objects, object->id);
+    shm_free_frames(object);
+}
+
+int shm_destroy(int64_t id) {
+    lock(shm_lock);
+    shm_object_t *object = shm_objects ? hashmap_get_elem(shm_objects, id) : NULL;
+    if (!object) {
+        unlock(shm_lock);
+        return -ENOENT;
+    }
+    if (!shm_permitted(object)) {
+        unlock(shm_lock);
+        return -EPERM;
+    }
+
+    shm_free_object(object);
+    unlock(shm_lock);
+    return 0;
+}
+
+/* Destroy everything a process created, called when it's killed */
+void shm_release_process(int64_t pid) {
+    lock(shm_lock);
+    if (!shm_objects) {
+        unlock(shm_lock);
+        return;
+    }
+
+    uint8_t found = 1;
+    while (found) {
+        found = 0;
+        HASHMAP_ITERABLE(shm_objects)
+            shm_object_t *object = HASHMAP_ITERABLE_GET->data;
+            if (object->owner_pid == pid) {
+                shm_free_object(object);
+                found = 1;
+                break; // The element is gone, the bucket gets scanned again
+            }
+        HASHMAP_ITERABLE_END
+    }
+    unlock(shm_lock);
+}
\ No newline at end of file
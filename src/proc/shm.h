@@ -0,0 +1,24 @@
+#ifndef SHM_H
+#define SHM_H
+#include <stdint.h>
+
+#define SHM_MAX_PAGES 0x10000 // 256 MiB per object
+#define SHM_MAX_PROCESS_OBJECTS 16 // Objects one process can own at once
+#define SHM_MAX_PROCESS_PAGES 0x10000 // Pages one process can own across all its objects
+
+/* A named set of frames that can be mapped into any number of processes.
+   The object and every mapping hold a reference on each frame, so the
+   memory goes away once it's destroyed and the last mapping is gone */
+typedef struct {
+    int64_t id;
+    int64_t owner_pid; // Destroyed when this process exits
+    uint64_t pages;
+    void **frames;
+} shm_object_t;
+
+int64_t shm_create(uint64_t size, int64_t owner_pid);
+int shm_map(int64_t id, int64_t pid, void **mapped_addr);
+int shm_destroy(int64_t id);
+void shm_release_process(int64_t pid);
+
+#endif
\ No newline at end of file
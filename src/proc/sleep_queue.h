@@ -10,11 +10,16 @@ struct timespec {
 typedef struct sleep_queue {
     struct sleep_queue *next;
     struct sleep_queue *prev;
-    uint64_t time_left;
+    uint64_t deadline; // When to wake, in us since boot
     int64_t tid;
+    int cpu; // CPU whose timer fires for this deadline
 } sleep_queue_t;
 
 void advance_time();
+void sleep_queue_insert(uint64_t deadline, int64_t tid);
+void sleep_queue_remove(sleep_queue_t *node);
+uint64_t sleep_queue_next_deadline(int cpu);
+void sleep_us(uint64_t us);
 void sleep_ms(uint64_t ms);
 
 int nanosleep(struct timespec *req, struct timespec *rem);
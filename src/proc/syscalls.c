@@ -8,12 +8,14 @@
 #include "proc/sched_syscalls.h"
 #include "proc/safe_userspace.h"
 #include "proc/ipc.h"
+#include "proc/shm.h"
 #include "sys/smp.h"
 #include "sys/apic.h"
 #include "klibc/errno.h"
 #include "klibc/stdlib.h"
 #include "klibc/debug.h"
 #include "klibc/logger.h"
+#include "klibc/math.h"
 
 #include "drivers/serial.h"
 
@@ -68,6 +70,11 @@ void init_syscalls() {
     register_syscall(70, syscall_core_count);
     register_syscall(71, syscall_get_core_performance);
     register_syscall(72, syscall_ms_sleep);
+    register_syscall(73, syscall_shm_create);
+    register_syscall(74, syscall_shm_map);
+    register_syscall(75, syscall_shm_destroy);
+    register_syscall(76, syscall_set_priority);
+    register_syscall(77, syscall_set_affinity);
     register_syscall(300, syscall_set_fs);
 
     /* Memes */
@@ -196,39 +203,54 @@ void syscall_sprint(syscall_reg_t *r) {
 
 void syscall_ipc_read(syscall_reg_t *r) {
     int size = (int) r->rbx;
-    if (!range_mapped((void *) r->rdx, size)) {
-        union ipc_err err;
-        err.parts.err = IPC_BUFFER_INVALID;
+    union ipc_err err;
+    err.parts.err = IPC_INVALID_PARAM;
+    if (size < 0 || size > IPC_MAX_TRANSFER) {
+        r->rdx = err.real_err;
+        return;
+    }
+    err.parts.err = IPC_BUFFER_INVALID;
+    if (!userspace_range_ok((void *) r->rdx, size)) {
         r->rdx = err.real_err;
         return;
     }
 
-    void *buffer = kcalloc(size);
+    void *buffer = kcalloc(ROUND_UP(size, 0x1000)); // Whole pages, since the server maps these
     void *userspace_addr = (void *) r->rdx;
     r->rdx = read_ipc_server((int) r->rdi, (int) r->rsi, buffer, size).real_err; // Set err
-    memcpy(buffer, userspace_addr, size); // Copy the buffer in case anything was read
+    if (copy_to_userspace(userspace_addr, buffer, size)) { // Copy the buffer in case anything was read
+        r->rdx = err.real_err;
+    }
     kfree(buffer);
 }
 
 void syscall_ipc_write(syscall_reg_t *r) {
     int size = (int) r->rbx;
-    if (!range_mapped((void *) r->rdx, size)) {
+    if (size < 0 || size > IPC_MAX_TRANSFER) {
         union ipc_err err;
-        err.parts.err = IPC_BUFFER_INVALID;
+        err.parts.err = IPC_INVALID_PARAM;
         r->rdx = err.real_err;
         return;
     }
-
-    void *buffer = kcalloc(size);
+    void *buffer = kcalloc(ROUND_UP(size, 0x1000)); // Whole pages, since the server maps these
     void *userspace_addr = (void *) r->rdx;
-    memcpy(userspace_addr, buffer, size); // Copy the buffer for writing
+    if (copy_from_userspace(buffer, userspace_addr, size)) { // Copy the buffer for writing
+        union ipc_err err;
+        err.parts.err = IPC_BUFFER_INVALID;
+        r->rdx = err.real_err;
+        kfree(buffer);
+        return;
+    }
     r->rdx = write_ipc_server((int) r->rdi, (int) r->rsi, buffer, size).real_err; // Set err
     kfree(buffer);
 }
 
 void syscall_ipc_wait(syscall_reg_t *r) {
     r->rdx = 0;
-    if (!range_mapped((void *) r->rsi, sizeof(syscall_ipc_handle_t))) {
+    syscall_ipc_handle_t userspace_handle;
+    /* Check the handle buffer can be written before waiting on anything */
+    if (copy_from_userspace(&userspace_handle, (void *) r->rsi, sizeof(syscall_ipc_handle_t)) ||
+        copy_to_userspace((void *) r->rsi, &userspace_handle, sizeof(syscall_ipc_handle_t))) {
         r->rdx = EFAULT;
         return;
     }
@@ -259,24 +281,26 @@ void syscall_ipc_wait(syscall_reg_t *r) {
     vmm_map(GET_LOWER_HALF(void *, handle->buffer), map_buffer_addr, (handle->size + 0x1000 - 1) / 0x1000, 
         VMM_PRESENT | VMM_WRITE | VMM_USER);
 
-    syscall_ipc_handle_t *userspace_handle_buf = (void *) r->rsi;
-    userspace_handle_buf->original_buffer = handle;
-    userspace_handle_buf->operation_type = handle->operation_type;
-    userspace_handle_buf->pid = handle->pid;
-    userspace_handle_buf->size = handle->size;
-    userspace_handle_buf->buffer = map_buffer_addr;
+    userspace_handle.original_buffer = handle;
+    userspace_handle.operation_type = handle->operation_type;
+    userspace_handle.pid = handle->pid;
+    userspace_handle.size = handle->size;
+    userspace_handle.buffer = map_buffer_addr;
+    if (copy_to_userspace((void *) r->rsi, &userspace_handle, sizeof(syscall_ipc_handle_t))) {
+        r->rdx = EFAULT;
+    }
 }
 
 void syscall_ipc_handling_complete(syscall_reg_t *r) {
     r->rdx = 0;
-    if (!range_mapped((void *) r->rdi, sizeof(syscall_ipc_handle_t))) {
+    syscall_ipc_handle_t handle;
+    if (copy_from_userspace(&handle, (void *) r->rdi, sizeof(syscall_ipc_handle_t))) {
         r->rdx = EFAULT;
         return;
     }
-    syscall_ipc_handle_t *handle = (void *) r->rdi;
-    handle->original_buffer->err = handle->err;
-    handle->original_buffer->size = handle->size;
-    trigger_event(handle->original_buffer->ipc_completed); // this should be safer but alas, no
+    handle.original_buffer->err = handle.err;
+    handle.original_buffer->size = handle.size;
+    trigger_event(handle.original_buffer->ipc_completed); // this should be safer but alas, no
 }
 
 void syscall_ipc_register(syscall_reg_t *r) {
@@ -294,11 +318,6 @@ typedef struct {
 } __attribute__((packed)) cpu_performance_t;
 
 void syscall_get_core_performance(syscall_reg_t *r) {
-    if (!range_mapped((void *) r->rdi, sizeof(cpu_performance_t))) {
-        r->rdx = EFAULT;
-        return;
-    }
-
     if ((uint8_t) r->rsi > cpu_vector.items_count - 1) {
         r->rdx = EINVAL;
         return;
@@ -312,7 +331,9 @@ void syscall_get_core_performance(syscall_reg_t *r) {
     performace.time_active = locals->active_tsc_count;
     performace.time_idle = locals->idle_tsc_count;
 
-    memcpy((uint8_t *) &performace, (uint8_t *) r->rdi, sizeof(cpu_performance_t));
+    if (copy_to_userspace((void *) r->rdi, &performace, sizeof(cpu_performance_t))) {
+        r->rdx = EFAULT;
+    }
 }
 
 void syscall_ms_sleep(syscall_reg_t *r) {
@@ -344,6 +365,7 @@ void syscall_futex_wait(syscall_reg_t *r) {
 void syscall_start_thread(syscall_reg_t *r) {
     thread_t *new_thread = create_thread(get_cur_thread()->name, (void *) r->rdi, r->rsi, 3);
     new_thread->regs.fs = r->rdx;
+    sched_inherit(new_thread, get_cur_thread());
     r->rax = add_new_child_thread_no_stack_init(new_thread, get_cur_pid());
 }
 
@@ -363,16 +385,17 @@ void syscall_map_to_process(syscall_reg_t *r) {
 
     uint64_t pages = (r->rsi + 0x1000 - 1) / 0x1000;
 
+    /* The target faults the pages in itself when it touches them */
     lock(process->brk_lock);
     void *mapped_addr = (void *) process->current_brk;
+    if (vma_add(&process->vmas, process->current_brk, process->current_brk + pages * 0x1000,
+        VMM_PRESENT | VMM_USER | VMM_WRITE)) {
+        unlock(process->brk_lock);
+        r->rdx = 0;
+        return;
+    }
     process->current_brk += pages * 0x1000;
     unlock(process->brk_lock);
-
-    void *phys = pmm_alloc(pages * 0x1000);
-    memset(GET_HIGHER_HALF(void *, phys), 0, pages * 0x1000);
-
-    vmm_map_pages(phys, mapped_addr, (void *) process->cr3, pages,
-        VMM_PRESENT | VMM_USER | VMM_WRITE);
     
     r->rdx = (uint64_t) mapped_addr;
     return;
@@ -384,15 +407,13 @@ void syscall_map_from_us_to_process(syscall_reg_t *r) {
         return;
     }
 
-    void *phys = virt_to_phys((void *) (r->rsi & ~(0xfff)), (page_table_t *) get_cur_thread()->regs.cr3);
-    if (!range_mapped_in_userspace(phys, r->rdx)) {
+    uint64_t start = r->rsi & ~(0xfff);
+    uint64_t end = start + (((r->rdx + (r->rsi & 0xfff) + 0x1000 - 1) / 0x1000) * 0x1000);
+    if (end > 0x800000000000) {
         r->rdx = 0;
         return;
     }
 
-    uint64_t start = r->rsi & ~(0xfff);
-    uint64_t end = start + (((r->rdx + 0x1000 - 1) / 0x1000) * 0x1000);
-
     interrupt_safe_lock(sched_lock);
     if (r->rdi >= process_list_size) {
         interrupt_safe_unlock(sched_lock);
@@ -406,18 +427,118 @@ void syscall_map_from_us_to_process(syscall_reg_t *r) {
 
     uint64_t pages = (end - start) / 0x1000;
 
+    /* Only frames that really are the caller's user memory can be handed out */
+    for (uint64_t i = 0; i < pages; i++) {
+        if (!is_user_page((void *) (start + i * 0x1000), (void *) get_cur_thread()->regs.cr3)) {
+            r->rdx = 0;
+            return;
+        }
+    }
+
+    /* Copy on write frames are still shared with a fork sibling, so the caller
+       gets its own copies first. Same as the caller writing to each page */
+    for (uint64_t i = 0; i < pages; i++) {
+        vmm_handle_fault((void *) (start + i * 0x1000), VMM_FAULT_PRESENT | VMM_FAULT_WRITE | VMM_FAULT_USER);
+    }
+
     lock(process->brk_lock);
     void *mapped_addr = (void *) process->current_brk;
     process->current_brk += pages * 0x1000;
     unlock(process->brk_lock);
 
-    vmm_map_pages(phys, mapped_addr, (void *) process->cr3, pages,
-        VMM_PRESENT | VMM_USER | VMM_WRITE);
+    /* Demand paged memory isn't physically contiguous, so map page by page */
+    for (uint64_t i = 0; i < pages; i++) {
+        void *phys = virt_to_phys((void *) (start + i * 0x1000), (page_table_t *) get_cur_thread()->regs.cr3);
+        pmm_frame_share(phys);
+        vmm_map_pages(phys, (void *) ((uint64_t) mapped_addr + i * 0x1000), (void *) process->cr3, 1,
+            VMM_PRESENT | VMM_USER | VMM_WRITE);
+    }
     
     r->rdx = (uint64_t) mapped_addr + (r->rsi & 0xfff);
     return;
 }
 
+void syscall_shm_create(syscall_reg_t *r) {
+    int64_t id = shm_create(r->rdi, get_cur_pid());
+    if (id < 0) {
+        r->rax = 0;
+        r->rdx = -id;
+    } else {
+        r->rax = id;
+        r->rdx = 0;
+    }
+}
+
+void syscall_shm_map(syscall_reg_t *r) {
+    void *mapped_addr = (void *) 0;
+    int ret = shm_map((int64_t) r->rdi, (int64_t) r->rsi, &mapped_addr);
+    r->rax = (uint64_t) mapped_addr;
+    r->rdx = -ret;
+}
+
+void syscall_shm_destroy(syscall_reg_t *r) {
+    int ret = shm_destroy((int64_t) r->rdi);
+    r->rax = ret ? 1 : 0;
+    r->rdx = -ret;
+}
+
+/* Find a thread the caller may change the scheduling of, -1 being the caller. sched_lock must be held */
+static thread_t *sched_syscall_target(int64_t tid, int *err) {
+    if (tid == -1) {
+        return get_cur_thread();
+    }
+
+    thread_t *thread = (uint64_t) tid < threads_list_size ? threads[tid] : (void *) 0;
+    if (!thread) {
+        *err = ESRCH;
+        return (void *) 0;
+    }
+    if (thread->parent_pid != get_cur_pid() && get_cur_process()->uid != 0) {
+        *err = EPERM; // Only root can touch other processes' threads
+        return (void *) 0;
+    }
+    return thread;
+}
+
+void syscall_set_priority(syscall_reg_t *r) {
+    int64_t tid = (int64_t) r->rdi;
+    uint8_t policy = (uint8_t) r->rsi;
+    int priority = (int) r->rdx;
+    int err = 0;
+
+    interrupt_safe_lock(sched_lock);
+    thread_t *thread = sched_syscall_target(tid, &err);
+    if (thread) {
+        /* Real time and raising the fair weight are privileged, anyone may lower their own */
+        if (get_cur_process()->uid != 0 && (policy == SCHED_POLICY_FIFO || thread->sched_policy == SCHED_POLICY_FIFO
+            || (policy == SCHED_POLICY_FAIR && priority < thread->nice))) {
+            err = EPERM;
+        } else {
+            err = sched_set_policy(thread, policy, priority);
+        }
+    }
+    interrupt_safe_unlock(sched_lock);
+
+    r->rax = err ? 1 : 0;
+    r->rdx = err;
+}
+
+void syscall_set_affinity(syscall_reg_t *r) {
+    int64_t tid = (int64_t) r->rdi;
+    uint64_t affinity = r->rsi;
+    int err = 0;
+
+    interrupt_safe_lock(sched_lock);
+    thread_t *thread = sched_syscall_target(tid, &err);
+    if (thread) {
+        err = sched_set_affinity(thread, affinity);
+    }
+    interrupt_safe_unlock(sched_lock);
+
+    r->rax = err ? 1 : 0;
+    r->rdx = err;
+}
+
 void syscall_open_pipe(syscall_reg_t *r) {
     int pid = (int) r->rdi;
     int remote_fd = (int) r->rsi;
@@ -446,7 +567,7 @@ void syscall_open_pipe(syscall_reg_t *r) {
             kfree(fd_table[remote_fd]);
         }
 
-        fd_entry_t *new_entry = kcalloc(sizeof(fd_entry_t));
+        fd_entry_t *new_entry = slab_alloc(&fd_entry_cache);
         new_entry->node = &pipe_node;
 
         fd_table[remote_fd] = new_entry;
@@ -34,6 +34,11 @@ void syscall_map_to_process(syscall_reg_t *r);         // 69    int pid, uint64_
 void syscall_core_count(syscall_reg_t *r);             // 70
 void syscall_get_core_performance(syscall_reg_t *r);   // 71    cpu_performance_t *out, uint8_t core
 void syscall_ms_sleep(syscall_reg_t *r);               // 72    uint64_t ms
+void syscall_shm_create(syscall_reg_t *r);             // 73    uint64_t size
+void syscall_shm_map(syscall_reg_t *r);                // 74    int64_t id, int pid
+void syscall_shm_destroy(syscall_reg_t *r);            // 75    int64_t id
+void syscall_set_priority(syscall_reg_t *r);           // 76    int64_t tid, uint8_t policy, int priority
+void syscall_set_affinity(syscall_reg_t *r);           // 77    int64_t tid, uint64_t cpu_mask
 void syscall_set_fs(syscall_reg_t *r);                 // 300   uint64_t fs
 
 /* Meme syscalls (very temporary) */
@@ -44,8 +49,4 @@ void syscall_empty(syscall_reg_t *r);
 
 void init_syscalls();
 
-extern uint64_t memcpy_from_userspace(void *dst, void *src, uint64_t byte_count);
-extern uint64_t strcpy_from_userspace(char *dst, char *src);
-extern uint64_t strlen_from_userspace(char *dst);
-
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "urm.h"
 #include "scheduler.h"
 #include "exec_formats/elf.h"
+#include "shm.h"
 #include "mm/vmm.h"
 #include "mm/pmm.h"
 #include "sys/smp.h"
@@ -43,9 +44,11 @@ int urm_kill_process(urm_kill_process_data *data) {
         }
     }
 
+    shm_release_process(data->pid);
     if (process->cr3 != base_kernel_cr3) {
-        vmm_deconstruct_address_space((void *) process->cr3);
+        vmm_queue_teardown((void *) process->cr3);
     }
+    vma_clear(&process->vmas);
     clear_fds(data->pid);
     kfree(process->threads);
     delete_hashmap(process->ipc_handles);
@@ -61,17 +64,25 @@ int urm_kill_process(urm_kill_process_data *data) {
 int urm_execve(urm_execve_data *data) {
     uint64_t entry_point = 0;
     auxv_auxc_group_t auxv_info;
-    void *address_space = load_elf_addrspace(data->executable_path, &entry_point, 0, NULL, &auxv_info);
+    vma_list_t vmas = {0, {0, 0, 0, 0}};
+    void *address_space = load_elf_addrspace(data->executable_path, &entry_point, 0, NULL, &auxv_info, &vmas);
     if (!address_space) {
+        vma_clear(&vmas);
         sprintf("bruh momento [execve]\n");
         return ENOENT;
     }
 
+    thread_t *thread = create_thread(data->executable_path, (void *) entry_point, USER_STACK, 3);
+
     interrupt_safe_lock(sched_lock);
     process_t *current_process = processes[data->pid];
     for (uint64_t i = 0; i < current_process->threads_size; i++) {
         if (current_process->threads[i] != -1) {
             if (threads[current_process->threads[i]]) {
+                if (current_process->threads[i] == data->tid) {
+                    sched_inherit(thread, threads[data->tid]); // exec keeps the caller's priority
+                }
+                sched_detach(threads[current_process->threads[i]]);
                 kfree(threads[current_process->threads[i]]);
                 threads[current_process->threads[i]] = (void *) 0;
             }
@@ -80,12 +91,13 @@ int urm_execve(urm_execve_data *data) {
         }
     }
 
-    vmm_deconstruct_address_space((void *) current_process->cr3);
+    uint64_t old_cr3 = current_process->cr3;
+    vma_clear(&current_process->vmas);
+    current_process->vmas.head = vmas.head;
 
     current_process->current_brk = DEFAULT_BRK;
     current_process->cr3 = (uint64_t) address_space;
 
-    thread_t *thread = create_thread(data->executable_path, (void *) entry_point, USER_STACK, 3);
     if (auxv_info.auxv) {
         thread->vars.auxc = auxv_info.auxc;
         thread->vars.auxv = auxv_info.auxv;
@@ -99,6 +111,7 @@ int urm_execve(urm_execve_data *data) {
 
     interrupt_safe_unlock(sched_lock);
 
+    vmm_queue_teardown((void *) old_cr3); // Wakes the reclaim thread, so not under sched_lock
     add_new_child_thread(thread, data->pid);
 
     return 0; // There is not code waiting for us, since we have replaced the thread
@@ -184,7 +197,8 @@ void urm_thread() {
         new_urm_thread->regs.rsi = (uint64_t) runtime_params;
 
         interrupt_safe_lock(sched_lock);
-        new_urm_thread->state = READY;
+        sched_set_policy(new_urm_thread, SCHED_POLICY_FAIR, SCHED_NICE_SERVICE);
+        sched_wake(new_urm_thread);
         interrupt_safe_unlock(sched_lock);
 
         // Reset state
@@ -0,0 +1,110 @@
+#include "srat.h"
+#include "mm/pmm.h"
+#include "drivers/serial.h"
+#include "drivers/tty/tty.h"
+
+/* Proximity domain of every node. Domains can be any 32 bit number, the
+   PMM wants nodes numbered from 0 */
+static uint32_t node_domains[PMM_MAX_NODES];
+static uint8_t node_count = 0;
+
+static uint8_t numa_domain_node(uint32_t domain) {
+    for (uint8_t i = 0; i < node_count; i++) {
+        if (node_domains[i] == domain) {
+            return i;
+        }
+    }
+
+    if (node_count == PMM_MAX_NODES) {
+        sprintf("[SRAT] Too many nodes, putting domain %u on node 0\n", domain);
+        return 0;
+    }
+    node_domains[node_count] = domain;
+    return node_count++;
+}
+
+static void parse_srat(srat_t *srat) {
+    uint64_t bytes_for_entries = srat->header.length - sizeof(srat_t);
+
+    sprintf("[SRAT] SRAT entries:\n");
+    for (uint64_t e = 0; e < bytes_for_entries; e++) {
+        if (e + 2 > bytes_for_entries) {
+            break;
+        }
+        uint8_t type = srat->entries[e++];
+        uint8_t size = srat->entries[e++];
+
+        // A broken size would loop forever or walk off the table
+        if (size < 2 || e - 2 + size > bytes_for_entries) {
+            sprintf("[SRAT] Bad entry size %u, ignoring the rest\n", (uint32_t) size);
+            break;
+        }
+
+        if (type == 0) {
+            srat_ent0_t *ent = (srat_ent0_t *) &(srat->entries[e]);
+            uint32_t domain = ent->domain_low | ((uint32_t) ent->domain_high[0] << 8)
+                | ((uint32_t) ent->domain_high[1] << 16) | ((uint32_t) ent->domain_high[2] << 24);
+            if (ent->flags & SRAT_ENABLED) {
+                sprintf("CPU:\n");
+                sprintf("  APIC ID: %u\n", (uint32_t) ent->apic_id);
+                sprintf("  Domain: %u\n", domain);
+                pmm_numa_set_cpu(ent->apic_id, numa_domain_node(domain));
+            }
+        } else if (type == 1) {
+            srat_ent1_t *ent = (srat_ent1_t *) &(srat->entries[e]);
+            if (ent->flags & SRAT_ENABLED && ent->length) {
+                sprintf("Memory:\n");
+                sprintf("  Range: %lx - %lx\n", ent->base, ent->base + ent->length);
+                sprintf("  Domain: %u\n", ent->domain);
+                pmm_numa_add_range(ent->base, ent->length, numa_domain_node(ent->domain));
+            }
+        } else if (type == 2) {
+            srat_ent2_t *ent = (srat_ent2_t *) &(srat->entries[e]);
+            // APIC IDs are 8 bits everywhere else, so bigger ones can't be running
+            if (ent->flags & SRAT_ENABLED && ent->x2apic_id < 256) {
+                sprintf("x2APIC CPU:\n");
+                sprintf("  APIC ID: %u\n", ent->x2apic_id);
+                sprintf("  Domain: %u\n", ent->domain);
+                pmm_numa_set_cpu((uint8_t) ent->x2apic_id, numa_domain_node(ent->domain));
+            }
+        }
+
+        e += size - 3;
+    }
+}
+
+/* Read the node layout from the SRAT, and the distances from the SLIT if
+   there is one, then split the PMM up by node */
+void numa_init() {
+    srat_t *srat = (srat_t *) search_sdt_header("SRAT");
+    if (!srat) {
+        kprintf("[SRAT] No SRAT, memory is one node\n");
+        return;
+    }
+
+    kprintf("[SRAT] Found SRAT %lx\n", srat);
+    parse_srat(srat);
+
+    uint8_t distances[PMM_MAX_NODES][PMM_MAX_NODES];
+    for (uint8_t i = 0; i < PMM_MAX_NODES; i++) {
+        for (uint8_t j = 0; j < PMM_MAX_NODES; j++) {
+            distances[i][j] = i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    /* The SLIT is indexed by proximity domain */
+    slit_t *slit = (slit_t *) search_sdt_header("SLIT");
+    if (slit) {
+        kprintf("[SLIT] Found SLIT %lx\n", slit);
+        for (uint8_t i = 0; i < node_count; i++) {
+            for (uint8_t j = 0; j < node_count; j++) {
+                if (node_domains[i] < slit->localities && node_domains[j] < slit->localities) {
+                    distances[i][j] = slit->entries[node_domains[i] * slit->localities + node_domains[j]];
+                }
+            }
+        }
+    }
+
+    kprintf("[SRAT] NUMA nodes: %u\n", (uint32_t) node_count);
+    pmm_numa_setup(node_count, distances);
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef SRAT_H
+#define SRAT_H
+#include <stdint.h>
+#include "sys/acpi/rsdt.h"
+
+#define SRAT_ENABLED (1<<0)
+
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+typedef struct {
+    sdt_header_t header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+    uint8_t entries[];
+} __attribute__ ((packed)) srat_t;
+
+/* Processor local APIC affinity */
+typedef struct {
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+} __attribute__ ((packed)) srat_ent0_t;
+
+/* Memory affinity */
+typedef struct {
+    uint32_t domain;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__ ((packed)) srat_ent1_t;
+
+/* Processor local x2APIC affinity */
+typedef struct {
+    uint16_t reserved1;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__ ((packed)) srat_ent2_t;
+
+typedef struct {
+    sdt_header_t header;
+    uint64_t localities;
+    uint8_t entries[]; // localities * localities distances
+} __attribute__ ((packed)) slit_t;
+
+void numa_init();
+
+#endif
\ No newline at end of file
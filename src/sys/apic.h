@@ -9,6 +9,8 @@
 #define REDIRECT_TABLE_BAD_READ 0xFFFFFFFFFFFFFFFF
 #define KERNEL_VM_OFFSET 0xFFFF800000000000
 
+#define LAPIC_TIMER_VECTOR 248
+
 typedef struct {
     uint8_t acpi_processor_id;
     uint8_t apic_id;
@@ -14,6 +14,7 @@
 #include "io/ports.h"
 #include "io/msr.h"
 #include "mm/vmm.h"
+#include "proc/safe_userspace.h"
 
 #include "sys/smp.h"
 
@@ -33,9 +34,24 @@ static void send_panic_ipis() {
 }
 
 void isr_handler(int_reg_t *r) {
+    /* Page faults the VMM can fix (copy on write) just retry the access.
+       This is still the faulting CR3, and there is no LAPIC EOI to send */
+    if (r->int_num == 14) {
+        uint64_t cr2;
+        asm volatile("movq %%cr2, %0;" : "=r"(cr2));
+        if (vmm_handle_fault((void *) cr2, r->int_err)) {
+            return;
+        }
+    }
+
+    /* Bad pointers in the user copy routines just make the copy fail */
+    if ((r->int_num == 14 || r->int_num == 13) && r->cs != 0x1B && extable_fixup(r)) {
+        return;
+    }
+
     uint64_t start_tsc = read_tsc();
     uint8_t was_idle = 0;
-    if (r->int_num != 32 && r->int_num != 253 && r->int_num != 254) {
+    if (r->int_num != LAPIC_TIMER_VECTOR && r->int_num != 253 && r->int_num != 254) {
         if (get_cpu_locals()->currently_idle) {
             get_cpu_locals()->idle_tsc_count += read_tsc() - get_cpu_locals()->idle_start_tsc;
             get_cpu_locals()->currently_idle = 0;
@@ -143,7 +159,7 @@ void isr_handler(int_reg_t *r) {
         while (1) { asm volatile("hlt"); }
     }
 
-    if (r->int_num != 32 && r->int_num != 253 && r->int_num != 254) {
+    if (r->int_num != LAPIC_TIMER_VECTOR && r->int_num != 253 && r->int_num != 254) {
         get_cpu_locals()->active_tsc_count += read_tsc() - start_tsc;
         if (was_idle) {
             get_cpu_locals()->idle_start_tsc = read_tsc();
@@ -486,6 +502,7 @@ void configure_idt() {
     /* IRQ Stacks (IST index 1) */
     set_ist(32, 1);
     set_ist(33, 1);
+    set_ist(LAPIC_TIMER_VECTOR, 1);
     set_ist(254, 1);
     set_ist(253, 1);
     set_ist(250, 1);
@@ -494,10 +511,12 @@ void configure_idt() {
     register_int_handler(32, timer_handler);
     register_int_handler(33, keyboard_handler);
     register_int_handler(44, mouse_handler);
+    register_int_handler(LAPIC_TIMER_VECTOR, schedule_timer);
     register_int_handler(254, schedule);
-    register_int_handler(253, schedule_ap);
+    register_int_handler(253, schedule_ipi);
     register_int_handler(252, isr_panic_idle);
     register_int_handler(251, panic_handler);
     register_int_handler(250, set_debug_state);
+    register_int_handler(VMM_SHOOTDOWN_IPI, vmm_shootdown_handler);
     asm volatile("sti"); // Enable interrupts and hope we dont die lmao
 }
\ No newline at end of file
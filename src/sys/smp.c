@@ -52,8 +52,10 @@ uint8_t get_lapic_id() {
 }
 
 void send_ipi(uint8_t ap, uint32_t ipi_number) {
+    interrupt_state_t state = interrupt_lock(); // An interrupt handler sending an IPI can't split the ICR writes
     write_lapic(0x310, (ap << 24));
     write_lapic(0x300, ipi_number);
+    interrupt_unlock(state);
 }
 
 static void write_cpu_data32(uint16_t offset, uint32_t data) {
@@ -85,7 +87,9 @@ void launch_cpus() {
                 write_cpu_data32(0x10, (uint32_t) vmm_get_base()); // Set the cr3
                 memcpy((uint8_t *) GDT_PTR_32, (uint8_t *) (0x520 + NORMAL_VMA_OFFSET), 6); // Copy the GDT pointer
                 memcpy((uint8_t *) GDT_PTR_64, (uint8_t *) (0x530 + NORMAL_VMA_OFFSET), 10); // Copy the 64 bit GDT pointer
-                write_cpu_data64(0x40, (uint64_t) kmalloc(0x4000) + 0x4000);
+                /* The stack comes from the AP's own node, it never gets freed */
+                void *ap_stack = pmm_alloc_node(0x4000, pmm_cpu_node(cpu->apic_id));
+                write_cpu_data64(0x40, GET_HIGHER_HALF(uint64_t, ap_stack) + 0x4000);
                 write_cpu_data64(0x50, (uint64_t) long_smp_loaded);
 
                 *(volatile uint8_t *) (0x560 + NORMAL_VMA_OFFSET) = i;
@@ -116,6 +120,9 @@ void launch_cpus() {
     }
     vmm_unmap((void *) 0, 1 + ((code_size + 0x1000 - 1) / 0x1000));
     vmm_unmap((void *) (GDT64 - KERNEL_VMA_OFFSET), 1);
+
+    /* Every CPU has its locals now, so the PMM can use the per-CPU caches */
+    pmm_cpu_caches_enabled = 1;
 }
 
 void smp_entry_point() {
@@ -125,7 +132,9 @@ void smp_entry_point() {
     cpu_locals_t *cpu_locals = get_cpu_locals();
     cpu_locals->apic_id = get_lapic_id();
     cpu_locals->cpu_index = *(uint8_t *) (0x560 + NORMAL_VMA_OFFSET);
+    cpu_locals->numa_node = pmm_cpu_node(cpu_locals->apic_id);
     hashmap_set_elem(cpu_locals_list, get_cpu_index(), cpu_locals);
+    vmm_pcid_init();
 
     load_tss();
     set_panic_stack((uint64_t) kmalloc(0x1000) + 0x1000);
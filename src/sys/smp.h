@@ -4,9 +4,11 @@
 #include "proc/scheduler.h"
 #include "sys/int/idt.h"
 #include "sys/tss.h"
+#include "mm/pmm.h"
+#include "mm/vmm.h"
 
 typedef struct {
-    /* Needed. Do NOT remove or change positions. */
+    /* Needed. Do NOT remove or change positions, the assembly uses fixed gs offsets for these */
     uint64_t meta_pointer;
     uint64_t thread_kernel_stack;
     uint64_t thread_user_stack;
@@ -15,10 +17,18 @@ typedef struct {
     /* Change these ig lol */
     uint8_t apic_id;
     uint8_t cpu_index;
+    uint8_t numa_node; // Node the PMM prefers to allocate from on this CPU
     thread_t *current_thread;
     int64_t pid;
     int64_t tid;
     int64_t idle_tid; // The TID for this CPUs idle task
+    run_queue_t run_queue; // READY threads waiting for this CPU
+    uint8_t sched_online; // Set once this CPU's scheduler state is set up
+    uint64_t balance_countdown; // Schedules until this CPU next looks for an imbalance
+    uint64_t steal_failures; // Steals refused since all candidates were cache hot
+    volatile uint8_t need_resched; // A reschedule IPI came in while sched_lock was taken
+    uint64_t timer_deadline; // When the LAPIC timer is armed to fire, in us
+    uint8_t preempting; // The current thread is being preempted, not yielding
 
     uint64_t idle_tsc_count;
     uint64_t idle_start_tsc;
@@ -33,11 +43,17 @@ typedef struct {
 
     uint64_t local_dr7;
 
+    pmm_cpu_cache_t page_cache;
+
+    uint64_t active_cr3; // The address space this CPU is running, for TLB shootdowns
+    volatile uint32_t tlb_shootdown; // Set while a shootdown for this CPU isn't handled yet
+    uint64_t pcid_stale[VMM_PCID_COUNT / 64]; // PCIDs to flush the next time they're loaded here
+
     idt_gate_t idt[IDT_ENTRIES];
     tss_64_t tss;
 
     uint8_t ignore_ring;
-} __attribute__((packed)) cpu_locals_t;
+} cpu_locals_t;
 
 hashmap_t *cpu_locals_list;
 
@@ -70,9 +70,11 @@ long_smp_loaded:
     mov rax, cr0
     and ax, 0xFFFB
     or ax, 0x2
+    or rax, 1 << 16 ; Write protect, so kernel writes to COW pages fault too
     mov cr0, rax
     mov rax, cr4
     or ax, 3 << 9
+    or ax, 1 << 7 ; Global pages, kernel half entries stay in the TLB across CR3 loads
     mov cr4, rax
 
     cld
@@ -0,0 +1,124 @@
+#include "timer.h"
+#include "sys/apic.h"
+#include "sys/smp.h"
+#include "io/msr.h"
+#include "drivers/pit.h"
+#include "drivers/serial.h"
+#include <cpuid.h>
+
+#define TSC_DEADLINE_MSR 0x6E0
+#define TIMER_CALIBRATE_MS 20
+#define TIMER_MIN_US 20 // Closer deadlines are pushed out, so the interrupt can't land before we return
+
+uint8_t timer_calibrated = 0;
+static uint8_t timer_tsc_deadline = 0; // The LAPIC timer takes absolute TSC deadlines
+static uint64_t tsc_per_ms = 0;
+static uint64_t lapic_per_ms = 0; // With the divider at 16
+static uint64_t tsc_boot = 0; // TSC value at time 0
+
+/* Split so neither side can overflow, whatever the uptime */
+static uint64_t tsc_to_us(uint64_t tsc) {
+    return tsc / tsc_per_ms * 1000 + (tsc % tsc_per_ms) * 1000 / tsc_per_ms;
+}
+
+uint64_t timer_us_to_tsc(uint64_t us) {
+    return us / 1000 * tsc_per_ms + (us % 1000) * tsc_per_ms / 1000;
+}
+
+/* Time the TSC and LAPIC timer against the PIT, then stop the PIT.
+   The PIT has to be ticking. Every core shares the same clocks, so this runs once */
+void timer_calibrate() {
+    uint32_t a, b, c, d;
+    __cpuid(1, a, b, c, d);
+    timer_tsc_deadline = (c >> 24) & 1;
+
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1 << 8))) {
+        sprintf("[Timer] TSC isn't invariant, time may drift with power states\n");
+    }
+
+    write_lapic(0x3E0, 0x3); // Divide by 16
+    write_lapic(0x320, 1 << 16); // Masked one shot
+
+    sleep_no_task(1); // Start on a tick edge
+    uint64_t start_ticks = global_ticks;
+    uint64_t start_tsc = read_tsc();
+    write_lapic(0x380, 0xFFFFFFFF);
+    while (global_ticks < start_ticks + TIMER_CALIBRATE_MS) { asm volatile("pause"); }
+    uint64_t tsc_elapsed = read_tsc() - start_tsc;
+    uint32_t lapic_elapsed = 0xFFFFFFFF - read_lapic(0x390);
+    write_lapic(0x380, 0); // Stop
+
+    tsc_per_ms = tsc_elapsed / TIMER_CALIBRATE_MS;
+    lapic_per_ms = lapic_elapsed / TIMER_CALIBRATE_MS;
+    tsc_boot = read_tsc() - global_ticks * tsc_per_ms; // Carry on from the PIT's count
+    timer_calibrated = 1;
+    pit_stop();
+
+    sprintf("[Timer] TSC at %lu ticks per ms, LAPIC timer at %lu, %s\n", tsc_per_ms, lapic_per_ms,
+        timer_tsc_deadline ? "using TSC deadlines" : "using one shots");
+}
+
+/* Put this CPU's LAPIC timer in deadline or one shot mode, disarmed */
+void timer_init_cpu() {
+    if (timer_tsc_deadline) {
+        write_lapic(0x320, LAPIC_TIMER_VECTOR | (2 << 17));
+        asm volatile("mfence" ::: "memory"); // The mode switch has to land before the first deadline write
+    } else {
+        write_lapic(0x3E0, 0x3); // Divide by 16
+        write_lapic(0x320, LAPIC_TIMER_VECTOR);
+    }
+    timer_arm(TIMER_NEVER);
+}
+
+/* Interrupt this CPU at deadline_us, replacing whatever was armed */
+void timer_arm(uint64_t deadline_us) {
+    get_cpu_locals()->timer_deadline = deadline_us;
+    if (deadline_us == TIMER_NEVER) {
+        if (timer_tsc_deadline) {
+            write_msr(TSC_DEADLINE_MSR, 0);
+        } else {
+            write_lapic(0x380, 0);
+        }
+        return;
+    }
+
+    uint64_t now = timer_now_us();
+    if (deadline_us < now + TIMER_MIN_US) {
+        deadline_us = now + TIMER_MIN_US;
+    }
+
+    if (timer_tsc_deadline) {
+        write_msr(TSC_DEADLINE_MSR, tsc_boot + timer_us_to_tsc(deadline_us));
+    } else {
+        uint64_t count = (deadline_us - now) * lapic_per_ms / 1000;
+        if (count > 0xFFFFFFFF) {
+            count = 0xFFFFFFFF; // Fires early, and the handler arms the rest
+        }
+        write_lapic(0x380, count ? (uint32_t) count : 1);
+    }
+}
+
+/* Arm deadline_us unless something sooner is still pending */
+void timer_arm_before(uint64_t deadline_us) {
+    uint64_t armed = get_cpu_locals()->timer_deadline;
+    if (armed <= timer_now_us() || armed > deadline_us) {
+        timer_arm(deadline_us);
+    }
+}
+
+void timer_udelay(uint64_t us) {
+    uint64_t end = timer_now_us() + us;
+    while (timer_now_us() < end) { asm volatile("pause"); }
+}
+
+/* Microseconds since boot */
+uint64_t timer_now_us() {
+    if (!timer_calibrated) {
+        return global_ticks * 1000;
+    }
+    return tsc_to_us(read_tsc() - tsc_boot);
+}
+
+uint64_t timer_now_ms() {
+    return timer_now_us() / 1000;
+}
\ No newline at end of file
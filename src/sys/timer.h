@@ -0,0 +1,19 @@
+#ifndef TIMER_H
+#define TIMER_H
+#include <stdint.h>
+
+#define TIMER_NEVER 0xFFFFFFFFFFFFFFFF // No deadline, the timer stays quiet
+
+void timer_calibrate();
+void timer_init_cpu();
+void timer_arm(uint64_t deadline_us);
+void timer_arm_before(uint64_t deadline_us);
+void timer_udelay(uint64_t us);
+
+uint64_t timer_now_us();
+uint64_t timer_now_ms();
+uint64_t timer_us_to_tsc(uint64_t us);
+
+extern uint8_t timer_calibrated;
+
+#endif
\ No newline at end of file